@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define TRACE_LINE_SIZE 160 // Enough for the tags and all phases with 6 digit times
+
+// Fixed points of a wake cycle, in the order they normally happen
+enum TracePhase : uint8_t {
+  TRACE_WAKEUP,          // Wake-up cause read
+  TRACE_CONFIG_LOADED,   // Configuration loaded from NVS
+  TRACE_WIFI_BEGIN,      // First WiFi connection attempt started
+  TRACE_WIFI_ASSOCIATED, // Associated with the AP
+  TRACE_WIFI_GOT_IP,     // IP address ready
+  TRACE_TLS_DONE,        // TLS handshake finished (HTTPS only)
+  TRACE_HTTP_RESPONSE,   // Webhook response (or gateway/broker ack) received
+  TRACE_SLEEP,           // Entering deep sleep
+  TRACE_PHASE_COUNT
+};
+
+// What the wake cycle was, printed before the phases so lines can be grouped
+enum TraceTag : uint8_t {
+  TRACE_TAG_TRANSPORT,  // webhook, udp, espnow or mqtt
+  TRACE_TAG_CONNECTION, // cold (full connection), fast (fast reconnect) or radio (ESP-NOW)
+  TRACE_TAG_COUNT
+};
+
+/**
+ * Per-phase timestamps of the current wake cycle, to see where the time between the
+ * press and the webhook goes.
+ *
+ * traceMark() stores esp_timer_get_time() (time since the chip woke up) the first time a
+ * phase is reached, later calls are ignored so e.g. TRACE_HTTP_RESPONSE is the response to
+ * the first press. It can be called from any task. traceEnd() prints all phases as one line
+ * and keeps the line in RTC memory, where it is available as lastCycleTrace() during the
+ * next wake cycle (to report it along with the next webhook). value of traceTag() must be
+ * a string literal, only the pointer is kept.
+ */
+void traceMark(TracePhase phase);
+void traceTag(TraceTag tag, const char* value);
+void traceEnd();
+// Line of the previous wake cycle, empty after a power cycle
+const char* lastCycleTrace();
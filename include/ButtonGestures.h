@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+#include "PressEventRing.h"
+
+#define BUTTON_POLL_INTERVAL 5 // Time (ms) between samples of the pin while the button is in use
+#define BUTTON_SETTLE_TIME 20 // The pin must keep its level this long (ms) to count as pressed or released
+
+struct ButtonTiming {
+  uint32_t doublePressWindow; // After a release, how long (ms) to wait for a second press
+  uint32_t longPressTime; // Held at least this long (ms) is a long press
+  uint32_t holdTime; // Held this long (ms) calls onHold instead of reporting a gesture
+};
+
+// Both are called from the esp_timer task: keep them short and never block
+typedef void (*ButtonGestureCallback)(PressGesture gesture, uint32_t pressTime);
+typedef void (*ButtonHoldCallback)();
+
+/**
+ * Debounced button, reporting gestures.
+ *
+ * The pin interrupt is only taken for the first edge of a gesture: the ISR disables it and
+ * starts a periodic esp_timer that samples the pin until the gesture is over, so contact
+ * bounce costs no interrupts and a level only counts once it held for BUTTON_SETTLE_TIME.
+ * The interrupt is enabled again when the button is released and nothing is pending.
+ *
+ * With classify, a press is reported as GESTURE_SINGLE once no second press followed within
+ * doublePressWindow, as GESTURE_DOUBLE on the second press, and as GESTURE_LONG on release
+ * if it was held for longPressTime. pressTime is the millis() of the (first) press. Without
+ * classify every press is reported as GESTURE_SINGLE when it is released, with no other
+ * delay. Holding the button for holdTime calls onHold instead of reporting it, in both cases.
+ *
+ * wokenByPress: the press that woke us from deep sleep is already under way, from millis() 0.
+ */
+void buttonBegin(int pin, bool classify, const ButtonTiming& timing, ButtonGestureCallback onGesture,
+                 ButtonHoldCallback onHold, bool wokenByPress);
+// Detaches the interrupt and stops sampling, before deep sleep. A gesture in progress is lost
+void buttonEnd();
+// True while a gesture is in progress: pressed, or waiting for a second press
+bool buttonBusy();
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncUDP.h>
+
+/**
+ * DNS responder for the captive portal: every A query is answered with the AP address,
+ * other query types get an empty answer.
+ *
+ * Queries are answered from the AsyncUDP packet callback (lwIP side), so nothing has to
+ * be polled from loop() and a reply never waits for a page being served.
+ */
+class CaptiveDnsServer {
+public:
+  bool begin(IPAddress ip, uint16_t port);
+  void stop();
+
+private:
+  void handlePacket(AsyncUDPPacket& packet);
+
+  AsyncUDP _udp;
+  uint8_t _ip[4] = {0, 0, 0, 0};
+};
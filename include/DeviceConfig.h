@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "HttpRequest.h" // CONFIG_URL_SIZE and WebhookHeaderTable
+
+#define WEBHOOK_TARGETS 3 // Webhooks called on each press
+#define WIFI_NETWORKS 3 // WiFi networks the button can join, the first one is the main one
+
+#define CONFIG_SSID_SIZE 33 // 32 characters max (802.11)
+#define CONFIG_PASSWORD_SIZE 65 // 63 character passphrase or 64 hex digits
+#define CONFIG_METHOD_SIZE 8
+#define CONFIG_PAYLOAD_SIZE 385
+#define CONFIG_CERTIFICATE_SIZE 2049 // PEM of a single certificate
+#define CONFIG_CERTIFICATE_KEY "tls_cert" // The certificate is stored on its own, see DeviceConfig
+#define CONFIG_GATEWAY_SIZE 65
+#define CONFIG_KEY_SIZE 65
+#define CONFIG_TOPIC_SIZE 129
+#define CONFIG_USERNAME_SIZE 65
+
+// WiFi credentials, unused if ssid is empty
+struct WifiNetwork {
+  char ssid[CONFIG_SSID_SIZE];
+  char password[CONFIG_PASSWORD_SIZE];
+};
+
+// One of the webhooks called on each press, unused if url is empty
+struct WebhookTarget {
+  char url[CONFIG_URL_SIZE];
+  char method[CONFIG_METHOD_SIZE];
+  char payload[CONFIG_PAYLOAD_SIZE];
+  bool validateCertificate; // Validate the HTTPS server against the pinned certificate
+  WebhookHeaderTable headers;
+};
+
+// How presses leave the button
+enum TriggerTransport : uint8_t {
+  TRANSPORT_WEBHOOK = 0, // HTTP(S) requests to the webhooks
+  TRANSPORT_UDP = 1,     // Signed UDP datagram to a gateway on the local network
+  TRANSPORT_ESPNOW = 2,  // Signed ESP-NOW frame to a bridge, without joining the WiFi network
+  TRANSPORT_MQTT = 3     // QoS 1 publish to an MQTT broker (see MqttPublisher.h)
+};
+
+// Gateway or bridge that gets the presses instead of the webhooks (see FastTrigger.h)
+struct TriggerConfig {
+  uint8_t transport; // TriggerTransport
+  char gateway[CONFIG_GATEWAY_SIZE]; // UDP: "host:port". ESP-NOW: MAC address of the bridge
+  uint8_t channel; // ESP-NOW: WiFi channel of the bridge
+  char key[CONFIG_KEY_SIZE]; // Shared secret the messages are signed with
+};
+
+struct MqttConfig {
+  char broker[CONFIG_URL_SIZE]; // mqtt://host[:port] or mqtts://host[:port]
+  char topic[CONFIG_TOPIC_SIZE];
+  char username[CONFIG_USERNAME_SIZE]; // Optional
+  char password[CONFIG_PASSWORD_SIZE];
+  bool validateCertificate; // mqtts: validate the broker against the pinned certificate
+};
+
+/**
+ * Whole device configuration, stored in Preferences as a single blob.
+ *
+ * Loaded with one NVS read and saved with one (atomic) write, so a power loss while
+ * saving leaves the previous configuration intact. crc covers everything before it;
+ * a blob with an unknown version or a wrong size or crc is not used. The headers as
+ * typed in the form are not part of it, only the captive portal needs them. Neither is
+ * the pinned certificate (CONFIG_CERTIFICATE_KEY): it is only read when a webhook
+ * validates it, and keeping it out leaves room for the RTC copy of the configuration.
+ */
+struct DeviceConfig {
+  uint16_t version;
+  uint16_t size;
+  WifiNetwork networks[WIFI_NETWORKS]; // Joined as seen by the last scan, see setupWiFi()
+  bool webhookBatching; // Fold all pending presses into a single request
+  uint32_t batchWindow; // Extra time (ms) to wait for more presses before sending a batch
+  WebhookTarget webhooks[WEBHOOK_TARGETS];
+  uint8_t webhookGestures[WEBHOOK_TARGETS]; // Bit per PressGesture each webhook is called for, 0 for every press
+  TriggerConfig trigger;
+  MqttConfig mqtt;
+  uint32_t crc;
+};
+
+// Loads the configuration, migrating it from the per-setting keys of older firmware
+// if needed. Without any saved configuration it is left empty (method GET).
+// When waking up from deep sleep it comes from a copy in RTC memory, without reading NVS,
+// which only has the settings of the configured transport. complete reads the rest of them
+// from NVS if that is the case (for the captive portal, which shows all of them)
+void loadDeviceConfig(Preferences& preferences, DeviceConfig& config, bool complete = false);
+bool saveDeviceConfig(Preferences& preferences, DeviceConfig& config);
+// Copies a form value (trimmed) into a configuration field. Returns false, leaving the
+// field as it was, if it doesn't fit
+bool setConfigString(char* field, size_t size, String value);
+// Preferences key of the headers of a webhook as typed in the form
+const char* webhookHeadersKey(int target);
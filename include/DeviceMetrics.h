@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define METRICS_MAGIC 0x4D455431 // "MET1"
+#define METRIC_BUCKET_COUNT 8 // Histogram buckets, the last one is +Inf
+
+enum MetricCounter : uint8_t {
+  METRIC_WAKEUPS,           // Boots and wake-ups from deep sleep
+  METRIC_AP_FALLBACKS,      // WiFi never connected and the captive portal was started
+  METRIC_WIFI_FAILURES,     // Failed connection attempts, fast reconnects included
+  METRIC_WIFI_LOST,         // Connection lost while awake
+  METRIC_PRESSES_DELIVERED, // Reached every target
+  METRIC_PRESSES_DEFERRED,  // Moved to the backlog for a later wake-up
+  METRIC_PRESSES_DROPPED,   // Lost: press queue full, or oldest backlog press overwritten
+  METRIC_REQUESTS,          // Webhook requests, gateway messages and MQTT publish rounds
+  METRIC_REQUEST_ERRORS,    // No (acknowledged) response, or an HTTP status >= 400
+  METRIC_COUNTER_COUNT
+};
+
+enum MetricHistogram : uint8_t {
+  METRIC_WIFI_CONNECT_MS,  // From the first connection attempt to the IP address
+  METRIC_REQUEST_MS,       // Duration of each request
+  METRIC_PRESS_LATENCY_MS, // From the press to its delivery to every target
+  METRIC_HISTOGRAM_COUNT
+};
+
+/**
+ * Counters and small latency histograms of this unit, kept in RTC memory so they add up
+ * across deep sleep (a power cycle resets them).
+ *
+ * metricsCount() and metricsObserve() can be called from any task, they only do atomic
+ * increments. Not from the button ISR, which stays minimal: presses are counted by their
+ * sequence number instead.
+ */
+void metricsBegin();
+void metricsCount(MetricCounter counter, uint32_t amount = 1);
+void metricsObserve(MetricHistogram histogram, uint32_t ms);
+uint32_t metricsValue(MetricCounter counter);
+// Average of a histogram in ms, 0 without observations
+uint32_t metricsAverage(MetricHistogram histogram);
+// All counters and histograms in the Prometheus text format
+void metricsWrite(Print& out);
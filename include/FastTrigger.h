@@ -0,0 +1,82 @@
+#pragma once
+
+#include <Arduino.h>
+#include <IPAddress.h>
+#include "DeviceConfig.h"
+#include "PressEventRing.h"
+
+#define TRIGGER_MAGIC 0x42545247 // "GRTB" on the wire
+#define TRIGGER_VERSION 1
+#define TRIGGER_MAX_PRESSES 16 // Presses per message, more are sent in several messages
+#define TRIGGER_SIGNATURE_SIZE 16 // Truncated HMAC-SHA256
+#define TRIGGER_ATTEMPTS 5 // Sends of a message before giving up on the ack
+#define TRIGGER_AGE_UNKNOWN 0xFFFFFFFF // ageMs of a press kept across a power cycle
+#define TRIGGER_ACK_TIMEOUT 100 // Time (ms) to wait for the ack of each send
+
+enum TriggerMessageType : uint8_t {
+  TRIGGER_PRESSES = 1,
+  TRIGGER_ACK = 2
+};
+
+/**
+ * Wire format, little-endian, shared by UDP and ESP-NOW:
+ *
+ *   TriggerHeader | TriggerPress x count | HMAC-SHA256(key, all of the above), first 16 bytes
+ *
+ * The gateway answers with a TRIGGER_ACK header (count 0) with the same device and
+ * nonce, signed the same way. Retries send the same message again, so the gateway
+ * should use the press sequence numbers to skip presses it already got.
+ */
+struct __attribute__((packed)) TriggerHeader {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t type; // TriggerMessageType
+  uint8_t count; // Presses that follow
+  uint8_t reserved;
+  uint8_t device[6]; // WiFi station MAC address of the button
+  uint32_t nonce; // Random, ties the ack to the message
+};
+
+struct __attribute__((packed)) TriggerPress {
+  uint32_t sequence;
+  uint32_t ageMs; // How long ago the press happened
+};
+
+/**
+ * Sends presses to a gateway (UDP) or bridge (ESP-NOW) that does the webhook calls,
+ * instead of doing HTTP(S) from the button, and waits for them to be acknowledged.
+ *
+ * UDP still needs the WiFi connection (but no TCP or TLS). ESP-NOW only needs the radio
+ * on the channel of the bridge: no association, no DHCP.
+ */
+class TriggerSender {
+public:
+  // UDP gateway as "host:port", the host is resolved on the first send. WiFi must be connected to send
+  bool beginUdp(const char* gateway, const char* key);
+  // ESP-NOW bridge by MAC address. WiFi must be started in station mode, it doesn't need to be connected
+  bool beginEspNow(const char* bridge, uint8_t channel, const char* key);
+  // Sends up to TRIGGER_MAX_PRESSES presses. Returns true once the gateway acknowledged them
+  bool send(const PressEvent* presses, int count, unsigned long now);
+
+private:
+  void sign(const uint8_t* data, size_t length, uint8_t* signature) const;
+  bool transmit(const uint8_t* data, size_t length);
+  bool receiveAck(uint32_t nonce, uint32_t timeout);
+  bool isValidAck(const uint8_t* data, size_t length, uint32_t nonce) const;
+
+  uint8_t _transport = TRANSPORT_WEBHOOK;
+  const char* _key = "";
+  uint8_t _device[6];
+  // UDP
+  char _host[CONFIG_GATEWAY_SIZE];
+  uint16_t _port = 0;
+  IPAddress _address;
+  bool _resolved = false;
+  int _socket = -1;
+  // ESP-NOW
+  uint8_t _peer[6];
+};
+
+// Validation for the captive portal form
+bool parseUdpGateway(const char* gateway, char* host, size_t hostSize, uint16_t& port);
+bool parseMacAddress(const char* text, uint8_t* mac);
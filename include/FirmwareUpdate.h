@@ -0,0 +1,75 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WiFiClient.h>
+#include "DeviceConfig.h"
+#include "WebhookRequest.h"
+
+#define FIRMWARE_VERSION_SIZE 32
+#define FIRMWARE_MANIFEST_SIZE 512 // The whole manifest, the rest of a longer one is ignored
+#define FIRMWARE_READ_SIZE 1024 // Bytes of the image read from the connection at a time
+
+// Errors of downloadFirmware(), next to the WEBHOOK_ERROR_* of the request itself
+#define FIRMWARE_ERROR_NO_PARTITION -100
+#define FIRMWARE_ERROR_NO_MEMORY -101
+#define FIRMWARE_ERROR_BAD_RESPONSE -102 // Not a 200 with a Content-Length
+#define FIRMWARE_ERROR_CORRUPT -103 // Not gzip, or didn't decompress
+#define FIRMWARE_ERROR_WRONG_SIZE -104
+#define FIRMWARE_ERROR_WRONG_HASH -105
+#define FIRMWARE_ERROR_FLASH -106
+#define FIRMWARE_ERROR_INVALID_IMAGE -107 // Rejected by esp_ota_end()
+#define FIRMWARE_ERROR_CANCELLED -108
+#define FIRMWARE_ERROR_TIMEOUT -109
+
+/**
+ * Update manifest, a short text file next to the images:
+ *
+ *   version=1.0.3
+ *   url=https://example.com/grotbutton-1.0.3.bin.gz
+ *   size=912384
+ *   sha256=<64 hex digits>
+ *
+ * size and sha256 are those of the firmware image itself (firmware.bin), also when the
+ * url is a .gz file, which is decompressed while it is written.
+ */
+struct FirmwareManifest {
+  char version[FIRMWARE_VERSION_SIZE];
+  char url[CONFIG_URL_SIZE];
+  uint32_t size;
+  uint8_t sha256[32];
+  bool gzip; // url ends with .gz
+};
+
+// While it returns true the download waits, so presses get the connection to themselves
+typedef bool (*FirmwareDownloadPause)();
+
+/**
+ * Firmware updates into the inactive OTA partition, with rollback.
+ *
+ * An image is downloaded (and verified) without touching the running firmware, and only
+ * installed by installFirmware(), which makes the next boot start it. That boot is on
+ * probation: firmwarePendingVerify() stays true until firmwareMarkValid(), and a restart
+ * before that (a crash included) makes the bootloader go back to the previous firmware.
+ * A version that was rolled back is remembered in NVS and not installed again.
+ */
+// Once at boot. Tells if the running firmware is the one a previous update installed
+void firmwareUpdateBegin(Preferences* preferences, const char* runningVersion);
+bool firmwarePendingVerify();
+// The new firmware works, keep it
+void firmwareMarkValid();
+// The new firmware doesn't work: go back to the previous one. Restarts
+void firmwareRollBack();
+bool firmwareRejected(const char* version);
+
+bool parseFirmwareManifest(const char* text, FirmwareManifest& manifest);
+// Requests and parses the manifest. Returns the HTTP status (the manifest is only set if
+// it is 200 and valid, see valid), or a WEBHOOK_ERROR_*. The connection is kept if it can be
+int fetchFirmwareManifest(WiFiClient& client, const WebhookUrl& url, uint32_t timeout, FirmwareManifest& manifest,
+                          bool& valid);
+// Streams the image into the inactive partition and verifies it. Returns 0 or an error.
+// Gives up after deadline (millis()) or when cancel is set; the connection is closed
+int downloadFirmware(WiFiClient& client, const WebhookUrl& url, const FirmwareManifest& manifest, uint32_t timeout,
+                     uint32_t deadline, FirmwareDownloadPause pause, const volatile bool* cancel);
+// Boots the downloaded image on the next restart
+bool installFirmware(const char* version);
@@ -0,0 +1,99 @@
+#pragma once
+
+// No Arduino dependencies, so requests can also be built and checked on a host (see test/)
+#include <stddef.h>
+#include <stdint.h>
+#include "PayloadTemplate.h"
+
+#define CONFIG_URL_SIZE 257 // Webhook and MQTT broker URLs, see DeviceConfig.h
+#define MAX_WEBHOOK_HEADERS 6 // Max number of custom headers per webhook
+#define WEBHOOK_HEADERS_POOL_SIZE 256 // Space for all header names and values of a webhook (null-terminated)
+
+#define WEBHOOK_HEAD_SIZE 1280 // Request line (without the batch query) and all headers of a request
+#define WEBHOOK_AUTHORIZATION_SIZE 100 // "Basic " and the base64 of user:password from the URL
+#define WEBHOOK_USER_AGENT "ESP32HTTPClient" // What HTTPClient sent, so servers see the same client
+
+/**
+ * Webhook headers, parsed once when the configuration is saved.
+ *
+ * Stored as part of the configuration and loaded as is at boot, so sending
+ * a request doesn't need to parse (and allocate substrings of) the free text headers.
+ * Names and values are null-terminated strings packed in pool.
+ */
+struct WebhookHeaderTable {
+  uint8_t count;
+  uint16_t keyOffset[MAX_WEBHOOK_HEADERS];
+  uint16_t valueOffset[MAX_WEBHOOK_HEADERS];
+  char pool[WEBHOOK_HEADERS_POOL_SIZE];
+};
+
+// Parse free text headers (one per line, "Header: Value") into table.
+// Returns false if some headers didn't fit and were left out
+bool parseWebhookHeaders(const char* text, WebhookHeaderTable& table);
+
+/**
+ * Webhook URL split once at boot, so a request only copies its parts.
+ * path points into the URL it was parsed from, which must outlive it.
+ */
+struct WebhookUrl {
+  bool secure;
+  uint16_t port;
+  char host[CONFIG_URL_SIZE];
+  const char* path; // Path and query, might be empty or start with '?'
+  char authorization[WEBHOOK_AUTHORIZATION_SIZE]; // Empty without user:password@ in the URL
+};
+
+struct HttpHeader {
+  const char* name;
+  const char* value;
+};
+
+/**
+ * Requests are written into a buffer the caller owns (one per webhook task), and sent
+ * with a single write: no String, no allocation. The request is built in two steps so
+ * the caller can append a batch query right after the path:
+ *
+ *   writeRequestLine(out, "GET", url);  // "GET /path?a=b"
+ *   out.append("&count=2...");
+ *   writeRequestHeaders(out, ...);      // " HTTP/1.1\r\nHost: ...\r\n\r\n"
+ *
+ * Sending it and reading the response is in WebhookRequest.h.
+ */
+// http://[user:password@]host[:port][/path], or https://. Returns false if it isn't one
+bool parseWebhookUrl(const char* url, WebhookUrl& parsed);
+void writeRequestLine(PayloadWriter& out, const char* method, const WebhookUrl& url);
+// Ends the request line and writes the headers, up to the empty line. The configured
+// headers can replace User-Agent and Authorization. contentLength < 0 for no body
+void writeRequestHeaders(PayloadWriter& out, const WebhookUrl& url, const WebhookHeaderTable& headers,
+                         const HttpHeader* extra, int extraCount, long contentLength);
+
+// Everything a webhook request is built from, apart from the connection
+struct WebhookRequestParts {
+  bool post; // GET otherwise
+  const WebhookUrl* url;
+  const WebhookHeaderTable* headers;
+  const PayloadTemplate* payload; // Compiled from the configured payload
+  PayloadValues values; // pressCount, sequence and gesture are set from the presses
+  const PressEvent* presses; // Only those target didn't get yet are sent
+  int pressCount;
+  int target;
+  bool asBatch; // With the batch fields: in the body of a POST, the query of a GET
+  uint32_t now; // millis() the batch ages are counted to
+  const HttpHeader* extra;
+  int extraCount;
+};
+
+struct WebhookRequestBuild {
+  size_t length; // Of the whole request
+  size_t bodyLength; // The body is the end of the request
+  bool payloadCut; // The rendered payload didn't fit and was cut
+  bool batchWithoutPayload; // The batch body didn't fit with the payload, it has only the batch fields
+  bool queryCut; // The batch query didn't fit and was cut
+};
+
+// Builds the whole request: head, then batch query or body. The head gets the first
+// headSize bytes of request, a GET can use all of them. scratch holds the rendered payload
+// of a batch until the batch fields are added. Returns false if the head (or the batch
+// fields alone) didn't fit, the request must not be sent
+bool buildWebhookRequest(const WebhookRequestParts& parts, char* request, size_t size, size_t headSize,
+                         char* scratch, size_t scratchSize, WebhookRequestBuild& built);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef LATENCY_BENCH_CYCLES
+#define LATENCY_BENCH_CYCLES 0 // Cycles of the latency benchmark, set by the latency_bench environment. 0 for normal operation
+#endif
+#define BENCH_MAX_CYCLES 64 // Samples kept in RTC memory, see RTC_BUDGET_BENCH
+#define BENCH_SLEEP_TIME 3000 // Deep sleep (ms) between two cycles
+#define BENCH_COLD_EVERY 2 // Every Nth cycle forgets the cached connection, so it connects cold
+// Limits of the result, in ms and for every connection mode. 0 for no limit
+#ifndef BENCH_MAX_P95_MS
+#define BENCH_MAX_P95_MS 0 // Press latency p95
+#endif
+#ifndef BENCH_MAX_P99_MS
+#define BENCH_MAX_P99_MS 0 // Press latency p99
+#endif
+#ifndef BENCH_MAX_AWAKE_MS
+#define BENCH_MAX_AWAKE_MS 0 // p95 of the time from the wake-up to deep sleep
+#endif
+
+/**
+ * Latency benchmark, only in builds with LATENCY_BENCH_CYCLES.
+ *
+ * After a power-on the button runs that many wake-press-sleep cycles on its own. It sleeps
+ * for BENCH_SLEEP_TIME, and the timer wake-up is handled exactly like a button press:
+ * pressed at wake-up, sent through the configured transport. Every BENCH_COLD_EVERY-th
+ * cycle connects cold, the others use the fast reconnect. With a second GPIO wired to
+ * BUTTON_PIN (BENCH_DRIVE_PIN in main.cpp), each cycle also presses the button once more
+ * while online, over the kept-alive connection.
+ *
+ * Latency is from the press to its delivery to every target, awake time from the wake-up
+ * to deep sleep. At the end p50/p95/p99 of each are printed for every connection mode, on
+ * Serial whatever the LOG_LEVEL, followed by a single "Benchmark: PASS" line, or
+ * "Benchmark: FAIL" and what was over the BENCH_MAX_* limits (or missed). The button then
+ * sleeps until the next power-on.
+ */
+// At boot. Starts over after a power-on. True if this wake-up is a cycle of the benchmark
+bool benchBegin(bool timerWakeup);
+// Cycles are left (or about to start, after a power-on)
+bool benchRunning();
+// The current cycle has to connect without the cached connection
+bool benchColdCycle();
+// connection: cold, fast or radio for the wake press, awake for a press while online.
+// Only the first press of each kind counts. Can be called from any task
+void benchRecordPress(const char* connection, uint32_t latencyMs);
+// The current cycle has its wake press and, with awakePress, its press while online
+bool benchCycleDone(bool awakePress);
+// From goToSleep(), before each deep sleep while benchRunning(). Returns the time to sleep
+// before the next cycle. After the last one it prints the result and never returns
+uint32_t benchEndCycle(bool cycle, uint32_t awakeMs, const char* transport);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/**
+ * Serial logging that can be compiled out.
+ *
+ * Every wake cycle pays for its logs (String concatenation, USB serial writes and the
+ * delays giving the serial monitor time to attach or flush), so builds can pick a
+ * LOG_LEVEL (e.g. -DLOG_LEVEL=LOG_LEVEL_NONE in the production environment). Disabled
+ * log statements expand to nothing, their arguments are not evaluated.
+ *
+ * LOG_x(value) prints a line like Serial.println(), LOG_xF(format, ...) works like
+ * Serial.printf(). LOG_DELAY(ms) is for waits that only exist so the logs can be read.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+#define LOG_BEGIN(baud) Serial.begin(baud)
+#define LOG_FLUSH() Serial.flush()
+#define LOG_DELAY(ms) delay(ms)
+#else
+#define LOG_BEGIN(baud) do {} while (0)
+#define LOG_FLUSH() do {} while (0)
+#define LOG_DELAY(ms) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(value) Serial.println(value)
+#define LOG_ERRORF(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG_ERROR(value) do {} while (0)
+#define LOG_ERRORF(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(value) Serial.println(value)
+#define LOG_INFOF(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG_INFO(value) do {} while (0)
+#define LOG_INFOF(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(value) Serial.println(value)
+#define LOG_DEBUGF(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG_DEBUG(value) do {} while (0)
+#define LOG_DEBUGF(...) do {} while (0)
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include "DeviceConfig.h"
+#include "PressEventRing.h"
+
+#define MQTT_SESSION_MAGIC 0x4D515431 // "MQT1"
+#define MQTT_MAX_INFLIGHT 16 // Publishes waiting for their PUBACK, also the presses per publish() call
+#define MQTT_KEEP_ALIVE 120 // Seconds, longer than the time the button stays awake
+#define MQTT_TIMEOUT 5000 // Max time (ms) to wait for CONNACK or PUBACK
+
+/**
+ * Client side of the persistent MQTT session, kept in RTC memory.
+ *
+ * Publishes that were sent but not acknowledged before going to sleep stay listed
+ * with their packet ID. Their presses are still undelivered (in the backlog), and
+ * when they are published again they reuse that packet ID with the DUP flag, as
+ * MQTT 3.1.1 expects for a resumed session. key ties the session to the broker and
+ * client ID it was created with.
+ */
+struct MqttSession {
+  uint32_t magic;
+  uint32_t key;
+  uint16_t nextPacketId;
+  uint8_t inflightCount;
+  struct {
+    uint16_t packetId;
+    uint32_t sequence; // Press that was published
+  } inflight[MQTT_MAX_INFLIGHT];
+};
+
+/**
+ * Minimal MQTT 3.1.1 publisher: CONNECT with clean session off, then one QoS 1 PUBLISH
+ * per press. The publishes of a call are pipelined and then their PUBACKs collected, so
+ * many presses cost one round trip. The connection is kept open while awake.
+ *
+ * Runs over the client it is given (WiFiClient or ResumableTlsClient for mqtts).
+ */
+class MqttPublisher {
+public:
+  void begin(const MqttConfig* config, MqttSession* session, WiFiClient* client);
+  // Publishes up to MQTT_MAX_INFLIGHT presses and waits for the broker to acknowledge
+  // them. acked[i] tells which ones were. Returns false if the broker couldn't be reached
+  bool publish(const PressEvent* presses, int count, unsigned long now, bool* acked);
+  void stop();
+
+private:
+  bool connect();
+  bool writePacket(uint8_t header, const uint8_t* body, size_t length);
+  int readPacket(uint8_t& header, uint8_t* body, size_t size, uint32_t timeout);
+  uint16_t packetIdFor(uint32_t sequence, bool& duplicate);
+  void forgetInflight(uint16_t packetId);
+
+  const MqttConfig* _config = nullptr;
+  MqttSession* _session = nullptr;
+  WiFiClient* _client = nullptr;
+  char _host[CONFIG_URL_SIZE];
+  uint16_t _port = 0;
+  char _clientId[24];
+  bool _connected = false;
+};
+
+// mqtt://host[:port] (1883) or mqtts://host[:port] (8883)
+bool parseMqttBroker(const char* broker, char* host, size_t hostSize, uint16_t& port, bool& secure);
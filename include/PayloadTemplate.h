@@ -0,0 +1,131 @@
+#pragma once
+
+// No Arduino dependencies, so payloads can also be built and checked on a host
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "PressEventRing.h"
+
+#define PAYLOAD_MAX_SEGMENTS 24 // Literal and placeholder pieces of a payload template
+
+enum PayloadField : uint8_t {
+  PAYLOAD_LITERAL,
+  PAYLOAD_PRESS_COUNT, // {{press_count}}
+  PAYLOAD_SEQUENCE,    // {{sequence}}: sequence number of the newest press
+  PAYLOAD_GESTURE,     // {{gesture}}: single, double or long, of the newest press
+  PAYLOAD_RSSI,        // {{rssi}}
+  PAYLOAD_UPTIME,      // {{uptime_ms}}
+  PAYLOAD_MAC,         // {{mac}}
+  PAYLOAD_BATTERY,     // {{battery_mv}}
+  PAYLOAD_SSID         // {{ssid}}
+};
+
+struct PayloadSegment {
+  PayloadField field;
+  uint16_t offset; // Literal text, as a slice of the template
+  uint16_t length;
+};
+
+/**
+ * Payload with {{placeholders}}, split once (at boot) into literal and field segments.
+ *
+ * Rendering a request only walks the segments and writes into a caller buffer, without
+ * searching the text or allocating. Values are JSON escaped if the payload is JSON
+ * (starts with { or [). Unknown placeholders are sent as they are.
+ */
+struct PayloadTemplate {
+  const char* text; // Not copied, must outlive the template
+  uint8_t count;
+  bool json;
+  bool hasFields; // False: the payload can be sent as it is
+  PayloadSegment segments[PAYLOAD_MAX_SEGMENTS];
+};
+
+// Everything a placeholder can be replaced with
+struct PayloadValues {
+  uint32_t pressCount;
+  uint32_t sequence;
+  const char* gesture;
+  int32_t rssi;
+  uint32_t uptimeMs;
+  const char* mac;
+  int32_t batteryMv; // Negative if it can't be measured, rendered as null (JSON) or empty
+  const char* ssid;
+};
+
+// Appends to a fixed buffer, remembering if something didn't fit. Also used to build the
+// HTTP requests (see HttpRequest.h)
+struct PayloadWriter {
+  char* buffer;
+  size_t size;
+  size_t length;
+  bool overflow;
+
+  void append(const char* data, size_t dataLength) {
+    if (length + dataLength >= size) {
+      overflow = true;
+      dataLength = size - 1 - length;
+    }
+    memcpy(buffer + length, data, dataLength);
+    length += dataLength;
+  }
+
+  void append(const char* text) {
+    append(text, strlen(text));
+  }
+
+  void appendNumber(long value) {
+    char number[12];
+    append(number, snprintf(number, sizeof(number), "%ld", value));
+  }
+
+  void appendNumber(unsigned long value) {
+    char number[12];
+    append(number, snprintf(number, sizeof(number), "%lu", value));
+  }
+
+  void appendString(const char* value, bool json) {
+    if (!json) {
+      append(value, strlen(value));
+      return;
+    }
+    for (; *value != '\0'; value++) {
+      char c = *value;
+      char escaped[7];
+      switch (c) {
+        case '\\': append("\\\\", 2); break;
+        case '"': append("\\\"", 2); break;
+        case '\n': append("\\n", 2); break;
+        case '\r': append("\\r", 2); break;
+        case '\t': append("\\t", 2); break;
+        default:
+          if ((unsigned char)c < ' ') {
+            append(escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c));
+          } else {
+            append(&c, 1);
+          }
+      }
+    }
+  }
+};
+
+// Returns false if the template has too many placeholders, the rest of it is sent as it is
+bool compilePayloadTemplate(const char* text, PayloadTemplate& payload);
+// Renders into buffer (always null-terminated). Returns the length, or -1 if it didn't fit
+int renderPayload(const PayloadTemplate& payload, const PayloadValues& values, char* buffer, size_t size);
+
+// Presses of a batch that a target (bit of PressEvent::delivered) didn't get yet, the
+// others are left out of its request
+bool pressPending(const PressEvent& press, int target);
+int countPendingPresses(const PressEvent* presses, int pressCount, int target);
+// nullptr if the target got all of them
+const PressEvent* newestPendingPress(const PressEvent* presses, int pressCount, int target);
+// Batch fields for a GET request:
+// press_count=2&press_ages_ms=350,20&press_sequences=7,8&press_gestures=single,long
+int renderBatchQuery(const PressEvent* presses, int pressCount, uint32_t now, int target, char* buffer, size_t size);
+// Adds the batch fields to the (rendered) payload: merged into it if it is a JSON object,
+// otherwise the payload is wrapped (as a string) in a new object. Returns the length, or -1
+// with an empty buffer if it didn't fit: a cut body wouldn't be valid JSON
+int renderBatchPayload(const char* payload, const PressEvent* presses, int pressCount, uint32_t now, int target,
+                       char* buffer, size_t size);
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Static parts of the captive portal configuration page, kept in flash.
+ *
+ * handleRoot() streams them in order with the (HTML escaped) configuration values
+ * in between, each chunk ends right where the next value goes.
+ */
+
+static const char PORTAL_PAGE_HEAD[] PROGMEM =
+  "<html><head><title>GrotBot Configuration</title>"
+  "<meta name='viewport' content='width=device-width, initial-scale=1'>"
+  "<style>"
+  "body { font-family: Arial, sans-serif; max-width: 800px; margin: 0 auto; padding: 20px; }"
+  "h1 { color: #333; text-align: center; }"
+  "h2 { color: #444; border-bottom: 1px solid #eee; padding-bottom: 10px; }"
+  ".form-group { margin-bottom: 15px; }"
+  "label { display: block; margin-bottom: 5px; font-weight: bold; }"
+  "input[type='text'], input[type='password'], select, textarea { width: 100%; padding: 8px; box-sizing: border-box; margin-bottom: 10px; }"
+  "button { background-color: #4CAF50; color: white; padding: 10px 15px; border: none; cursor: pointer; width: 100%; font-size: 16px; }"
+  ".form-section { background: #f9f9f9; padding: 15px; border-radius: 5px; margin-bottom: 20px; }"
+  "small { display: block; margin-top: 5px; color: #666; font-size: 0.9em; }"
+  "</style></head>"
+  "<body><h1>GrotBot Configuration</h1>"
+  "<form action='/save' method='post'>"
+
+  "<div class='form-section'><h2>WiFi Settings</h2>"
+  "<div class='form-group'>"
+  "<label for='ssid'>WiFi SSID:</label>"
+  "<input type='text' id='ssid' name='ssid' maxlength='32' value='";
+
+static const char PORTAL_PAGE_AFTER_SSID[] PROGMEM =
+  "' required>"
+  "</div>"
+  "<div class='form-group'>"
+  "<label for='password'>WiFi Password:</label>"
+  "<input type='text' id='password' name='password' maxlength='64' value='";
+
+static const char PORTAL_PAGE_AFTER_PASSWORD[] PROGMEM =
+  "' required>"
+  "<small>Make sure there are no extra spaces in your password</small>"
+  "</div>";
+
+// Repeated for each other network, in order
+static const char PORTAL_PAGE_NETWORK_START[] PROGMEM =
+  "<div class='form-group'>"
+  "<label>Other WiFi SSID (optional):"
+  "<input type='text' name='network_ssid' maxlength='32' value='";
+
+static const char PORTAL_PAGE_NETWORK_AFTER_SSID[] PROGMEM =
+  "'></label>"
+  "<label>Password:"
+  "<input type='text' name='network_password' maxlength='64' value='";
+
+static const char PORTAL_PAGE_NETWORK_END[] PROGMEM =
+  "'></label>"
+  "</div>";
+
+static const char PORTAL_PAGE_AFTER_NETWORKS[] PROGMEM =
+  "<small>The button joins whichever of these networks is in range, preferring the last one that worked</small>"
+  "</div>"
+
+  "<div class='form-section'><h2>Delivery</h2>"
+  "<div class='form-group'>"
+  "<label for='trigger_transport'>Send Presses To:</label>"
+  "<select id='trigger_transport' name='trigger_transport'>"
+  "<option value='0'";
+
+static const char PORTAL_PAGE_AFTER_TRANSPORT_WEBHOOK[] PROGMEM =
+  ">The webhooks below (HTTP/HTTPS)</option>"
+  "<option value='1'";
+
+static const char PORTAL_PAGE_AFTER_TRANSPORT_UDP[] PROGMEM =
+  ">A gateway on the local network (UDP)</option>"
+  "<option value='2'";
+
+static const char PORTAL_PAGE_AFTER_TRANSPORT_ESPNOW[] PROGMEM =
+  ">An ESP-NOW bridge (no WiFi connection)</option>"
+  "<option value='3'";
+
+static const char PORTAL_PAGE_AFTER_TRANSPORT_MQTT[] PROGMEM =
+  ">An MQTT broker</option>"
+  "</select>"
+  "<small>A gateway or bridge gets the press much faster and calls the webhooks itself. "
+  "MQTT publishes each press with QoS 1</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='trigger_gateway'>Gateway:</label>"
+  "<input type='text' id='trigger_gateway' name='trigger_gateway' maxlength='64' value='";
+
+static const char PORTAL_PAGE_AFTER_GATEWAY[] PROGMEM =
+  "'>"
+  "<small>UDP: host:port. ESP-NOW: MAC address of the bridge (AA:BB:CC:DD:EE:FF)</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='trigger_channel'>ESP-NOW Channel:</label>"
+  "<input type='text' id='trigger_channel' name='trigger_channel' value='";
+
+static const char PORTAL_PAGE_AFTER_CHANNEL[] PROGMEM =
+  "'>"
+  "<small>WiFi channel the bridge listens on</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='trigger_key'>Shared Key:</label>"
+  "<input type='text' id='trigger_key' name='trigger_key' maxlength='64' value='";
+
+static const char PORTAL_PAGE_AFTER_KEY[] PROGMEM =
+  "'>"
+  "<small>Messages to the gateway or bridge are signed with it, it must know the same key</small>"
+  "</div></div>"
+
+  "<div class='form-section'><h2>MQTT Settings</h2>"
+  "<div class='form-group'>"
+  "<label for='mqtt_broker'>Broker:</label>"
+  "<input type='text' id='mqtt_broker' name='mqtt_broker' maxlength='256' value='";
+
+static const char PORTAL_PAGE_AFTER_MQTT_BROKER[] PROGMEM =
+  "'>"
+  "<small>mqtt://host[:port] or mqtts://host[:port] (default ports 1883 and 8883)</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='mqtt_topic'>Topic:</label>"
+  "<input type='text' id='mqtt_topic' name='mqtt_topic' maxlength='128' value='";
+
+static const char PORTAL_PAGE_AFTER_MQTT_TOPIC[] PROGMEM =
+  "'>"
+  "<small>Each press is published as {\"sequence\":N,\"age_ms\":N,\"wakeup\":true|false}</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='mqtt_username'>Username (optional):</label>"
+  "<input type='text' id='mqtt_username' name='mqtt_username' maxlength='64' value='";
+
+static const char PORTAL_PAGE_AFTER_MQTT_USERNAME[] PROGMEM =
+  "'>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='mqtt_password'>Password (optional):</label>"
+  "<input type='text' id='mqtt_password' name='mqtt_password' maxlength='64' value='";
+
+static const char PORTAL_PAGE_AFTER_MQTT_PASSWORD[] PROGMEM =
+  "'>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='mqtt_validate'>Validate Broker Certificate:</label>"
+  "<select id='mqtt_validate' name='mqtt_validate'>"
+  "<option value='0'";
+
+static const char PORTAL_PAGE_AFTER_MQTT_VALIDATE_OFF[] PROGMEM =
+  ">No</option>"
+  "<option value='1'";
+
+static const char PORTAL_PAGE_AFTER_MQTT_VALIDATE_ON[] PROGMEM =
+  ">Yes, with the server certificate below</option>"
+  "</select>"
+  "</div></div>"
+
+  "<div class='form-section'><h2>Webhook Settings</h2>"
+  "<div class='form-group'>"
+  "<label for='webhook_batch'>Multiple Presses:</label>"
+  "<select id='webhook_batch' name='webhook_batch'>"
+  "<option value='0'";
+
+static const char PORTAL_PAGE_AFTER_BATCH_OFF[] PROGMEM =
+  ">One request per press</option>"
+  "<option value='1'";
+
+static const char PORTAL_PAGE_AFTER_BATCH_ON[] PROGMEM =
+  ">Batch presses into one request</option>"
+  "</select>"
+  "<label for='batch_window'>Batch Window (ms):</label>"
+  "<input type='text' id='batch_window' name='batch_window' value='";
+
+static const char PORTAL_PAGE_AFTER_BATCH_WINDOW[] PROGMEM =
+  "'>"
+  "<small>When batching, presses during a request (and during this window after the first press) are sent together with their count and timestamps</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label for='tls_cert'>Server Certificate (optional, PEM):</label>"
+  "<textarea id='tls_cert' name='tls_cert' rows='4' maxlength='2048'>";
+
+static const char PORTAL_PAGE_AFTER_CERTIFICATE[] PROGMEM =
+  "</textarea>"
+  "<small>CA or server certificate used to validate the HTTPS webhooks (or the mqtts broker) that ask for it</small>"
+  "</div></div>";
+
+// Repeated for each webhook. Fields have the same names in every section, the form
+// sends them in order
+static const char PORTAL_PAGE_WEBHOOK_START[] PROGMEM =
+  "<div class='form-section'><h2>Webhook ";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_NUMBER[] PROGMEM =
+  "</h2>"
+  "<div class='form-group'>"
+  "<label>Webhook URL:"
+  "<input type='text' name='webhook' maxlength='256' value='";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_URL[] PROGMEM =
+  "'></label>"
+  "<small>Leave empty to not use this webhook</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label>HTTP Method:"
+  "<select name='webhook_method'>"
+  "<option value='GET'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_GET[] PROGMEM =
+  ">GET</option>"
+  "<option value='POST'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_POST[] PROGMEM =
+  ">POST</option>"
+  "</select></label>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label>Called For:"
+  "<select name='webhook_gesture'>"
+  "<option value='0'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_ANY[] PROGMEM =
+  ">Every press</option>"
+  "<option value='1'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_SINGLE[] PROGMEM =
+  ">Single presses</option>"
+  "<option value='2'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_DOUBLE[] PROGMEM =
+  ">Double presses</option>"
+  "<option value='4'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_LONG[] PROGMEM =
+  ">Long presses</option>"
+  "</select></label>"
+  "<small>Telling presses apart waits a moment after a short press to see if a second one follows</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label>Headers (one per line):"
+  "<textarea name='webhook_headers' rows='4'>";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_HEADERS[] PROGMEM =
+  "</textarea></label>"
+  "<small>Example: Content-Type: application/json</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label>Request Payload (for POST requests):"
+  "<textarea name='webhook_payload' rows='4' maxlength='384'>";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_PAYLOAD[] PROGMEM =
+  "</textarea></label>"
+  "<small>For JSON, use regular quotes (no escape characters). "
+  "Placeholders: {{press_count}}, {{sequence}}, {{gesture}}, {{rssi}}, {{uptime_ms}}, {{mac}}, {{battery_mv}}, {{ssid}}</small>"
+  "</div>"
+
+  "<div class='form-group'>"
+  "<label>Validate Server Certificate:"
+  "<select name='webhook_validate'>"
+  "<option value='0'";
+
+static const char PORTAL_PAGE_WEBHOOK_AFTER_VALIDATE_OFF[] PROGMEM =
+  ">No</option>"
+  "<option value='1'";
+
+static const char PORTAL_PAGE_WEBHOOK_END[] PROGMEM =
+  ">Yes, with the server certificate above</option>"
+  "</select></label>"
+  "</div></div>";
+
+static const char PORTAL_PAGE_TAIL[] PROGMEM =
+  "<button type='submit'>Save and Connect</button>"
+  "</form></body></html>";
+
+static const char PORTAL_SAVED_PAGE[] PROGMEM =
+  "<!DOCTYPE html>"
+  "<html>"
+  "<head>"
+  "<title>Configuration Saved</title>"
+  "<meta name='viewport' content='width=device-width, initial-scale=1'>"
+  "<style>"
+  "body { font-family: Arial, sans-serif; margin: 20px; text-align: center; }"
+  "h1 { color: #4CAF50; }"
+  "</style>"
+  "</head>"
+  "<body>"
+  "<h1>Configuration Saved!</h1>"
+  "<p>The device will now restart and attempt to connect to the WiFi network.</p>"
+  "</body>"
+  "</html>";
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "PressEventRing.h"
+
+#define BACKLOG_RTC_SIZE 32 // Presses kept in RTC memory before spilling to flash
+#define BACKLOG_NVS_SIZE 128 // Presses kept in flash, the oldest ones are overwritten when full
+#define BACKLOG_MAX_PRESSES (BACKLOG_RTC_SIZE + BACKLOG_NVS_SIZE)
+
+/**
+ * Presses that could not be delivered (no WiFi, request failed), kept until the next
+ * successful connection.
+ *
+ * New presses go to a ring in RTC memory, which survives deep sleep for free. When it
+ * is full its contents are moved in one write to a bigger ring stored in Preferences,
+ * which also survives power loss. Press times are stored as RTC time (which keeps
+ * counting during deep sleep) so their age is still known after sleeping. A power cycle
+ * restarts that clock: presses kept in flash across one come back with ageUnknown set.
+ */
+void backlogBegin(Preferences* preferences);
+void backlogAdd(const PressEvent& press);
+uint32_t backlogSize();
+// Copies all deferred presses, oldest first, with timestamps converted back to millis()
+int backlogLoad(PressEvent* presses, int maxPresses);
+void backlogClear();
+// Replaces the whole backlog with these presses, oldest first (those a flush didn't deliver).
+// Never clears it first, so a reset while replacing it loses nothing
+void backlogReplace(const PressEvent* presses, int pressCount);
+// Moves the presses kept in RTC memory to flash, before a restart (which clears RTC memory)
+void backlogPersist();
+
+// Milliseconds of RTC time, keeps counting across deep sleep
+int64_t rtcTimeMs();
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+
+enum PressType : uint8_t {
+  PRESS_SINGLE = 0, // Regular press while awake
+  PRESS_WAKEUP = 1  // Press that woke the device up from deep sleep
+};
+
+// How the button was pressed, see ButtonGestures.h
+enum PressGesture : uint8_t {
+  GESTURE_SINGLE = 0,
+  GESTURE_DOUBLE = 1, // Pressed again right after releasing it
+  GESTURE_LONG = 2,   // Held down for a while
+  GESTURE_COUNT
+};
+
+inline const char* gestureName(uint8_t gesture) {
+  switch (gesture) {
+    case GESTURE_DOUBLE: return "double";
+    case GESTURE_LONG: return "long";
+    default: return "single";
+  }
+}
+
+struct PressEvent {
+  uint32_t sequence; // Keeps counting across deep sleep, identifies the press
+  uint32_t timestamp; // millis() of the press
+  PressType type;
+  uint8_t delivered; // Webhooks (bit per target) that already got this press, or don't want it
+  PressGesture gesture;
+  bool ageUnknown; // Kept in flash across a power cycle, which restarted the clock its time was counted on
+};
+
+/**
+ * Single-producer/single-consumer ring of button presses.
+ *
+ * The button (gesture callback) is the only producer (push) and loop() the only
+ * consumer (peek/pop), so no locks are needed: each side only writes its own index
+ * and publishes it with release/acquire ordering. push() is always inlined so it
+ * can also be used from an IRAM interrupt handler. When the ring is full new presses
+ * are not stored, only counted in dropped().
+ */
+template <uint32_t Size>
+class PressEventRing {
+  static_assert((Size & (Size - 1)) == 0, "PressEventRing size must be a power of two");
+
+public:
+  inline __attribute__((always_inline)) bool push(const PressEvent& event) {
+    uint32_t head = _head;
+    if (head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) >= Size) {
+      _dropped++;
+      return false;
+    }
+    _events[head & (Size - 1)] = event;
+    __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  bool peek(PressEvent& event) const {
+    uint32_t tail = _tail;
+    if (tail == __atomic_load_n(&_head, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    event = _events[tail & (Size - 1)];
+    return true;
+  }
+
+  bool pop(PressEvent& event) {
+    if (!peek(event)) {
+      return false;
+    }
+    __atomic_store_n(&_tail, _tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  uint32_t size() const {
+    return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) - _tail;
+  }
+
+  uint32_t dropped() const {
+    return __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+  }
+
+private:
+  PressEvent _events[Size];
+  uint32_t _head = 0; // Only written by the producer
+  uint32_t _tail = 0; // Only written by the consumer
+  uint32_t _dropped = 0; // Only written by the producer
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/x509_crt.h>
+
+#define TLS_SESSION_CACHE_MAGIC 0x544C5331 // "TLS1"
+#define TLS_SESSION_CACHE_SIZE 2048 // Serialized session incl. the peer certificate when mbedtls keeps it
+
+/**
+ * Serialized TLS session (session ID and/or ticket) from the last full handshake.
+ *
+ * Meant to live in RTC memory so the next wake-up can resume the session
+ * (abbreviated handshake) instead of paying for a full one. key ties the session
+ * to the host and pinned certificate it was negotiated with.
+ */
+struct TlsSessionCache {
+  uint32_t magic;
+  uint32_t key;
+  uint16_t length;
+  uint8_t data[TLS_SESSION_CACHE_SIZE];
+};
+
+/**
+ * Drop-in replacement for WiFiClientSecure that can be passed to HTTPClient.
+ *
+ * WiFiClientSecure doesn't let us hand a previous session to mbedtls before the
+ * handshake, so this runs mbedtls directly on top of the WiFiClient TCP socket:
+ * - Sessions are resumed from (and saved to) a TlsSessionCache
+ * - A pinned certificate can be set: if it is a CA the server chain is validated
+ *   against it, otherwise the server leaf certificate must match it exactly.
+ *   Without a pinned certificate nothing is validated (same as setInsecure())
+ */
+class ResumableTlsClient : public WiFiClient {
+public:
+  ResumableTlsClient();
+  ~ResumableTlsClient();
+  ResumableTlsClient(const ResumableTlsClient&) = delete;
+  ResumableTlsClient& operator=(const ResumableTlsClient&) = delete;
+
+  // Without update the cached session is only offered, never replaced or cleared: for
+  // background connections that mustn't evict the session the presses resume
+  void setSessionCache(TlsSessionCache* cache, bool update = true) {
+    _sessionCache = cache;
+    _updateSessionCache = update;
+  }
+  // Parses the PEM certificate to pin. Returns false (and stays unpinned) if it is invalid
+  bool setPinnedCertificate(const char* pem);
+  bool isPinned() const { return _pinned; }
+  // True if the last handshake resumed a cached session
+  bool sessionResumed() const { return _sessionResumed; }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+  int connect(const char* host, uint16_t port) override;
+  int connect(const char* host, uint16_t port, int32_t timeout) override;
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t* buf, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t* buf, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() { return connected(); }
+
+  using Print::write;
+
+private:
+  int startTls(const char* host, int32_t timeout);
+  void freeTls();
+  bool restoreSession(uint32_t key);
+  void saveSession(uint32_t key);
+  uint32_t sessionKey(const char* host) const;
+  static int verifyPinnedLeaf(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags);
+
+  mbedtls_ssl_context _ssl;
+  mbedtls_ssl_config _conf;
+  mbedtls_net_context _net;
+  mbedtls_x509_crt _pinnedCert;
+  bool _pinned = false;
+  bool _tlsActive = false;
+  bool _sessionResumed = false;
+  int _peek = -1;
+  TlsSessionCache* _sessionCache = nullptr;
+  bool _updateSessionCache = true;
+};
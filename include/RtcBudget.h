@@ -0,0 +1,25 @@
+#pragma once
+
+/**
+ * Shares of the RTC memory (RTC_DATA_ATTR) that survives deep sleep.
+ *
+ * The ESP32-C3 only has 8KB of it, and IDF keeps some for itself (the wake stub and its
+ * own RTC data). Each module checks what it keeps there against its share with a
+ * static_assert next to the definition, so growing a struct fails the build where it is
+ * defined instead of overflowing the RTC segment at link time (or breaking wake-ups).
+ */
+#define RTC_BUDGET_CONFIG 1536 // Packed copy of the configuration, see DeviceConfig.cpp
+#define RTC_BUDGET_TLS_SESSION 2064 // TlsSessionCache, serialized session and peer certificate
+#define RTC_BUDGET_BACKLOG 544 // Presses that didn't go out, see PressBacklog.cpp
+#define RTC_BUDGET_METRICS 384 // Counters and histograms, see DeviceMetrics.cpp
+#define RTC_BUDGET_BOOT_TRACE 160 // Timings of the previous wake cycle
+#define RTC_BUDGET_WIFI 128 // Connection and scan caches
+#define RTC_BUDGET_MQTT 160 // MqttSession
+#define RTC_BUDGET_MISC 96 // Counters, TX power level and firmware update state of main.cpp
+#define RTC_BUDGET_BENCH 520 // Samples of the latency benchmark, 8 bytes per cycle (only used by its builds)
+
+#define RTC_BUDGET_TOTAL                                                                                 \
+  (RTC_BUDGET_CONFIG + RTC_BUDGET_TLS_SESSION + RTC_BUDGET_BACKLOG + RTC_BUDGET_METRICS +                \
+   RTC_BUDGET_BOOT_TRACE + RTC_BUDGET_WIFI + RTC_BUDGET_MQTT + RTC_BUDGET_MISC + RTC_BUDGET_BENCH)
+// Leaves 2KB of the 8KB to IDF and to alignment
+static_assert(RTC_BUDGET_TOTAL <= 6144, "The RTC memory shares add up to more than the ESP32-C3 can spare");
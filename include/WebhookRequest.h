@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include "HttpRequest.h"
+
+// Errors, with the codes HTTPClient used so results and logs don't change
+#define WEBHOOK_ERROR_CONNECTION_REFUSED -1
+#define WEBHOOK_ERROR_SEND_FAILED -3
+#define WEBHOOK_ERROR_NOT_CONNECTED -4 // Closed before any of the response arrived
+#define WEBHOOK_ERROR_CONNECTION_LOST -5
+#define WEBHOOK_ERROR_NO_HTTP_SERVER -7
+#define WEBHOOK_ERROR_TOO_LONG -8
+#define WEBHOOK_ERROR_READ_TIMEOUT -11
+
+struct ResponseHead {
+  bool keepAlive;
+  bool chunked;
+  long contentLength; // -1 if the response didn't say
+};
+
+// Waits until something can be read. Returns 0, or an error if the connection closed or
+// nothing came in time
+int waitResponseData(WiFiClient& client, uint32_t timeout);
+// Reads the status line and headers of a response, leaving the body unread. Returns the
+// status code or an error, WEBHOOK_ERROR_NOT_CONNECTED if the connection closed before
+// any of it arrived
+int readResponseHead(WiFiClient& client, uint32_t timeout, ResponseHead& head);
+// Reads the response to a request: status line, headers and, if readBody, the body (its
+// first previewSize - 1 bytes are kept in preview). Returns the status code or an error.
+// reusable tells if the connection can carry the next request (keep-alive, and nothing
+// of this response left unread)
+int readWebhookResponse(WiFiClient& client, uint32_t timeout, bool readBody, bool& reusable,
+                        char* preview, size_t previewSize);
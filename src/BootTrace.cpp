@@ -0,0 +1,54 @@
+#include "BootTrace.h"
+
+#include <esp_timer.h>
+#include "Log.h"
+#include "RtcBudget.h"
+
+static const char* const TRACE_PHASE_NAMES[TRACE_PHASE_COUNT] = {
+  "wake", "cfg", "wifi", "assoc", "ip", "tls", "http", "sleep"
+};
+
+static const char* const TRACE_TAG_NAMES[TRACE_TAG_COUNT] = {"via", "conn"};
+
+static int64_t traceTimes[TRACE_PHASE_COUNT]; // 0 = phase not reached
+static const char* traceTags[TRACE_TAG_COUNT];
+static_assert(TRACE_LINE_SIZE <= RTC_BUDGET_BOOT_TRACE, "The boot trace is over its share of RTC memory");
+RTC_DATA_ATTR static char lastTraceLine[TRACE_LINE_SIZE];
+
+void traceMark(TracePhase phase) {
+  if (traceTimes[phase] == 0) {
+    traceTimes[phase] = esp_timer_get_time();
+  }
+}
+
+void traceTag(TraceTag tag, const char* value) {
+  traceTags[tag] = value;
+}
+
+void traceEnd() {
+  traceMark(TRACE_SLEEP);
+
+  // "via=webhook conn=fast wake=1002 cfg=1010 ..." in ms since wake-up, tags that were not
+  // set and phases that were not reached are left out
+  int length = 0;
+  for (int i = 0; i < TRACE_TAG_COUNT; i++) {
+    if (traceTags[i] != nullptr) {
+      length += snprintf(lastTraceLine + length, TRACE_LINE_SIZE - length, "%s%s=%s",
+                         length > 0 ? " " : "", TRACE_TAG_NAMES[i], traceTags[i]);
+    }
+  }
+  for (int i = 0; i < TRACE_PHASE_COUNT && length < TRACE_LINE_SIZE; i++) {
+    if (traceTimes[i] == 0) {
+      continue;
+    }
+    length += snprintf(lastTraceLine + length, TRACE_LINE_SIZE - length, "%s%s=%lu",
+                       length > 0 ? " " : "", TRACE_PHASE_NAMES[i],
+                       (unsigned long)(traceTimes[i] / 1000));
+  }
+  LOG_INFOF("Trace: %s\n", lastTraceLine);
+}
+
+const char* lastCycleTrace() {
+  lastTraceLine[TRACE_LINE_SIZE - 1] = '\0';
+  return lastTraceLine;
+}
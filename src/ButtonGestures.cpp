@@ -0,0 +1,152 @@
+#include "ButtonGestures.h"
+
+#include <driver/gpio.h>
+#include <esp_timer.h>
+
+// Set by buttonBegin(), read by the ISR
+DRAM_ATTR static gpio_num_t buttonPin;
+DRAM_ATTR static esp_timer_handle_t pollTimer = nullptr;
+static volatile bool polling = false; // pollButton() is running, the interrupt is off
+
+// Only used by pollButton() once the button is set up
+static bool classifyGestures;
+static ButtonTiming gestureTiming;
+static ButtonGestureCallback gestureCallback;
+static ButtonHoldCallback holdCallback;
+static bool sampledDown = false; // Last sample of the pin
+static uint32_t sampleChanged = 0; // When the samples last changed level
+static bool down = false; // Debounced state
+static uint32_t pressStart = 0; // Of the current, or last, press
+static uint32_t releaseTime = 0; // Of the last press
+static uint32_t gestureStart = 0; // First press of the gesture being classified
+static uint8_t pendingPresses = 0; // Presses of that gesture, 0 once it is reported
+static bool holdReported = false; // The current press reached holdTime
+
+static void report(PressGesture gesture, uint32_t time) {
+  pendingPresses = 0;
+  gestureCallback(gesture, time);
+}
+
+static void onPressed(uint32_t now) {
+  pressStart = now;
+  holdReported = false;
+  if (!classifyGestures) {
+    pendingPresses = 1; // Reported on release, unless it turns into a hold
+    return;
+  }
+  if (pendingPresses++ == 0) {
+    gestureStart = now;
+  } else {
+    report(GESTURE_DOUBLE, gestureStart);
+  }
+}
+
+static void onReleased(uint32_t now) {
+  releaseTime = now;
+  if (!classifyGestures) {
+    if (pendingPresses > 0) {
+      report(GESTURE_SINGLE, pressStart);
+    }
+    return;
+  }
+  if (pendingPresses > 0 && now - pressStart >= gestureTiming.longPressTime) {
+    report(GESTURE_LONG, pressStart);
+  }
+}
+
+static void startPolling() {
+  gpio_intr_disable(buttonPin);
+  polling = true;
+  esp_timer_start_periodic(pollTimer, BUTTON_POLL_INTERVAL * 1000);
+}
+
+static void pollButton(void*) {
+  uint32_t now = millis();
+  bool sample = gpio_get_level(buttonPin) == 0;
+  if (sample != sampledDown) {
+    sampledDown = sample;
+    sampleChanged = now;
+  }
+  if (sample != down && now - sampleChanged >= BUTTON_SETTLE_TIME) {
+    down = sample;
+    if (down) {
+      onPressed(sampleChanged);
+    } else {
+      onReleased(sampleChanged);
+    }
+  }
+
+  if (down) {
+    if (!holdReported && now - pressStart >= gestureTiming.holdTime) {
+      // A hold is not a press, whatever it started as
+      holdReported = true;
+      pendingPresses = 0;
+      holdCallback();
+    }
+    return;
+  }
+  if (pendingPresses > 0) {
+    if (now - releaseTime < gestureTiming.doublePressWindow) {
+      return;
+    }
+    report(GESTURE_SINGLE, gestureStart);
+  }
+  if (sampledDown) {
+    return; // Still bouncing
+  }
+
+  // Idle again, the next press is caught by the interrupt
+  esp_timer_stop(pollTimer);
+  polling = false;
+  gpio_intr_enable(buttonPin);
+  if (gpio_get_level(buttonPin) == 0) {
+    startPolling(); // Pressed before the interrupt was back, it might have missed the edge
+  }
+}
+
+static void IRAM_ATTR buttonISR() {
+  // Only the first edge: bounce and the release are sampled by pollButton()
+  gpio_intr_disable(buttonPin);
+  polling = true;
+  esp_timer_start_periodic(pollTimer, BUTTON_POLL_INTERVAL * 1000);
+}
+
+void buttonBegin(int pin, bool classify, const ButtonTiming& timing, ButtonGestureCallback onGesture,
+                 ButtonHoldCallback onHold, bool wokenByPress) {
+  buttonPin = (gpio_num_t)pin;
+  classifyGestures = classify;
+  gestureTiming = timing;
+  gestureCallback = onGesture;
+  holdCallback = onHold;
+
+  if (pollTimer == nullptr) {
+    esp_timer_create_args_t args = {};
+    args.callback = pollButton;
+    args.name = "button";
+    esp_timer_create(&args, &pollTimer);
+  }
+
+  pinMode(pin, INPUT_PULLUP);
+  attachInterrupt(pin, buttonISR, FALLING);
+  if (wokenByPress) {
+    sampledDown = true;
+    down = true;
+    sampleChanged = 0;
+    onPressed(0);
+    startPolling();
+  } else if (digitalRead(pin) == LOW) {
+    startPolling(); // Held since boot, e.g. to open the captive portal
+  }
+}
+
+void buttonEnd() {
+  detachInterrupt(buttonPin);
+  if (pollTimer != nullptr) {
+    esp_timer_stop(pollTimer);
+  }
+  polling = false;
+}
+
+bool buttonBusy() {
+  return polling;
+}
@@ -0,0 +1,73 @@
+#include "CaptiveDnsServer.h"
+
+#include "Log.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_PACKET_SIZE 512 // Plain UDP DNS
+#define DNS_ANSWER_SIZE 16 // Name pointer, type, class, TTL, length and the IPv4 address
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+#define DNS_ANSWER_TTL 60 // Seconds, short so clients don't keep the AP address once configured
+
+bool CaptiveDnsServer::begin(IPAddress ip, uint16_t port) {
+  for (int i = 0; i < 4; i++) {
+    _ip[i] = ip[i];
+  }
+  if (!_udp.listen(port)) {
+    LOG_ERROR("DNS: could not listen for queries");
+    return false;
+  }
+  _udp.onPacket([this](AsyncUDPPacket& packet) { handlePacket(packet); });
+  return true;
+}
+
+void CaptiveDnsServer::stop() {
+  _udp.close();
+}
+
+void CaptiveDnsServer::handlePacket(AsyncUDPPacket& packet) {
+  const uint8_t* query = packet.data();
+  size_t length = packet.length();
+
+  // Only standard queries with a single question
+  if (length < DNS_HEADER_SIZE || length > DNS_MAX_PACKET_SIZE ||
+      (query[2] & 0x80) != 0 || (query[2] & 0x78) != 0 || query[4] != 0 || query[5] != 1) {
+    return;
+  }
+
+  // The question is the name (length prefixed labels ending with a zero), type and class
+  size_t questionEnd = DNS_HEADER_SIZE;
+  while (questionEnd < length && query[questionEnd] != 0) {
+    if ((query[questionEnd] & 0xC0) != 0) {
+      return; // No compressed names in a question
+    }
+    questionEnd += query[questionEnd] + 1;
+  }
+  questionEnd += 5;
+  if (questionEnd > length) {
+    return;
+  }
+  uint16_t type = (query[questionEnd - 4] << 8) | query[questionEnd - 3];
+
+  // The reply repeats the header and question, extra records in the query are dropped
+  uint8_t reply[DNS_MAX_PACKET_SIZE + DNS_ANSWER_SIZE];
+  memcpy(reply, query, questionEnd);
+  reply[2] = 0x80 | (query[2] & 0x01); // Response, keep "recursion desired"
+  reply[3] = 0x80; // Recursion available, no error
+  memset(reply + 6, 0, 6); // No answer, authority or additional records (yet)
+  size_t replyLength = questionEnd;
+
+  if (type == DNS_TYPE_A) {
+    reply[7] = 1;
+    const uint8_t answer[DNS_ANSWER_SIZE] = {
+      0xC0, DNS_HEADER_SIZE, // Name: pointer to the one in the question
+      0, DNS_TYPE_A, 0, DNS_CLASS_IN,
+      0, 0, 0, DNS_ANSWER_TTL,
+      0, 4, _ip[0], _ip[1], _ip[2], _ip[3]
+    };
+    memcpy(reply + replyLength, answer, sizeof(answer));
+    replyLength += sizeof(answer);
+  }
+
+  packet.write(reply, replyLength);
+}
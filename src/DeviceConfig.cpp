@@ -0,0 +1,276 @@
+#include "DeviceConfig.h"
+
+#include <esp_rom_crc.h>
+#include <esp_system.h>
+#include "Log.h"
+#include "RtcBudget.h"
+
+#define CONFIG_VERSION 1
+#define CONFIG_NVS_KEY "config"
+
+// What a wake-up needs of the last loaded or saved configuration, used instead of NVS
+// when waking up from deep sleep: only the settings of the configured transport, packed
+// (strings without their unused space, see packConfig()). Checked with a crc, so it is
+// ignored after a power cycle or a firmware with a different layout. A configuration that
+// doesn't fit (e.g. three webhooks with long payloads) has no copy, wake-ups then read NVS
+#define RTC_CONFIG_DATA_SIZE (RTC_BUDGET_CONFIG - 8)
+struct RtcConfig {
+  uint16_t version;
+  uint16_t length; // Of data, 0 without a copy
+  uint32_t crc;
+  uint8_t data[RTC_CONFIG_DATA_SIZE];
+};
+static_assert(sizeof(RtcConfig) <= RTC_BUDGET_CONFIG, "RtcConfig is over its share of RTC memory");
+RTC_DATA_ATTR static RtcConfig rtcConfig;
+static bool configFromRtc = false; // The loaded configuration only has what the transport needs
+
+static uint32_t configCrc(const DeviceConfig& config) {
+  return esp_rom_crc32_le(0, (const uint8_t*)&config, offsetof(DeviceConfig, crc));
+}
+
+// Sanity check for tables loaded from flash, so a corrupt blob can't point outside the pool
+static bool isValidHeaderTable(const WebhookHeaderTable& table) {
+    if (table.count > MAX_WEBHOOK_HEADERS || table.pool[sizeof(table.pool) - 1] != '\0') {
+        return false;
+    }
+    for (int i = 0; i < table.count; i++) {
+        if (table.keyOffset[i] >= sizeof(table.pool) || table.valueOffset[i] >= sizeof(table.pool)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// WiFi.begin() and the request code need the strings to be terminated
+#define IS_TERMINATED(field) ((field)[sizeof(field) - 1] == '\0')
+
+static bool isValidConfig(const DeviceConfig& config) {
+  if (config.version != CONFIG_VERSION || config.size != sizeof(DeviceConfig) || config.crc != configCrc(config) ||
+      !IS_TERMINATED(config.trigger.gateway) || !IS_TERMINATED(config.trigger.key) ||
+      !IS_TERMINATED(config.mqtt.broker) || !IS_TERMINATED(config.mqtt.topic) ||
+      !IS_TERMINATED(config.mqtt.username) || !IS_TERMINATED(config.mqtt.password)) {
+    return false;
+  }
+  for (const WifiNetwork& network : config.networks) {
+    if (!IS_TERMINATED(network.ssid) || !IS_TERMINATED(network.password)) {
+      return false;
+    }
+  }
+  for (const WebhookTarget& webhook : config.webhooks) {
+    if (!IS_TERMINATED(webhook.url) || !IS_TERMINATED(webhook.method) || !IS_TERMINATED(webhook.payload) ||
+        !isValidHeaderTable(webhook.headers)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the fields packConfig() visits into the RTC copy
+struct ConfigPacker {
+  uint8_t* data;
+  size_t length;
+  bool failed;
+
+  void value(const void* field, size_t size) {
+    if (failed || length + size > RTC_CONFIG_DATA_SIZE) {
+      failed = true;
+      return;
+    }
+    memcpy(data + length, field, size);
+    length += size;
+  }
+
+  void string(char* field, size_t size) {
+    value(field, strnlen(field, size - 1) + 1);
+  }
+};
+
+// Reads them back, checking every string is terminated within its field
+struct ConfigUnpacker {
+  const uint8_t* data;
+  size_t length;
+  size_t position;
+  bool failed;
+
+  void value(void* field, size_t size) {
+    if (failed || position + size > length) {
+      failed = true;
+      return;
+    }
+    memcpy(field, data + position, size);
+    position += size;
+  }
+
+  void string(char* field, size_t size) {
+    const void* end = failed ? nullptr : memchr(data + position, '\0', min(size, length - position));
+    if (end == nullptr) {
+      failed = true;
+      return;
+    }
+    value(field, (const uint8_t*)end - (data + position) + 1);
+  }
+};
+
+// Used space of the pool: the end of the last string in it
+static uint16_t headerPoolLength(const WebhookHeaderTable& table) {
+  size_t length = 0;
+  for (int i = 0; i < table.count; i++) {
+    uint16_t offset = max(table.keyOffset[i], table.valueOffset[i]);
+    length = max(length, offset + strnlen(table.pool + offset, sizeof(table.pool) - offset) + 1);
+  }
+  return min(length, sizeof(table.pool));
+}
+
+// The fields a wake-up needs, in the order they are packed. The same code packs and
+// unpacks them, so both always agree on the layout
+template <typename Packer>
+static void packConfig(Packer& packer, DeviceConfig& config) {
+  TriggerConfig& trigger = config.trigger;
+  packer.value(&trigger.transport, sizeof(trigger.transport));
+  for (WifiNetwork& network : config.networks) {
+    packer.string(network.ssid, sizeof(network.ssid));
+    packer.string(network.password, sizeof(network.password));
+  }
+  packer.value(&config.webhookBatching, sizeof(config.webhookBatching));
+  packer.value(&config.batchWindow, sizeof(config.batchWindow));
+
+  if (trigger.transport == TRANSPORT_UDP || trigger.transport == TRANSPORT_ESPNOW) {
+    packer.string(trigger.gateway, sizeof(trigger.gateway));
+    packer.value(&trigger.channel, sizeof(trigger.channel));
+    packer.string(trigger.key, sizeof(trigger.key));
+  } else if (trigger.transport == TRANSPORT_MQTT) {
+    MqttConfig& mqtt = config.mqtt;
+    packer.string(mqtt.broker, sizeof(mqtt.broker));
+    packer.string(mqtt.topic, sizeof(mqtt.topic));
+    packer.string(mqtt.username, sizeof(mqtt.username));
+    packer.string(mqtt.password, sizeof(mqtt.password));
+    packer.value(&mqtt.validateCertificate, sizeof(mqtt.validateCertificate));
+  } else {
+    packer.value(config.webhookGestures, sizeof(config.webhookGestures));
+    for (WebhookTarget& webhook : config.webhooks) {
+      packer.string(webhook.url, sizeof(webhook.url));
+      if (webhook.url[0] == '\0') {
+        continue;
+      }
+      packer.string(webhook.method, sizeof(webhook.method));
+      packer.string(webhook.payload, sizeof(webhook.payload));
+      packer.value(&webhook.validateCertificate, sizeof(webhook.validateCertificate));
+      WebhookHeaderTable& headers = webhook.headers;
+      packer.value(&headers.count, sizeof(headers.count));
+      packer.value(headers.keyOffset, sizeof(headers.keyOffset));
+      packer.value(headers.valueOffset, sizeof(headers.valueOffset));
+      uint16_t poolLength = headerPoolLength(headers);
+      packer.value(&poolLength, sizeof(poolLength));
+      packer.value(headers.pool, min(poolLength, (uint16_t)sizeof(headers.pool)));
+    }
+  }
+}
+
+static void saveRtcConfig(DeviceConfig& config) {
+  ConfigPacker packer = {rtcConfig.data, 0, false};
+  packConfig(packer, config);
+  if (packer.failed) {
+    LOG_INFO("Configuration too big for its RTC copy, wake-ups read it from flash");
+    rtcConfig.length = 0;
+    return;
+  }
+  rtcConfig.version = CONFIG_VERSION;
+  rtcConfig.length = packer.length;
+  rtcConfig.crc = esp_rom_crc32_le(0, rtcConfig.data, packer.length);
+}
+
+static bool loadRtcConfig(DeviceConfig& config) {
+  if (rtcConfig.version != CONFIG_VERSION || rtcConfig.length == 0 || rtcConfig.length > RTC_CONFIG_DATA_SIZE ||
+      rtcConfig.crc != esp_rom_crc32_le(0, rtcConfig.data, rtcConfig.length)) {
+    return false;
+  }
+  memset(&config, 0, sizeof(config));
+  for (WebhookTarget& webhook : config.webhooks) {
+    strcpy(webhook.method, "GET");
+  }
+  ConfigUnpacker unpacker = {rtcConfig.data, rtcConfig.length, 0, false};
+  packConfig(unpacker, config);
+  config.version = CONFIG_VERSION;
+  config.size = sizeof(DeviceConfig);
+  config.crc = configCrc(config);
+  return !unpacker.failed && unpacker.position == rtcConfig.length && isValidConfig(config);
+}
+
+bool setConfigString(char* field, size_t size, String value) {
+  value.trim();
+  if (value.length() >= size) {
+    return false;
+  }
+  memcpy(field, value.c_str(), value.length() + 1);
+  return true;
+}
+
+const char* webhookHeadersKey(int target) {
+  static const char* const keys[WEBHOOK_TARGETS] = {"webhook_headers", "webhook_headers1", "webhook_headers2"};
+  return keys[target];
+}
+
+// Configuration saved by an older firmware, one key per setting
+static bool migrateLegacyConfig(Preferences& preferences, DeviceConfig& config) {
+  if (!preferences.isKey("ssid")) {
+    return false;
+  }
+  LOG_INFO("Migrating configuration saved by an older firmware");
+
+  // Values that don't fit (only possible if they didn't work anyway) are left empty
+  WebhookTarget& webhook = config.webhooks[0];
+  WifiNetwork& network = config.networks[0];
+  setConfigString(network.ssid, sizeof(network.ssid), preferences.getString("ssid", ""));
+  setConfigString(network.password, sizeof(network.password), preferences.getString("password", ""));
+  setConfigString(webhook.url, sizeof(webhook.url), preferences.getString("webhook", ""));
+  setConfigString(webhook.method, sizeof(webhook.method), preferences.getString("webhook_method", "GET"));
+  setConfigString(webhook.payload, sizeof(webhook.payload), preferences.getString("webhook_payload", ""));
+  parseWebhookHeaders(preferences.getString(webhookHeadersKey(0), "").c_str(), webhook.headers);
+
+  if (!saveDeviceConfig(preferences, config)) {
+    return true; // Keep the old keys, we'll try again next boot
+  }
+  // The headers text is still stored on its own, the configuration form shows it
+  static const char* const legacyKeys[] = {"ssid", "password", "webhook", "webhook_method", "webhook_payload"};
+  for (const char* key : legacyKeys) {
+    preferences.remove(key);
+  }
+  return true;
+}
+
+void loadDeviceConfig(Preferences& preferences, DeviceConfig& config, bool complete) {
+  if (complete && !configFromRtc) {
+    return;
+  }
+  if (!complete && esp_reset_reason() == ESP_RST_DEEPSLEEP && loadRtcConfig(config)) {
+    configFromRtc = true;
+    return;
+  }
+  configFromRtc = false;
+
+  if (preferences.getBytes(CONFIG_NVS_KEY, &config, sizeof(config)) == sizeof(config) && isValidConfig(config)) {
+    saveRtcConfig(config);
+    return;
+  }
+
+  memset(&config, 0, sizeof(config));
+  for (WebhookTarget& webhook : config.webhooks) {
+    strcpy(webhook.method, "GET");
+  }
+  if (!migrateLegacyConfig(preferences, config) && preferences.isKey(CONFIG_NVS_KEY)) {
+    LOG_ERROR("Saved configuration is corrupt or from an unknown firmware version, ignoring it");
+  }
+}
+
+bool saveDeviceConfig(Preferences& preferences, DeviceConfig& config) {
+  config.version = CONFIG_VERSION;
+  config.size = sizeof(DeviceConfig);
+  config.crc = configCrc(config);
+  if (preferences.putBytes(CONFIG_NVS_KEY, &config, sizeof(config)) != sizeof(config)) {
+    LOG_ERROR("Failed to save the configuration");
+    return false;
+  }
+  saveRtcConfig(config);
+  configFromRtc = false;
+  return true;
+}
@@ -0,0 +1,100 @@
+#include "DeviceMetrics.h"
+
+#include <esp_system.h>
+#include "RtcBudget.h"
+
+static const uint32_t BUCKET_BOUNDS[METRIC_BUCKET_COUNT - 1] = {100, 250, 500, 1000, 2500, 5000, 10000};
+
+static const struct {
+  const char* name;
+  const char* help;
+} COUNTERS[METRIC_COUNTER_COUNT] = {
+  {"grotbot_wakeups_total", "Boots and wake-ups from deep sleep"},
+  {"grotbot_ap_fallbacks_total", "Times WiFi never connected and the captive portal was started"},
+  {"grotbot_wifi_failures_total", "Failed WiFi connection attempts"},
+  {"grotbot_wifi_lost_total", "WiFi connections lost while awake"},
+  {"grotbot_presses_delivered_total", "Presses delivered to every target"},
+  {"grotbot_presses_deferred_total", "Presses kept for a later wake-up"},
+  {"grotbot_presses_dropped_total", "Presses lost because the queue or the backlog was full"},
+  {"grotbot_requests_total", "Webhook requests, gateway messages and MQTT publish rounds"},
+  {"grotbot_request_errors_total", "Requests without a (successful) response"},
+};
+
+static const struct {
+  const char* name;
+  const char* help;
+} HISTOGRAMS[METRIC_HISTOGRAM_COUNT] = {
+  {"grotbot_wifi_connect_ms", "Time from the first WiFi connection attempt to the IP address"},
+  {"grotbot_request_ms", "Duration of each request"},
+  {"grotbot_press_latency_ms", "Time from the press to its delivery to every target"},
+};
+
+struct Histogram {
+  uint32_t buckets[METRIC_BUCKET_COUNT]; // Not cumulative
+  uint32_t count;
+  uint32_t sum; // ms, wraps after ~49 days of observed time
+};
+
+struct DeviceMetrics {
+  uint32_t magic;
+  uint32_t counters[METRIC_COUNTER_COUNT];
+  Histogram histograms[METRIC_HISTOGRAM_COUNT];
+};
+static_assert(sizeof(DeviceMetrics) <= RTC_BUDGET_METRICS, "DeviceMetrics is over its share of RTC memory");
+RTC_DATA_ATTR static DeviceMetrics metrics;
+
+void metricsBegin() {
+  if (esp_reset_reason() != ESP_RST_DEEPSLEEP || metrics.magic != METRICS_MAGIC) {
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.magic = METRICS_MAGIC;
+  }
+}
+
+void metricsCount(MetricCounter counter, uint32_t amount) {
+  __atomic_add_fetch(&metrics.counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+void metricsObserve(MetricHistogram histogram, uint32_t ms) {
+  int bucket = 0;
+  while (bucket < METRIC_BUCKET_COUNT - 1 && ms > BUCKET_BOUNDS[bucket]) {
+    bucket++;
+  }
+  Histogram& target = metrics.histograms[histogram];
+  __atomic_add_fetch(&target.buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&target.count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&target.sum, ms, __ATOMIC_RELAXED);
+}
+
+uint32_t metricsValue(MetricCounter counter) {
+  return __atomic_load_n(&metrics.counters[counter], __ATOMIC_RELAXED);
+}
+
+uint32_t metricsAverage(MetricHistogram histogram) {
+  const Histogram& source = metrics.histograms[histogram];
+  uint32_t count = __atomic_load_n(&source.count, __ATOMIC_RELAXED);
+  return count > 0 ? __atomic_load_n(&source.sum, __ATOMIC_RELAXED) / count : 0;
+}
+
+void metricsWrite(Print& out) {
+  for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+    out.printf("# HELP %s %s\n# TYPE %s counter\n%s %lu\n", COUNTERS[i].name, COUNTERS[i].help,
+               COUNTERS[i].name, COUNTERS[i].name, (unsigned long)metricsValue((MetricCounter)i));
+  }
+
+  for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+    const char* name = HISTOGRAMS[i].name;
+    const Histogram& histogram = metrics.histograms[i];
+    out.printf("# HELP %s %s\n# TYPE %s histogram\n", name, HISTOGRAMS[i].help, name);
+    uint32_t cumulative = 0;
+    for (int bucket = 0; bucket < METRIC_BUCKET_COUNT; bucket++) {
+      cumulative += __atomic_load_n(&histogram.buckets[bucket], __ATOMIC_RELAXED);
+      if (bucket < METRIC_BUCKET_COUNT - 1) {
+        out.printf("%s_bucket{le=\"%lu\"} %lu\n", name, (unsigned long)BUCKET_BOUNDS[bucket], (unsigned long)cumulative);
+      } else {
+        out.printf("%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)cumulative);
+      }
+    }
+    out.printf("%s_sum %lu\n%s_count %lu\n", name, (unsigned long)__atomic_load_n(&histogram.sum, __ATOMIC_RELAXED),
+               name, (unsigned long)cumulative);
+  }
+}
@@ -0,0 +1,225 @@
+#include "FastTrigger.h"
+
+#include <WiFi.h>
+#include <esp_now.h>
+#include <esp_system.h>
+#include <esp_wifi.h>
+#include <lwip/sockets.h>
+#include <mbedtls/md.h>
+#include "Log.h"
+
+#define TRIGGER_ACK_SIZE (sizeof(TriggerHeader) + TRIGGER_SIGNATURE_SIZE)
+
+// ESP-NOW frames arrive in the WiFi task, the latest ack is handed over through this queue
+struct EspNowAck {
+  uint8_t data[TRIGGER_ACK_SIZE];
+};
+static QueueHandle_t espNowAcks = nullptr;
+static uint8_t espNowPeer[6];
+
+static void onEspNowReceive(const uint8_t* mac, const uint8_t* data, int length) {
+  if (length != TRIGGER_ACK_SIZE || memcmp(mac, espNowPeer, sizeof(espNowPeer)) != 0) {
+    return;
+  }
+  EspNowAck ack;
+  memcpy(ack.data, data, TRIGGER_ACK_SIZE);
+  xQueueOverwrite(espNowAcks, &ack);
+}
+
+bool parseUdpGateway(const char* gateway, char* host, size_t hostSize, uint16_t& port) {
+  const char* colon = strrchr(gateway, ':');
+  if (colon == nullptr || colon == gateway || (size_t)(colon - gateway) >= hostSize) {
+    return false;
+  }
+  char* end;
+  long value = strtol(colon + 1, &end, 10);
+  if (*end != '\0' || value <= 0 || value > 65535) {
+    return false;
+  }
+  memcpy(host, gateway, colon - gateway);
+  host[colon - gateway] = '\0';
+  port = value;
+  return true;
+}
+
+bool parseMacAddress(const char* text, uint8_t* mac) {
+  unsigned int bytes[6];
+  char extra;
+  if (sscanf(text, "%x:%x:%x:%x:%x:%x%c", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5], &extra) != 6) {
+    return false;
+  }
+  for (int i = 0; i < 6; i++) {
+    if (bytes[i] > 0xFF) {
+      return false;
+    }
+    mac[i] = bytes[i];
+  }
+  return true;
+}
+
+bool TriggerSender::beginUdp(const char* gateway, const char* key) {
+  if (!parseUdpGateway(gateway, _host, sizeof(_host), _port)) {
+    LOG_ERRORF("Invalid UDP gateway: %s\n", gateway);
+    return false;
+  }
+  _transport = TRANSPORT_UDP;
+  _key = key;
+  esp_read_mac(_device, ESP_MAC_WIFI_STA);
+  _resolved = false;
+  return true;
+}
+
+bool TriggerSender::beginEspNow(const char* bridge, uint8_t channel, const char* key) {
+  if (!parseMacAddress(bridge, _peer)) {
+    LOG_ERRORF("Invalid ESP-NOW bridge address: %s\n", bridge);
+    return false;
+  }
+  _transport = TRANSPORT_ESPNOW;
+  _key = key;
+  esp_read_mac(_device, ESP_MAC_WIFI_STA);
+
+  if (channel != 0) {
+    esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+  }
+  if (esp_now_init() != ESP_OK) {
+    LOG_ERROR("Failed to start ESP-NOW");
+    return false;
+  }
+  memcpy(espNowPeer, _peer, sizeof(espNowPeer));
+  espNowAcks = xQueueCreate(1, sizeof(EspNowAck));
+  esp_now_register_recv_cb(onEspNowReceive);
+
+  esp_now_peer_info_t peer = {};
+  memcpy(peer.peer_addr, _peer, sizeof(_peer));
+  peer.channel = 0; // Whatever channel the radio is on
+  peer.ifidx = WIFI_IF_STA;
+  peer.encrypt = false; // Messages are signed instead, see TriggerHeader
+  if (esp_now_add_peer(&peer) != ESP_OK) {
+    LOG_ERROR("Failed to add the ESP-NOW bridge");
+    return false;
+  }
+  return true;
+}
+
+void TriggerSender::sign(const uint8_t* data, size_t length, uint8_t* signature) const {
+  uint8_t digest[32];
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)_key, strlen(_key),
+                  data, length, digest);
+  memcpy(signature, digest, TRIGGER_SIGNATURE_SIZE);
+}
+
+bool TriggerSender::isValidAck(const uint8_t* data, size_t length, uint32_t nonce) const {
+  if (length != TRIGGER_ACK_SIZE) {
+    return false;
+  }
+  TriggerHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != TRIGGER_MAGIC || header.version != TRIGGER_VERSION || header.type != TRIGGER_ACK ||
+      header.nonce != nonce || memcmp(header.device, _device, sizeof(_device)) != 0) {
+    return false;
+  }
+
+  uint8_t expected[TRIGGER_SIGNATURE_SIZE];
+  sign(data, sizeof(header), expected);
+  uint8_t difference = 0; // Constant time comparison
+  for (int i = 0; i < TRIGGER_SIGNATURE_SIZE; i++) {
+    difference |= expected[i] ^ data[sizeof(header) + i];
+  }
+  return difference == 0;
+}
+
+bool TriggerSender::transmit(const uint8_t* data, size_t length) {
+  if (_transport == TRANSPORT_ESPNOW) {
+    xQueueReset(espNowAcks);
+    return esp_now_send(_peer, data, length) == ESP_OK;
+  }
+
+  if (!_resolved) {
+    if (!WiFi.hostByName(_host, _address)) {
+      LOG_ERRORF("Could not resolve the UDP gateway %s\n", _host);
+      return false;
+    }
+    _resolved = true;
+  }
+  if (_socket < 0) {
+    _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (_socket < 0) {
+      return false;
+    }
+  }
+
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(_port);
+  address.sin_addr.s_addr = (uint32_t)_address;
+  return sendto(_socket, data, length, 0, (struct sockaddr*)&address, sizeof(address)) == (int)length;
+}
+
+bool TriggerSender::receiveAck(uint32_t nonce, uint32_t timeout) {
+  unsigned long start = millis();
+  while (millis() - start < timeout) {
+    uint32_t remaining = timeout - (millis() - start);
+
+    if (_transport == TRANSPORT_ESPNOW) {
+      EspNowAck ack;
+      if (xQueueReceive(espNowAcks, &ack, pdMS_TO_TICKS(remaining)) != pdTRUE) {
+        return false;
+      }
+      if (isValidAck(ack.data, sizeof(ack.data), nonce)) {
+        return true;
+      }
+      continue;
+    }
+
+    struct timeval wait = {(time_t)(remaining / 1000), (suseconds_t)((remaining % 1000) * 1000)};
+    setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    uint8_t data[TRIGGER_ACK_SIZE + 1]; // One more to spot datagrams that are too long
+    struct sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    int length = recvfrom(_socket, data, sizeof(data), 0, (struct sockaddr*)&from, &fromLength);
+    if (length < 0) {
+      return false; // Timed out
+    }
+    if (from.sin_addr.s_addr == (uint32_t)_address && isValidAck(data, length, nonce)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TriggerSender::send(const PressEvent* presses, int count, unsigned long now) {
+  uint8_t message[sizeof(TriggerHeader) + TRIGGER_MAX_PRESSES * sizeof(TriggerPress) + TRIGGER_SIGNATURE_SIZE];
+  count = min(count, TRIGGER_MAX_PRESSES);
+
+  TriggerHeader header = {};
+  header.magic = TRIGGER_MAGIC;
+  header.version = TRIGGER_VERSION;
+  header.type = TRIGGER_PRESSES;
+  header.count = count;
+  memcpy(header.device, _device, sizeof(_device));
+  header.nonce = esp_random();
+  memcpy(message, &header, sizeof(header));
+
+  size_t length = sizeof(header);
+  for (int i = 0; i < count; i++) {
+    TriggerPress press = {presses[i].sequence,
+                          presses[i].ageUnknown ? TRIGGER_AGE_UNKNOWN : (uint32_t)(now - presses[i].timestamp)};
+    memcpy(message + length, &press, sizeof(press));
+    length += sizeof(press);
+  }
+  sign(message, length, message + length);
+  length += TRIGGER_SIGNATURE_SIZE;
+
+  // The same message every time, so a late ack of an earlier attempt still counts
+  for (int attempt = 0; attempt < TRIGGER_ATTEMPTS; attempt++) {
+    if (!transmit(message, length)) {
+      delay(TRIGGER_ACK_TIMEOUT);
+      continue;
+    }
+    if (receiveAck(header.nonce, TRIGGER_ACK_TIMEOUT)) {
+      return true;
+    }
+    LOG_DEBUGF("No ack from the gateway (attempt %d)\n", attempt + 1);
+  }
+  return false;
+}
@@ -0,0 +1,438 @@
+#include "FirmwareUpdate.h"
+
+#include <esp32c3/rom/miniz.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include "Log.h"
+
+#define TRIED_KEY "ota_tried" // Version installed by the last update, until it proved it works
+#define REJECTED_KEY "ota_rejected" // Version that was rolled back
+
+static Preferences* updatePreferences = nullptr;
+static const char* firmwareVersion = "";
+static bool pendingVerify = false;
+static char rejectedVersion[FIRMWARE_VERSION_SIZE] = "";
+
+void firmwareUpdateBegin(Preferences* preferences, const char* runningVersion) {
+  updatePreferences = preferences;
+  firmwareVersion = runningVersion;
+
+  esp_ota_img_states_t state;
+  pendingVerify = esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+                  state == ESP_OTA_IMG_PENDING_VERIFY;
+
+  // Installed by the last update: either we run it, or the bootloader went back to this one
+  if (preferences->isKey(TRIED_KEY)) {
+    String tried = preferences->getString(TRIED_KEY, "");
+    if (tried != runningVersion) {
+      LOG_ERRORF("Firmware %s was rolled back, it won't be installed again\n", tried.c_str());
+      preferences->putString(REJECTED_KEY, tried);
+      preferences->remove(TRIED_KEY);
+    } else if (!pendingVerify) {
+      preferences->remove(TRIED_KEY); // A bootloader without rollback, nothing to verify
+    }
+  }
+  strlcpy(rejectedVersion, preferences->getString(REJECTED_KEY, "").c_str(), sizeof(rejectedVersion));
+
+  if (pendingVerify) {
+    LOG_INFOF("Firmware %s was just installed, it is kept once it works\n", runningVersion);
+  }
+}
+
+// Arduino would mark a new firmware as working right at boot, see firmwareMarkValid()
+extern "C" bool verifyRollbackLater() {
+  return true;
+}
+
+bool firmwarePendingVerify() {
+  return pendingVerify;
+}
+
+void firmwareMarkValid() {
+  if (!pendingVerify) {
+    return;
+  }
+  pendingVerify = false;
+  esp_ota_mark_app_valid_cancel_rollback();
+  updatePreferences->remove(TRIED_KEY);
+  LOG_INFOF("Firmware %s works, keeping it\n", firmwareVersion);
+}
+
+void firmwareRollBack() {
+  LOG_ERRORF("Firmware %s didn't work, going back to the previous one\n", firmwareVersion);
+  updatePreferences->putString(REJECTED_KEY, firmwareVersion);
+  updatePreferences->remove(TRIED_KEY);
+  LOG_FLUSH();
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  // Only returns if there is nothing to go back to
+  esp_restart();
+}
+
+bool firmwareRejected(const char* version) {
+  return version[0] != '\0' && strcmp(version, rejectedVersion) == 0;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool copyValue(char* field, size_t size, const char* value, size_t length) {
+  if (length >= size) {
+    return false;
+  }
+  memcpy(field, value, length);
+  field[length] = '\0';
+  return true;
+}
+
+bool parseFirmwareManifest(const char* text, FirmwareManifest& manifest) {
+  memset(&manifest, 0, sizeof(manifest));
+  bool hasHash = false;
+
+  while (*text != '\0') {
+    size_t lineLength = strcspn(text, "\r\n");
+    const char* equals = (const char*)memchr(text, '=', lineLength);
+    if (equals != nullptr) {
+      size_t keyLength = equals - text;
+      const char* value = equals + 1;
+      size_t valueLength = text + lineLength - value;
+      if (keyLength == 7 && strncmp(text, "version", 7) == 0) {
+        if (!copyValue(manifest.version, sizeof(manifest.version), value, valueLength)) return false;
+      } else if (keyLength == 3 && strncmp(text, "url", 3) == 0) {
+        if (!copyValue(manifest.url, sizeof(manifest.url), value, valueLength)) return false;
+      } else if (keyLength == 4 && strncmp(text, "size", 4) == 0) {
+        manifest.size = strtoul(value, nullptr, 10);
+      } else if (keyLength == 6 && strncmp(text, "sha256", 6) == 0) {
+        if (valueLength != 64) return false;
+        for (int i = 0; i < 32; i++) {
+          int high = hexDigit(value[2 * i]);
+          int low = hexDigit(value[2 * i + 1]);
+          if (high < 0 || low < 0) return false;
+          manifest.sha256[i] = high << 4 | low;
+        }
+        hasHash = true;
+      }
+    }
+    text += lineLength;
+    text += strspn(text, "\r\n");
+  }
+
+  size_t pathLength = strcspn(manifest.url, "?#");
+  manifest.gzip = pathLength > 3 && strncmp(manifest.url + pathLength - 3, ".gz", 3) == 0;
+  return manifest.version[0] != '\0' && manifest.url[0] != '\0' && manifest.size > 0 && hasHash;
+}
+
+// Connects unless the connection is still open, and sends a GET request
+static int sendRequest(WiFiClient& client, const WebhookUrl& url, uint32_t timeout) {
+  if (!client.connected() && !client.connect(url.host, url.port, timeout)) {
+    return WEBHOOK_ERROR_CONNECTION_REFUSED;
+  }
+  static const WebhookHeaderTable noHeaders = {};
+  char request[2 * CONFIG_URL_SIZE + 192];
+  PayloadWriter out = {request, sizeof(request), 0, false};
+  writeRequestLine(out, "GET", url);
+  writeRequestHeaders(out, url, noHeaders, nullptr, 0, -1);
+  if (out.overflow) {
+    return WEBHOOK_ERROR_TOO_LONG;
+  }
+  if (client.write((const uint8_t*)request, out.length) != out.length) {
+    return WEBHOOK_ERROR_SEND_FAILED;
+  }
+  return 0;
+}
+
+int fetchFirmwareManifest(WiFiClient& client, const WebhookUrl& url, uint32_t timeout, FirmwareManifest& manifest,
+                          bool& valid) {
+  valid = false;
+  int result = sendRequest(client, url, timeout);
+  char text[FIRMWARE_MANIFEST_SIZE];
+  bool reusable = false;
+  if (result == 0) {
+    result = readWebhookResponse(client, timeout, true, reusable, text, sizeof(text));
+  }
+  if (!reusable) {
+    client.stop();
+  }
+  if (result == 200) {
+    valid = parseFirmwareManifest(text, manifest);
+  }
+  return result;
+}
+
+// Image being written to the inactive partition, hashed on the way
+struct ImageWriter {
+  esp_ota_handle_t handle;
+  mbedtls_sha256_context sha256;
+  uint32_t size;
+  uint32_t written;
+};
+
+static int writeImage(ImageWriter& image, const uint8_t* data, size_t length) {
+  if (image.written + length > image.size) {
+    return FIRMWARE_ERROR_WRONG_SIZE;
+  }
+  if (esp_ota_write(image.handle, data, length) != ESP_OK) {
+    return FIRMWARE_ERROR_FLASH;
+  }
+  mbedtls_sha256_update_ret(&image.sha256, data, length);
+  image.written += length;
+  return 0;
+}
+
+enum GzipState : uint8_t {
+  GZIP_FIXED, // ID, method, flags, time, extra flags and OS: 10 bytes
+  GZIP_EXTRA_LENGTH,
+  GZIP_EXTRA,
+  GZIP_NAME,
+  GZIP_COMMENT,
+  GZIP_HEADER_CRC,
+  GZIP_DEFLATE,
+  GZIP_DONE // Only the CRC and size trailer is left, the hash already covers the image
+};
+
+#define GZIP_FLAG_HEADER_CRC 0x02
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+/**
+ * Streaming gzip decompression with the inflater in ROM. The image is written straight
+ * from the 32KB window the inflater needs anyway, so it costs ~43KB of heap for the
+ * duration of the download and nothing otherwise.
+ */
+struct GzipInflater {
+  GzipState state;
+  uint8_t flags;
+  uint16_t position; // In the current header field
+  uint16_t extraLength;
+  size_t windowOffset;
+  tinfl_decompressor decompressor;
+  uint8_t window[TINFL_LZ_DICT_SIZE];
+};
+
+// Moves past the header fields the flags say are missing
+static void skipAbsentFields(GzipInflater& gzip) {
+  if (gzip.state == GZIP_EXTRA_LENGTH && (gzip.flags & GZIP_FLAG_EXTRA) == 0) gzip.state = GZIP_NAME;
+  if (gzip.state == GZIP_EXTRA && gzip.extraLength == 0) gzip.state = GZIP_NAME;
+  if (gzip.state == GZIP_NAME && (gzip.flags & GZIP_FLAG_NAME) == 0) gzip.state = GZIP_COMMENT;
+  if (gzip.state == GZIP_COMMENT && (gzip.flags & GZIP_FLAG_COMMENT) == 0) gzip.state = GZIP_HEADER_CRC;
+  if (gzip.state == GZIP_HEADER_CRC && (gzip.flags & GZIP_FLAG_HEADER_CRC) == 0) gzip.state = GZIP_DEFLATE;
+}
+
+// Returns the bytes of data that belong to the header, or -1 if it isn't gzip
+static int readGzipHeader(GzipInflater& gzip, const uint8_t* data, size_t length) {
+  size_t used = 0;
+  while (used < length && gzip.state < GZIP_DEFLATE) {
+    uint8_t c = data[used++];
+    switch (gzip.state) {
+      case GZIP_FIXED:
+        if ((gzip.position == 0 && c != 0x1f) || (gzip.position == 1 && c != 0x8b) || (gzip.position == 2 && c != 8)) {
+          return -1;
+        }
+        if (gzip.position == 3) gzip.flags = c;
+        if (++gzip.position == 10) {
+          gzip.position = 0;
+          gzip.state = GZIP_EXTRA_LENGTH;
+        }
+        break;
+      case GZIP_EXTRA_LENGTH:
+        gzip.extraLength |= c << (8 * gzip.position);
+        if (++gzip.position == 2) {
+          gzip.position = 0;
+          gzip.state = GZIP_EXTRA;
+        }
+        break;
+      case GZIP_EXTRA:
+        if (++gzip.position == gzip.extraLength) {
+          gzip.position = 0;
+          gzip.state = GZIP_NAME;
+        }
+        break;
+      case GZIP_NAME:
+        if (c == 0) gzip.state = GZIP_COMMENT;
+        break;
+      case GZIP_COMMENT:
+        if (c == 0) gzip.state = GZIP_HEADER_CRC;
+        break;
+      case GZIP_HEADER_CRC:
+        if (++gzip.position == 2) gzip.state = GZIP_DEFLATE;
+        break;
+      default:
+        break;
+    }
+    skipAbsentFields(gzip);
+  }
+  return used;
+}
+
+static int inflateImage(GzipInflater& gzip, ImageWriter& image, const uint8_t* data, size_t length) {
+  int header = readGzipHeader(gzip, data, length);
+  if (header < 0) {
+    return FIRMWARE_ERROR_CORRUPT;
+  }
+  data += header;
+  length -= header;
+
+  while (length > 0 && gzip.state == GZIP_DEFLATE) {
+    size_t in = length;
+    size_t out = TINFL_LZ_DICT_SIZE - gzip.windowOffset;
+    tinfl_status status = tinfl_decompress(&gzip.decompressor, data, &in, gzip.window,
+                                           gzip.window + gzip.windowOffset, &out, TINFL_FLAG_HAS_MORE_INPUT);
+    data += in;
+    length -= in;
+    if (out > 0) {
+      int error = writeImage(image, gzip.window + gzip.windowOffset, out);
+      if (error < 0) {
+        return error;
+      }
+      gzip.windowOffset = (gzip.windowOffset + out) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    if (status < TINFL_STATUS_DONE) {
+      return FIRMWARE_ERROR_CORRUPT;
+    }
+    if (status == TINFL_STATUS_DONE) {
+      gzip.state = GZIP_DONE;
+    }
+  }
+  return 0;
+}
+
+// Waits while paused. Returns 0, or why the download has to stop
+static int checkDownload(FirmwareDownloadPause pause, const volatile bool* cancel, uint32_t deadline) {
+  for (;;) {
+    if (cancel != nullptr && *cancel) {
+      return FIRMWARE_ERROR_CANCELLED;
+    }
+    if ((int32_t)(millis() - deadline) >= 0) {
+      return FIRMWARE_ERROR_TIMEOUT;
+    }
+    if (pause == nullptr || !pause()) {
+      return 0;
+    }
+    delay(20);
+  }
+}
+
+// Sends the request, again on a new connection if the open one turns out to be closed
+static int requestImage(WiFiClient& client, const WebhookUrl& url, uint32_t timeout, ResponseHead& head) {
+  bool reused = client.connected();
+  int result = sendRequest(client, url, timeout);
+  if (result == 0) {
+    result = readResponseHead(client, timeout, head);
+  }
+  if (result < 0 && reused) {
+    client.stop();
+    result = sendRequest(client, url, timeout);
+    if (result == 0) {
+      result = readResponseHead(client, timeout, head);
+    }
+  }
+  return result;
+}
+
+static int streamImage(WiFiClient& client, long length, ImageWriter& image, GzipInflater* gzip, uint32_t timeout,
+                       uint32_t deadline, FirmwareDownloadPause pause, const volatile bool* cancel) {
+  uint8_t input[FIRMWARE_READ_SIZE];
+  while (length > 0) {
+    int result = checkDownload(pause, cancel, deadline);
+    if (result == 0) {
+      result = waitResponseData(client, timeout);
+    }
+    if (result < 0) {
+      return result;
+    }
+    int received = client.read(input, min(length, (long)sizeof(input)));
+    if (received <= 0) {
+      return WEBHOOK_ERROR_CONNECTION_LOST;
+    }
+    length -= received;
+    result = gzip != nullptr ? inflateImage(*gzip, image, input, received) : writeImage(image, input, received);
+    if (result < 0) {
+      return result;
+    }
+  }
+  return gzip != nullptr && gzip->state != GZIP_DONE ? FIRMWARE_ERROR_CORRUPT : 0;
+}
+
+int downloadFirmware(WiFiClient& client, const WebhookUrl& url, const FirmwareManifest& manifest, uint32_t timeout,
+                     uint32_t deadline, FirmwareDownloadPause pause, const volatile bool* cancel) {
+  const esp_partition_t* partition = esp_ota_get_next_update_partition(nullptr);
+  if (partition == nullptr) {
+    client.stop();
+    return FIRMWARE_ERROR_NO_PARTITION;
+  }
+  if (manifest.size > partition->size) {
+    client.stop();
+    return FIRMWARE_ERROR_WRONG_SIZE;
+  }
+
+  ResponseHead head;
+  int result = checkDownload(pause, cancel, deadline);
+  if (result == 0) {
+    result = requestImage(client, url, timeout, head);
+  }
+  if (result == 200 && !head.chunked && head.contentLength > 0) {
+    result = 0;
+  } else if (result >= 0) {
+    LOG_ERRORF("Firmware update: the image request got %d\n", result);
+    result = FIRMWARE_ERROR_BAD_RESPONSE;
+  }
+  GzipInflater* gzip = nullptr;
+  if (result == 0 && manifest.gzip) {
+    gzip = (GzipInflater*)malloc(sizeof(GzipInflater));
+    if (gzip == nullptr) {
+      result = FIRMWARE_ERROR_NO_MEMORY;
+    } else {
+      memset(gzip, 0, offsetof(GzipInflater, window));
+      tinfl_init(&gzip->decompressor);
+    }
+  }
+
+  // Sectors are erased as the image comes in, not all at once up front
+  ImageWriter image = {};
+  image.size = manifest.size;
+  if (result == 0 && esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &image.handle) != ESP_OK) {
+    result = FIRMWARE_ERROR_FLASH;
+  }
+  if (result == 0) {
+    LOG_INFOF("Firmware update: downloading %s (%ld bytes)\n", manifest.version, head.contentLength);
+    mbedtls_sha256_init(&image.sha256);
+    mbedtls_sha256_starts_ret(&image.sha256, 0);
+    result = streamImage(client, head.contentLength, image, gzip, timeout, deadline, pause, cancel);
+
+    uint8_t hash[32];
+    mbedtls_sha256_finish_ret(&image.sha256, hash);
+    mbedtls_sha256_free(&image.sha256);
+    if (result == 0 && image.written != image.size) {
+      result = FIRMWARE_ERROR_WRONG_SIZE;
+    }
+    if (result == 0 && memcmp(hash, manifest.sha256, sizeof(hash)) != 0) {
+      result = FIRMWARE_ERROR_WRONG_HASH;
+    }
+    if (result == 0) {
+      // Checks the image itself (header, segments and its own hash)
+      if (esp_ota_end(image.handle) != ESP_OK) {
+        result = FIRMWARE_ERROR_INVALID_IMAGE;
+      }
+    } else {
+      esp_ota_abort(image.handle);
+    }
+  }
+
+  free(gzip);
+  client.stop();
+  return result;
+}
+
+bool installFirmware(const char* version) {
+  const esp_partition_t* partition = esp_ota_get_next_update_partition(nullptr);
+  if (partition == nullptr || esp_ota_set_boot_partition(partition) != ESP_OK) {
+    LOG_ERROR("Firmware update: the downloaded image can't be booted");
+    return false;
+  }
+  updatePreferences->putString(TRIED_KEY, version);
+  return true;
+}
@@ -0,0 +1,237 @@
+#include "HttpRequest.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+bool parseWebhookHeaders(const char* text, WebhookHeaderTable& table) {
+  memset(&table, 0, sizeof(table));
+  size_t poolUsed = 0;
+  bool complete = true;
+
+  const char* line = text;
+  while (*line != '\0') {
+    const char* lineEnd = strchr(line, '\n');
+    if (lineEnd == nullptr) lineEnd = line + strlen(line);
+
+    const char* colon = (const char*)memchr(line, ':', lineEnd - line);
+    if (colon != nullptr) {
+      const char* keyStart = line;
+      const char* keyEnd = colon;
+      const char* valueStart = colon + 1;
+      const char* valueEnd = lineEnd;
+      while (keyStart < keyEnd && isspace((unsigned char)*keyStart)) keyStart++;
+      while (keyEnd > keyStart && isspace((unsigned char)keyEnd[-1])) keyEnd--;
+      while (valueStart < valueEnd && isspace((unsigned char)*valueStart)) valueStart++;
+      while (valueEnd > valueStart && isspace((unsigned char)valueEnd[-1])) valueEnd--;
+
+      size_t keyLength = keyEnd - keyStart;
+      size_t valueLength = valueEnd - valueStart;
+      if (keyLength > 0) {
+        if (table.count >= MAX_WEBHOOK_HEADERS || poolUsed + keyLength + valueLength + 2 > sizeof(table.pool)) {
+          complete = false;
+        } else {
+          table.keyOffset[table.count] = poolUsed;
+          memcpy(table.pool + poolUsed, keyStart, keyLength);
+          poolUsed += keyLength + 1;
+          table.valueOffset[table.count] = poolUsed;
+          memcpy(table.pool + poolUsed, valueStart, valueLength);
+          poolUsed += valueLength + 1;
+          table.count++;
+        }
+      }
+    }
+
+    line = *lineEnd != '\0' ? lineEnd + 1 : lineEnd;
+  }
+
+  return complete;
+}
+
+// Null-terminated. Returns false if it doesn't fit. Not mbedtls, so this builds on a host
+static bool encodeBase64(const char* data, size_t length, char* out, size_t size) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  if ((length + 2) / 3 * 4 >= size) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t bits = (uint8_t)data[i] << 16;
+    if (i + 1 < length) bits |= (uint8_t)data[i + 1] << 8;
+    if (i + 2 < length) bits |= (uint8_t)data[i + 2];
+    *out++ = alphabet[bits >> 18];
+    *out++ = alphabet[(bits >> 12) & 0x3F];
+    *out++ = i + 1 < length ? alphabet[(bits >> 6) & 0x3F] : '=';
+    *out++ = i + 2 < length ? alphabet[bits & 0x3F] : '=';
+  }
+  *out = '\0';
+  return true;
+}
+
+bool parseWebhookUrl(const char* url, WebhookUrl& parsed) {
+  if (strncmp(url, "https://", 8) == 0) {
+    parsed.secure = true;
+    url += 8;
+  } else if (strncmp(url, "http://", 7) == 0) {
+    parsed.secure = false;
+    url += 7;
+  } else {
+    return false;
+  }
+
+  const char* authorityEnd = url + strcspn(url, "/?#");
+  parsed.path = authorityEnd;
+
+  // user:password@ is sent as basic authentication, as HTTPClient did
+  parsed.authorization[0] = '\0';
+  const char* at = nullptr;
+  for (const char* c = url; c < authorityEnd; c++) {
+    if (*c == '@') at = c;
+  }
+  if (at != nullptr) {
+    strcpy(parsed.authorization, "Basic ");
+    if (!encodeBase64(url, at - url, parsed.authorization + 6, sizeof(parsed.authorization) - 6)) {
+      return false;
+    }
+    url = at + 1;
+  }
+
+  const char* colon = (const char*)memchr(url, ':', authorityEnd - url);
+  const char* hostEnd = colon != nullptr ? colon : authorityEnd;
+  size_t hostLength = hostEnd - url;
+  if (hostLength == 0 || hostLength >= sizeof(parsed.host)) {
+    return false;
+  }
+  parsed.port = parsed.secure ? 443 : 80;
+  if (colon != nullptr) {
+    char* end;
+    long value = strtol(colon + 1, &end, 10);
+    if (end != authorityEnd || value <= 0 || value > 65535) {
+      return false;
+    }
+    parsed.port = value;
+  }
+  memcpy(parsed.host, url, hostLength);
+  parsed.host[hostLength] = '\0';
+  return true;
+}
+
+void writeRequestLine(PayloadWriter& out, const char* method, const WebhookUrl& url) {
+  out.append(method);
+  out.append(" ", 1);
+  if (url.path[0] != '/') {
+    out.append("/", 1);
+  }
+  // The fragment is never sent
+  out.append(url.path, strcspn(url.path, "#"));
+}
+
+static void writeHeader(PayloadWriter& out, const char* name, const char* value) {
+  out.append(name);
+  out.append(": ", 2);
+  out.append(value);
+  out.append("\r\n", 2);
+}
+
+void writeRequestHeaders(PayloadWriter& out, const WebhookUrl& url, const WebhookHeaderTable& headers,
+                         const HttpHeader* extra, int extraCount, long contentLength) {
+  out.append(" HTTP/1.1\r\nHost: ");
+  out.append(url.host);
+  if (url.port != (url.secure ? 443 : 80)) {
+    out.append(":", 1);
+    out.appendNumber((unsigned long)url.port);
+  }
+  out.append("\r\nConnection: keep-alive\r\nAccept-Encoding: identity;q=1,chunked;q=0.1,*;q=0\r\n");
+
+  bool userAgent = false;
+  bool authorization = false;
+  for (int i = 0; i < headers.count; i++) {
+    const char* name = headers.pool + headers.keyOffset[i];
+    userAgent |= strcasecmp(name, "User-Agent") == 0;
+    authorization |= strcasecmp(name, "Authorization") == 0;
+  }
+  if (!userAgent) {
+    writeHeader(out, "User-Agent", WEBHOOK_USER_AGENT);
+  }
+  if (!authorization && url.authorization[0] != '\0') {
+    writeHeader(out, "Authorization", url.authorization);
+  }
+
+  for (int i = 0; i < headers.count; i++) {
+    const char* name = headers.pool + headers.keyOffset[i];
+    // These describe the connection and the body, they are always ours
+    if (strcasecmp(name, "Host") == 0 || strcasecmp(name, "Connection") == 0 ||
+        strcasecmp(name, "Content-Length") == 0) {
+      continue;
+    }
+    writeHeader(out, name, headers.pool + headers.valueOffset[i]);
+  }
+  for (int i = 0; i < extraCount; i++) {
+    writeHeader(out, extra[i].name, extra[i].value);
+  }
+  if (contentLength >= 0) {
+    out.append("Content-Length: ");
+    out.appendNumber((unsigned long)contentLength);
+    out.append("\r\n", 2);
+  }
+  out.append("\r\n", 2);
+}
+
+
+bool buildWebhookRequest(const WebhookRequestParts& parts, char* request, size_t size, size_t headSize,
+                         char* scratch, size_t scratchSize, WebhookRequestBuild& built) {
+  const PressEvent* presses = parts.presses;
+  int pressCount = parts.pressCount;
+  int target = parts.target;
+  built = {};
+
+  // The body is rendered after the room kept for the head, and moved right behind the head
+  // once its length is known
+  char* body = request + headSize;
+  size_t bodySize = size - headSize;
+  size_t bodyLength = 0;
+  bool bodyTooLong = false;
+  if (parts.post) {
+    // Only send payload for POST, with its placeholders replaced
+    if (parts.payload->hasFields) {
+      PayloadValues values = parts.values;
+      values.pressCount = countPendingPresses(presses, pressCount, target);
+      const PressEvent* newest = newestPendingPress(presses, pressCount, target);
+      values.sequence = newest != nullptr ? newest->sequence : 0;
+      values.gesture = gestureName(newest != nullptr ? newest->gesture : GESTURE_SINGLE);
+      char* rendered = parts.asBatch ? scratch : body;
+      size_t renderedSize = parts.asBatch ? scratchSize : bodySize;
+      built.payloadCut = renderPayload(*parts.payload, values, rendered, renderedSize) < 0;
+    } else if (!parts.asBatch) {
+      size_t length = strlen(parts.payload->text);
+      length = length < bodySize ? length : bodySize - 1;
+      memcpy(body, parts.payload->text, length);
+      body[length] = '\0';
+    }
+    if (parts.asBatch) {
+      const char* payload = parts.payload->hasFields ? scratch : parts.payload->text;
+      // The presses matter more than the payload, and a cut body wouldn't be valid JSON
+      if (renderBatchPayload(payload, presses, pressCount, parts.now, target, body, bodySize) < 0) {
+        built.batchWithoutPayload = true;
+        bodyTooLong = renderBatchPayload("", presses, pressCount, parts.now, target, body, bodySize) < 0;
+      }
+    }
+    bodyLength = strlen(body);
+  }
+
+  // A GET can use the whole buffer, its batch query is part of the request line
+  PayloadWriter out = {request, parts.post ? headSize : size, 0, false};
+  writeRequestLine(out, parts.post ? "POST" : "GET", *parts.url);
+  if (parts.asBatch && !parts.post) {
+    out.append(strchr(parts.url->path, '?') != nullptr ? "&" : "?");
+    built.queryCut =
+        renderBatchQuery(presses, pressCount, parts.now, target, out.buffer + out.length, out.size - out.length) < 0;
+    out.length += strlen(out.buffer + out.length);
+  }
+  writeRequestHeaders(out, *parts.url, *parts.headers, parts.extra, parts.extraCount,
+                      parts.post ? (long)bodyLength : -1);
+  memmove(request + out.length, body, bodyLength);
+  built.length = out.length + bodyLength;
+  built.bodyLength = bodyLength;
+  return !out.overflow && !bodyTooLong;
+}
@@ -0,0 +1,192 @@
+#include "LatencyBench.h"
+
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include "RtcBudget.h"
+
+#define BENCH_MAGIC 0x42454E31 // "BEN1"
+#define BENCH_WAKE_SAMPLED 0x01
+#define BENCH_AWAKE_SAMPLED 0x02
+
+static_assert(LATENCY_BENCH_CYCLES <= BENCH_MAX_CYCLES, "LATENCY_BENCH_CYCLES is over BENCH_MAX_CYCLES");
+
+static const char* const CONNECTIONS[] = {"cold", "fast", "radio", "awake"};
+#define BENCH_AWAKE 3
+
+// Times in ms, capped at 65535
+struct BenchCycle {
+  uint8_t connection; // Of the wake press, index in CONNECTIONS
+  uint8_t sampled; // BENCH_*_SAMPLED
+  uint16_t latency; // Of the wake press
+  uint16_t awakeLatency; // Of the press while online
+  uint16_t awake; // From the wake-up to deep sleep
+};
+
+struct BenchState {
+  uint32_t magic;
+  uint16_t done; // Cycles finished
+  uint16_t current; // Cycle running, done + 1 while one is
+  BenchCycle cycles[LATENCY_BENCH_CYCLES > 0 ? LATENCY_BENCH_CYCLES : 1];
+};
+static_assert(sizeof(BenchState) <= RTC_BUDGET_BENCH, "BenchState is over its share of RTC memory");
+RTC_DATA_ATTR static BenchState bench;
+
+static uint16_t capMs(uint32_t ms) {
+  return ms > UINT16_MAX ? UINT16_MAX : ms;
+}
+
+bool benchBegin(bool timerWakeup) {
+  if (esp_reset_reason() != ESP_RST_DEEPSLEEP || bench.magic != BENCH_MAGIC) {
+    memset(&bench, 0, sizeof(bench));
+    bench.magic = BENCH_MAGIC;
+    Serial.begin(115200);
+    Serial.printf("Benchmark: %d cycles, %d ms apart\n", LATENCY_BENCH_CYCLES, BENCH_SLEEP_TIME);
+    return false;
+  }
+  if (!timerWakeup || !benchRunning()) {
+    return false;
+  }
+  Serial.begin(115200);
+  memset(&bench.cycles[bench.done], 0, sizeof(BenchCycle));
+  bench.current = bench.done + 1;
+  return true;
+}
+
+bool benchRunning() {
+  return bench.magic == BENCH_MAGIC && bench.done < LATENCY_BENCH_CYCLES;
+}
+
+bool benchColdCycle() {
+  return bench.done % BENCH_COLD_EVERY == 0;
+}
+
+void benchRecordPress(const char* connection, uint32_t latencyMs) {
+  if (bench.current == 0) {
+    return;
+  }
+  BenchCycle& cycle = bench.cycles[bench.current - 1];
+  int index = 0;
+  while (index < BENCH_AWAKE && strcmp(connection, CONNECTIONS[index]) != 0) {
+    index++;
+  }
+  if (index == BENCH_AWAKE) {
+    if (!(cycle.sampled & BENCH_AWAKE_SAMPLED)) {
+      cycle.awakeLatency = capMs(latencyMs);
+      cycle.sampled |= BENCH_AWAKE_SAMPLED;
+    }
+  } else if (!(cycle.sampled & BENCH_WAKE_SAMPLED)) {
+    cycle.connection = index;
+    cycle.latency = capMs(latencyMs);
+    cycle.sampled |= BENCH_WAKE_SAMPLED;
+  }
+}
+
+bool benchCycleDone(bool awakePress) {
+  if (bench.current == 0) {
+    return false;
+  }
+  uint8_t wanted = BENCH_WAKE_SAMPLED | (awakePress ? BENCH_AWAKE_SAMPLED : 0);
+  return (bench.cycles[bench.current - 1].sampled & wanted) == wanted;
+}
+
+// Nearest rank, of sorted values
+static uint16_t percentile(const uint16_t* values, int count, int percent) {
+  int rank = (count * percent + 99) / 100;
+  return values[rank > 0 ? rank - 1 : 0];
+}
+
+static void sortValues(uint16_t* values, int count) {
+  for (int i = 1; i < count; i++) {
+    uint16_t value = values[i];
+    int j = i;
+    for (; j > 0 && values[j - 1] > value; j--) {
+      values[j] = values[j - 1];
+    }
+    values[j] = value;
+  }
+}
+
+static void printPercentiles(const char* name, uint16_t* values, int count) {
+  sortValues(values, count);
+  Serial.printf(" %s p50=%u p95=%u p99=%u ms", name, percentile(values, count, 50), percentile(values, count, 95),
+                percentile(values, count, 99));
+}
+
+// What went over a limit, " conn=cold latency_p95=2410>2000" for each
+static char failures[256];
+
+static void checkLimit(const char* connection, const char* name, uint16_t value, uint32_t limit) {
+  if (limit > 0 && value > limit) {
+    size_t length = strlen(failures);
+    snprintf(failures + length, sizeof(failures) - length, " conn=%s %s=%u>%lu", connection, name, value,
+             (unsigned long)limit);
+  }
+}
+
+// The summary, then the result against the BENCH_MAX_* limits on a line of its own
+static void printSummary(const char* transport) {
+  static uint16_t latencies[BENCH_MAX_CYCLES];
+  static uint16_t awake[BENCH_MAX_CYCLES];
+  int missed = 0;
+  for (int i = 0; i < bench.done; i++) {
+    missed += !(bench.cycles[i].sampled & BENCH_WAKE_SAMPLED);
+  }
+  Serial.printf("Benchmark done: via=%s cycles=%u missed=%d\n", transport, bench.done, missed);
+  failures[0] = '\0';
+  if (missed > 0) {
+    snprintf(failures, sizeof(failures), " missed=%d", missed);
+  }
+
+  for (int connection = 0; connection <= BENCH_AWAKE; connection++) {
+    int count = 0;
+    for (int i = 0; i < bench.done; i++) {
+      const BenchCycle& cycle = bench.cycles[i];
+      if (connection == BENCH_AWAKE && (cycle.sampled & BENCH_AWAKE_SAMPLED)) {
+        latencies[count++] = cycle.awakeLatency;
+      } else if (connection != BENCH_AWAKE && (cycle.sampled & BENCH_WAKE_SAMPLED) && cycle.connection == connection) {
+        latencies[count] = cycle.latency;
+        awake[count++] = cycle.awake;
+      }
+    }
+    if (count == 0) {
+      continue;
+    }
+    const char* name = CONNECTIONS[connection];
+    Serial.printf("Benchmark: via=%s conn=%s n=%d", transport, name, count);
+    printPercentiles("latency", latencies, count);
+    checkLimit(name, "latency_p95", percentile(latencies, count, 95), BENCH_MAX_P95_MS);
+    checkLimit(name, "latency_p99", percentile(latencies, count, 99), BENCH_MAX_P99_MS);
+    if (connection != BENCH_AWAKE) {
+      printPercentiles("awake", awake, count);
+      checkLimit(name, "awake_p95", percentile(awake, count, 95), BENCH_MAX_AWAKE_MS);
+    }
+    Serial.println();
+  }
+
+  if (failures[0] == '\0') {
+    Serial.println("Benchmark: PASS");
+  } else {
+    Serial.printf("Benchmark: FAIL%s\n", failures);
+  }
+}
+
+uint32_t benchEndCycle(bool cycle, uint32_t awakeMs, const char* transport) {
+  if (cycle && bench.current != 0) {
+    BenchCycle& current = bench.cycles[bench.current - 1];
+    current.awake = capMs(awakeMs);
+    Serial.printf("Benchmark: cycle %u/%d conn=%s latency=%u awake=%u ms\n", bench.current, LATENCY_BENCH_CYCLES,
+                  (current.sampled & BENCH_WAKE_SAMPLED) ? CONNECTIONS[current.connection] : "missed",
+                  current.latency, current.awake);
+    bench.done = bench.current;
+    bench.current = 0;
+  }
+  if (benchRunning()) {
+    return BENCH_SLEEP_TIME;
+  }
+
+  // Over: print the result once and sleep without wake-ups, until a power-on starts again
+  printSummary(transport);
+  Serial.flush();
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+  esp_deep_sleep_start();
+}
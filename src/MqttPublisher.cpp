@@ -0,0 +1,315 @@
+#include "MqttPublisher.h"
+
+#include <esp_system.h>
+#include "Log.h"
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH_QOS1 0x32
+#define MQTT_PUBLISH_DUP 0x08
+#define MQTT_PUBACK 0x40
+#define MQTT_PACKET_SIZE 512 // Largest packet we send: CONNECT with client ID, username and password
+
+static uint32_t sessionKey(const char* broker, const char* clientId) {
+  uint32_t hash = 2166136261UL;
+  for (const char* input : {broker, "\n", clientId}) {
+    for (; *input != '\0'; input++) {
+      hash ^= (uint8_t)*input;
+      hash *= 16777619UL;
+    }
+  }
+  return hash;
+}
+
+bool parseMqttBroker(const char* broker, char* host, size_t hostSize, uint16_t& port, bool& secure) {
+  if (strncmp(broker, "mqtts://", 8) == 0) {
+    secure = true;
+    broker += 8;
+  } else if (strncmp(broker, "mqtt://", 7) == 0) {
+    secure = false;
+    broker += 7;
+  } else {
+    return false;
+  }
+
+  const char* colon = strchr(broker, ':');
+  size_t hostLength = colon != nullptr ? (size_t)(colon - broker) : strlen(broker);
+  if (hostLength == 0 || hostLength >= hostSize || strchr(broker, '/') != nullptr) {
+    return false;
+  }
+  port = secure ? 8883 : 1883;
+  if (colon != nullptr) {
+    char* end;
+    long value = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 65535) {
+      return false;
+    }
+    port = value;
+  }
+  memcpy(host, broker, hostLength);
+  host[hostLength] = '\0';
+  return true;
+}
+
+void MqttPublisher::begin(const MqttConfig* config, MqttSession* session, WiFiClient* client) {
+  _config = config;
+  _session = session;
+  _client = client;
+
+  bool secure;
+  if (!parseMqttBroker(config->broker, _host, sizeof(_host), _port, secure)) {
+    LOG_ERRORF("Invalid MQTT broker: %s\n", config->broker);
+    _host[0] = '\0';
+  }
+
+  uint8_t mac[6];
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  snprintf(_clientId, sizeof(_clientId), "grotbot-%02x%02x%02x%02x%02x%02x",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  uint32_t key = sessionKey(config->broker, _clientId);
+  if (session->magic != MQTT_SESSION_MAGIC || session->key != key) {
+    memset(session, 0, sizeof(*session));
+    session->magic = MQTT_SESSION_MAGIC;
+    session->key = key;
+    session->nextPacketId = 1;
+  }
+}
+
+void MqttPublisher::stop() {
+  if (_client != nullptr) {
+    _client->stop();
+  }
+  _connected = false;
+}
+
+bool MqttPublisher::writePacket(uint8_t header, const uint8_t* body, size_t length) {
+  uint8_t packet[MQTT_PACKET_SIZE];
+  size_t used = 0;
+  packet[used++] = header;
+  size_t remaining = length;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    packet[used++] = remaining > 0 ? digit | 0x80 : digit;
+  } while (remaining > 0);
+  if (used + length > sizeof(packet)) {
+    return false;
+  }
+  // One write, so the packet goes out in a single segment (and TLS record)
+  memcpy(packet + used, body, length);
+  used += length;
+  return _client->write(packet, used) == used;
+}
+
+// Reads the next packet, keeping the first size bytes of its body. Returns the length of
+// the body, or -1 if nothing complete arrived before the timeout
+int MqttPublisher::readPacket(uint8_t& header, uint8_t* body, size_t size, uint32_t timeout) {
+  unsigned long start = millis();
+  auto readByte = [&]() -> int {
+    while (_client->available() <= 0) {
+      if (!_client->connected() || millis() - start >= timeout) {
+        return -1;
+      }
+      delay(1);
+    }
+    return _client->read();
+  };
+
+  int value = readByte();
+  if (value < 0) {
+    return -1;
+  }
+  header = value;
+
+  size_t length = 0;
+  for (int shift = 0; shift <= 21; shift += 7) {
+    value = readByte();
+    if (value < 0) {
+      return -1;
+    }
+    length |= (size_t)(value & 0x7F) << shift;
+    if ((value & 0x80) == 0) {
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    value = readByte();
+    if (value < 0) {
+      return -1;
+    }
+    if (i < size) {
+      body[i] = value;
+    }
+  }
+  return length;
+}
+
+bool MqttPublisher::connect() {
+  stop();
+  if (_host[0] == '\0') {
+    return false;
+  }
+  if (!_client->connect(_host, _port, MQTT_TIMEOUT)) {
+    LOG_ERRORF("Could not connect to the MQTT broker %s:%u\n", _host, _port);
+    return false;
+  }
+
+  uint8_t body[MQTT_PACKET_SIZE - 5];
+  size_t length = 0;
+  auto putString = [&](const char* value) {
+    size_t size = strlen(value);
+    body[length++] = size >> 8;
+    body[length++] = size & 0xFF;
+    memcpy(body + length, value, size);
+    length += size;
+  };
+
+  putString("MQTT");
+  body[length++] = 4; // Protocol level: 3.1.1
+  // Clean session off: the broker keeps the session while we sleep
+  uint8_t flags = 0;
+  if (_config->username[0] != '\0') {
+    flags |= 0x80;
+    if (_config->password[0] != '\0') {
+      flags |= 0x40;
+    }
+  }
+  body[length++] = flags;
+  body[length++] = MQTT_KEEP_ALIVE >> 8;
+  body[length++] = MQTT_KEEP_ALIVE & 0xFF;
+  putString(_clientId);
+  if (flags & 0x80) putString(_config->username);
+  if (flags & 0x40) putString(_config->password);
+
+  uint8_t header;
+  uint8_t reply[2];
+  if (!writePacket(MQTT_CONNECT, body, length) ||
+      readPacket(header, reply, sizeof(reply), MQTT_TIMEOUT) != 2 || header != MQTT_CONNACK) {
+    LOG_ERROR("No CONNACK from the MQTT broker");
+    stop();
+    return false;
+  }
+  if (reply[1] != 0) {
+    LOG_ERRORF("MQTT broker refused the connection (code %d)\n", reply[1]);
+    stop();
+    return false;
+  }
+  if ((reply[0] & 0x01) == 0 && _session->inflightCount > 0) {
+    LOG_INFO("MQTT broker didn't keep the session, unacknowledged presses are published again");
+  }
+  _connected = true;
+  return true;
+}
+
+// Presses that were published before (and not acknowledged) keep their packet ID
+uint16_t MqttPublisher::packetIdFor(uint32_t sequence, bool& duplicate) {
+  for (int i = 0; i < _session->inflightCount; i++) {
+    if (_session->inflight[i].sequence == sequence) {
+      duplicate = true;
+      return _session->inflight[i].packetId;
+    }
+  }
+
+  duplicate = false;
+  if (_session->inflightCount == MQTT_MAX_INFLIGHT) {
+    // Full of publishes from earlier wake-ups, the oldest one is forgotten
+    memmove(&_session->inflight[0], &_session->inflight[1], sizeof(_session->inflight[0]) * (MQTT_MAX_INFLIGHT - 1));
+    _session->inflightCount--;
+  }
+  uint16_t packetId = _session->nextPacketId;
+  _session->nextPacketId = packetId == 0xFFFF ? 1 : packetId + 1;
+  _session->inflight[_session->inflightCount++] = {packetId, sequence};
+  return packetId;
+}
+
+void MqttPublisher::forgetInflight(uint16_t packetId) {
+  for (int i = 0; i < _session->inflightCount; i++) {
+    if (_session->inflight[i].packetId == packetId) {
+      memmove(&_session->inflight[i], &_session->inflight[i + 1],
+              sizeof(_session->inflight[0]) * (_session->inflightCount - i - 1));
+      _session->inflightCount--;
+      return;
+    }
+  }
+}
+
+bool MqttPublisher::publish(const PressEvent* presses, int count, unsigned long now, bool* acked) {
+  count = min(count, MQTT_MAX_INFLIGHT);
+  for (int i = 0; i < count; i++) {
+    acked[i] = false;
+  }
+
+  // A kept-alive connection might have been closed by the broker, then we retry once with
+  // a new one. The presses that were not acknowledged go again with the DUP flag
+  bool reusingConnection = _connected && _client->connected();
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (!reusingConnection && !connect()) {
+      return false;
+    }
+
+    uint16_t packetIds[MQTT_MAX_INFLIGHT];
+    int pending = 0;
+    bool written = true;
+    for (int i = 0; i < count && written; i++) {
+      if (acked[i]) {
+        continue;
+      }
+      bool duplicate;
+      packetIds[i] = packetIdFor(presses[i].sequence, duplicate);
+
+      uint8_t body[CONFIG_TOPIC_SIZE + 80];
+      size_t topicLength = strlen(_config->topic);
+      size_t length = 0;
+      body[length++] = topicLength >> 8;
+      body[length++] = topicLength & 0xFF;
+      memcpy(body + length, _config->topic, topicLength);
+      length += topicLength;
+      body[length++] = packetIds[i] >> 8;
+      body[length++] = packetIds[i] & 0xFF;
+      char age[12] = "null";
+      if (!presses[i].ageUnknown) {
+        snprintf(age, sizeof(age), "%lu", (unsigned long)(now - presses[i].timestamp));
+      }
+      length += snprintf((char*)body + length, sizeof(body) - length, "{\"sequence\":%lu,\"age_ms\":%s,\"wakeup\":%s}",
+                         (unsigned long)presses[i].sequence, age, presses[i].type == PRESS_WAKEUP ? "true" : "false");
+
+      written = writePacket(MQTT_PUBLISH_QOS1 | (duplicate ? MQTT_PUBLISH_DUP : 0), body, length);
+      pending++;
+    }
+
+    // All publishes are out, now collect their acknowledgements
+    while (written && pending > 0) {
+      uint8_t header;
+      uint8_t reply[2];
+      int length = readPacket(header, reply, sizeof(reply), MQTT_TIMEOUT);
+      if (length < 0) {
+        break;
+      }
+      if ((header & 0xF0) != MQTT_PUBACK || length != 2) {
+        continue; // Nothing else is expected, we don't subscribe
+      }
+      uint16_t packetId = (reply[0] << 8) | reply[1];
+      forgetInflight(packetId);
+      for (int i = 0; i < count; i++) {
+        if (!acked[i] && packetIds[i] == packetId) {
+          acked[i] = true;
+          pending--;
+          break;
+        }
+      }
+    }
+    if (written && pending == 0) {
+      return true;
+    }
+
+    stop();
+    if (!reusingConnection) {
+      break;
+    }
+    LOG_INFO("MQTT connection was closed, reconnecting");
+    reusingConnection = false;
+  }
+  return false;
+}
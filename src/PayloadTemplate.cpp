@@ -0,0 +1,217 @@
+#include "PayloadTemplate.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+static const struct {
+  const char* name;
+  PayloadField field;
+} placeholders[] = {
+  {"press_count", PAYLOAD_PRESS_COUNT},
+  {"sequence", PAYLOAD_SEQUENCE},
+  {"gesture", PAYLOAD_GESTURE},
+  {"rssi", PAYLOAD_RSSI},
+  {"uptime_ms", PAYLOAD_UPTIME},
+  {"mac", PAYLOAD_MAC},
+  {"battery_mv", PAYLOAD_BATTERY},
+  {"ssid", PAYLOAD_SSID},
+};
+
+// A payload is JSON if it starts with { or [, after any whitespace
+static const char* skipSpace(const char* text) {
+  while (isspace((unsigned char)*text)) text++;
+  return text;
+}
+
+static PayloadField findPlaceholder(const char* name, size_t length) {
+  for (const auto& placeholder : placeholders) {
+    if (strncmp(placeholder.name, name, length) == 0 && placeholder.name[length] == '\0') {
+      return placeholder.field;
+    }
+  }
+  return PAYLOAD_LITERAL;
+}
+
+static void addSegment(PayloadTemplate& payload, PayloadField field, size_t offset, size_t length) {
+  if (field == PAYLOAD_LITERAL && length == 0) {
+    return;
+  }
+  payload.segments[payload.count++] = {field, (uint16_t)offset, (uint16_t)length};
+}
+
+bool compilePayloadTemplate(const char* text, PayloadTemplate& payload) {
+  payload.text = text;
+  payload.count = 0;
+  payload.hasFields = false;
+
+  const char* first = skipSpace(text);
+  payload.json = *first == '{' || *first == '[';
+
+  size_t length = strlen(text);
+  size_t literalStart = 0;
+  const char* search = text;
+  const char* open;
+  while ((open = strstr(search, "{{")) != nullptr) {
+    const char* close = strstr(open + 2, "}}");
+    if (close == nullptr) {
+      break;
+    }
+    PayloadField field = findPlaceholder(open + 2, close - open - 2);
+    if (field == PAYLOAD_LITERAL) {
+      search = open + 2; // Unknown, stays part of the text
+      continue;
+    }
+    // Room for the literal before it, the field and the literal after the last one
+    if (payload.count + 3 > PAYLOAD_MAX_SEGMENTS) {
+      addSegment(payload, PAYLOAD_LITERAL, literalStart, length - literalStart);
+      return false;
+    }
+    addSegment(payload, PAYLOAD_LITERAL, literalStart, open - text - literalStart);
+    addSegment(payload, field, 0, 0);
+    payload.hasFields = true;
+    literalStart = close + 2 - text;
+    search = close + 2;
+  }
+  addSegment(payload, PAYLOAD_LITERAL, literalStart, length - literalStart);
+  return true;
+}
+
+int renderPayload(const PayloadTemplate& payload, const PayloadValues& values, char* buffer, size_t size) {
+  PayloadWriter writer = {buffer, size, 0, false};
+
+  for (int i = 0; i < payload.count; i++) {
+    const PayloadSegment& segment = payload.segments[i];
+    switch (segment.field) {
+      case PAYLOAD_LITERAL:
+        writer.append(payload.text + segment.offset, segment.length);
+        break;
+      case PAYLOAD_PRESS_COUNT:
+        writer.appendNumber((unsigned long)values.pressCount);
+        break;
+      case PAYLOAD_SEQUENCE:
+        writer.appendNumber((unsigned long)values.sequence);
+        break;
+      case PAYLOAD_GESTURE:
+        writer.appendString(values.gesture, payload.json);
+        break;
+      case PAYLOAD_RSSI:
+        writer.appendNumber((long)values.rssi);
+        break;
+      case PAYLOAD_UPTIME:
+        writer.appendNumber((unsigned long)values.uptimeMs);
+        break;
+      case PAYLOAD_MAC:
+        writer.appendString(values.mac, payload.json);
+        break;
+      case PAYLOAD_BATTERY:
+        if (values.batteryMv >= 0) {
+          writer.appendNumber((long)values.batteryMv);
+        } else if (payload.json) {
+          writer.append("null", 4);
+        }
+        break;
+      case PAYLOAD_SSID:
+        writer.appendString(values.ssid, payload.json);
+        break;
+    }
+  }
+
+  buffer[writer.length] = '\0';
+  return writer.overflow ? -1 : (int)writer.length;
+}
+
+bool pressPending(const PressEvent& press, int target) {
+  return (press.delivered & (1 << target)) == 0;
+}
+
+int countPendingPresses(const PressEvent* presses, int pressCount, int target) {
+  int pending = 0;
+  for (int i = 0; i < pressCount; i++) {
+    if (pressPending(presses[i], target)) pending++;
+  }
+  return pending;
+}
+
+const PressEvent* newestPendingPress(const PressEvent* presses, int pressCount, int target) {
+  for (int i = pressCount - 1; i >= 0; i--) {
+    if (pressPending(presses[i], target)) return &presses[i];
+  }
+  return nullptr;
+}
+
+enum BatchList { BATCH_AGES, BATCH_SEQUENCES, BATCH_GESTURES };
+
+// Ages (ms before sending, null or empty if unknown), sequence numbers or gestures of the
+// pending presses, oldest first
+static void appendBatchList(PayloadWriter& writer, const PressEvent* presses, int pressCount, uint32_t now,
+                            int target, BatchList list, bool json) {
+  bool first = true;
+  for (int i = 0; i < pressCount; i++) {
+    const PressEvent& press = presses[i];
+    if (!pressPending(press, target)) continue;
+    if (!first) writer.append(",", 1);
+    if (list == BATCH_GESTURES) {
+      if (json) writer.append("\"", 1);
+      writer.append(gestureName(press.gesture));
+      if (json) writer.append("\"", 1);
+    } else if (list == BATCH_AGES && press.ageUnknown) {
+      if (json) writer.append("null");
+    } else {
+      writer.appendNumber((unsigned long)(list == BATCH_AGES ? now - press.timestamp : press.sequence));
+    }
+    first = false;
+  }
+}
+
+static void appendBatchFields(PayloadWriter& writer, const PressEvent* presses, int pressCount, uint32_t now,
+                              int target, bool json) {
+  writer.append(json ? "\"press_count\":" : "press_count=");
+  writer.appendNumber((unsigned long)countPendingPresses(presses, pressCount, target));
+  writer.append(json ? ",\"press_ages_ms\":[" : "&press_ages_ms=");
+  appendBatchList(writer, presses, pressCount, now, target, BATCH_AGES, json);
+  writer.append(json ? "],\"press_sequences\":[" : "&press_sequences=");
+  appendBatchList(writer, presses, pressCount, now, target, BATCH_SEQUENCES, json);
+  writer.append(json ? "],\"press_gestures\":[" : "&press_gestures=");
+  appendBatchList(writer, presses, pressCount, now, target, BATCH_GESTURES, json);
+  if (json) writer.append("]");
+}
+
+int renderBatchQuery(const PressEvent* presses, int pressCount, uint32_t now, int target, char* buffer, size_t size) {
+  PayloadWriter writer = {buffer, size, 0, false};
+  appendBatchFields(writer, presses, pressCount, now, target, false);
+  buffer[writer.length] = '\0';
+  return writer.overflow ? -1 : (int)writer.length;
+}
+
+int renderBatchPayload(const char* payload, const PressEvent* presses, int pressCount, uint32_t now, int target,
+                       char* buffer, size_t size) {
+  PayloadWriter writer = {buffer, size, 0, false};
+  writer.append("{", 1);
+  appendBatchFields(writer, presses, pressCount, now, target, true);
+
+  const char* first = skipSpace(payload);
+  if (*first == '{') {
+    // The rest of the object goes after our fields
+    const char* rest = skipSpace(first + 1);
+    size_t restLength = strlen(rest);
+    while (restLength > 0 && isspace((unsigned char)rest[restLength - 1])) {
+      restLength--;
+    }
+    if (rest[0] != '}') writer.append(",", 1);
+    writer.append(rest, restLength);
+  } else if (*first != '\0') {
+    writer.append(",\"payload\":\"");
+    writer.appendString(payload, true);
+    writer.append("\"}");
+  } else {
+    writer.append("}", 1);
+  }
+
+  if (writer.overflow) {
+    buffer[0] = '\0'; // Cut anywhere it wouldn't be valid JSON
+    return -1;
+  }
+  buffer[writer.length] = '\0';
+  return (int)writer.length;
+}
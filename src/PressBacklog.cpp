@@ -0,0 +1,211 @@
+#include "PressBacklog.h"
+
+#include <esp_system.h>
+#include <sys/time.h>
+#include "DeviceMetrics.h"
+#include "Log.h"
+#include "RtcBudget.h"
+
+#define BACKLOG_MAGIC 0x424B4C47 // "BKLG"
+#define BACKLOG_NVS_KEY "press_backlog"
+#define CLOCK_EPOCH_CHECK 0x45504F43 // "EPOC"
+#define PRESS_TIME_UNKNOWN INT64_MIN // StoredPress.time of a press with an unknown age
+
+struct StoredPress {
+  int64_t time; // rtcTimeMs() of the press
+  uint32_t sequence;
+  uint8_t type;
+  uint8_t delivered; // Was padding before, older entries read as 0 (not delivered anywhere)
+  uint8_t gesture; // Was padding before, older entries read as 0 (single press)
+};
+
+struct RtcBacklog {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t nvsCount; // Presses in the NVS ring, so we don't need to read flash to know
+  StoredPress presses[BACKLOG_RTC_SIZE];
+};
+
+// Ring of the oldest presses: head is the oldest one
+struct NvsBacklog {
+  uint16_t head;
+  uint16_t count;
+  uint32_t clockEpoch; // Of the press times
+  StoredPress presses[BACKLOG_NVS_SIZE];
+};
+
+// Identifies the run of the RTC clock the press times count on. Like the clock, it is kept
+// across deep sleep and restarts (RTC_NOINIT_ATTR isn't cleared at boot), a power cycle
+// leaves garbage that fails the check
+struct ClockEpoch {
+  uint32_t id;
+  uint32_t check; // id ^ CLOCK_EPOCH_CHECK
+};
+
+static_assert(sizeof(RtcBacklog) + sizeof(ClockEpoch) <= RTC_BUDGET_BACKLOG, "RtcBacklog is over its share of RTC memory");
+RTC_DATA_ATTR static RtcBacklog rtcBacklog;
+RTC_NOINIT_ATTR static ClockEpoch clockEpoch;
+static NvsBacklog nvsBacklog; // Only loaded when spilling or flushing
+static Preferences* backlogPreferences = nullptr;
+
+int64_t rtcTimeMs() {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  return (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static bool loadNvsBacklog() {
+  size_t length = backlogPreferences->getBytesLength(BACKLOG_NVS_KEY);
+  if (length != sizeof(nvsBacklog) ||
+      backlogPreferences->getBytes(BACKLOG_NVS_KEY, &nvsBacklog, sizeof(nvsBacklog)) != sizeof(nvsBacklog) ||
+      nvsBacklog.head >= BACKLOG_NVS_SIZE || nvsBacklog.count > BACKLOG_NVS_SIZE) {
+    memset(&nvsBacklog, 0, sizeof(nvsBacklog));
+    nvsBacklog.clockEpoch = clockEpoch.id;
+    return false;
+  }
+  if (nvsBacklog.clockEpoch != clockEpoch.id) {
+    // Stored before a power cycle, the clock restarted since then
+    for (StoredPress& press : nvsBacklog.presses) {
+      press.time = PRESS_TIME_UNKNOWN;
+    }
+    nvsBacklog.clockEpoch = clockEpoch.id;
+  }
+  return true;
+}
+
+void backlogBegin(Preferences* preferences) {
+  backlogPreferences = preferences;
+
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (clockEpoch.check != (clockEpoch.id ^ CLOCK_EPOCH_CHECK) || reason == ESP_RST_POWERON ||
+      reason == ESP_RST_BROWNOUT) {
+    clockEpoch.id = esp_random();
+    clockEpoch.check = clockEpoch.id ^ CLOCK_EPOCH_CHECK;
+  }
+
+  if (rtcBacklog.magic != BACKLOG_MAGIC) {
+    // RTC memory was lost (power cycle), but presses spilled to flash are still there
+    memset(&rtcBacklog, 0, sizeof(rtcBacklog));
+    rtcBacklog.magic = BACKLOG_MAGIC;
+    if (loadNvsBacklog()) {
+      rtcBacklog.nvsCount = nvsBacklog.count;
+    }
+  }
+
+  if (backlogSize() > 0) {
+    LOG_INFOF("Undelivered presses from previous wake-ups: %u\n", backlogSize());
+  }
+}
+
+// Move all RTC presses to flash in a single write
+static void spillToNvs() {
+  if (rtcBacklog.nvsCount > 0) {
+    loadNvsBacklog();
+  } else {
+    memset(&nvsBacklog, 0, sizeof(nvsBacklog));
+    nvsBacklog.clockEpoch = clockEpoch.id;
+  }
+
+  for (int i = 0; i < rtcBacklog.count; i++) {
+    if (nvsBacklog.count == BACKLOG_NVS_SIZE) {
+      // Full: drop the oldest press
+      metricsCount(METRIC_PRESSES_DROPPED);
+      nvsBacklog.head = (nvsBacklog.head + 1) % BACKLOG_NVS_SIZE;
+      nvsBacklog.count--;
+    }
+    nvsBacklog.presses[(nvsBacklog.head + nvsBacklog.count) % BACKLOG_NVS_SIZE] = rtcBacklog.presses[i];
+    nvsBacklog.count++;
+  }
+
+  backlogPreferences->putBytes(BACKLOG_NVS_KEY, &nvsBacklog, sizeof(nvsBacklog));
+  rtcBacklog.nvsCount = nvsBacklog.count;
+  rtcBacklog.count = 0;
+  LOG_INFOF("Press backlog moved to flash, %u presses stored there\n", rtcBacklog.nvsCount);
+}
+
+static void toStoredPress(const PressEvent& press, StoredPress& stored, int64_t now) {
+  stored.time = press.ageUnknown ? PRESS_TIME_UNKNOWN : now - (int64_t)(millis() - press.timestamp);
+  stored.sequence = press.sequence;
+  stored.type = press.type;
+  stored.delivered = press.delivered;
+  stored.gesture = press.gesture;
+}
+
+void backlogAdd(const PressEvent& press) {
+  if (rtcBacklog.count == BACKLOG_RTC_SIZE) {
+    spillToNvs();
+  }
+  toStoredPress(press, rtcBacklog.presses[rtcBacklog.count++], rtcTimeMs());
+}
+
+void backlogPersist() {
+  if (rtcBacklog.count > 0) {
+    spillToNvs();
+  }
+}
+
+uint32_t backlogSize() {
+  return rtcBacklog.count + rtcBacklog.nvsCount;
+}
+
+static void toPressEvent(const StoredPress& stored, PressEvent& press, int64_t now) {
+  press.sequence = stored.sequence;
+  press.type = (PressType)stored.type;
+  press.delivered = stored.delivered;
+  press.gesture = stored.gesture < GESTURE_COUNT ? (PressGesture)stored.gesture : GESTURE_SINGLE;
+  press.ageUnknown = stored.time == PRESS_TIME_UNKNOWN;
+  // Relative to millis(), wraps around for presses from before this boot which
+  // still gives the right age when subtracted from millis()
+  press.timestamp = press.ageUnknown ? millis() : millis() - (uint32_t)(now - stored.time);
+}
+
+int backlogLoad(PressEvent* presses, int maxPresses) {
+  int count = 0;
+  int64_t now = rtcTimeMs();
+
+  if (rtcBacklog.nvsCount > 0 && loadNvsBacklog()) {
+    for (int i = 0; i < nvsBacklog.count && count < maxPresses; i++) {
+      toPressEvent(nvsBacklog.presses[(nvsBacklog.head + i) % BACKLOG_NVS_SIZE], presses[count++], now);
+    }
+  }
+  for (int i = 0; i < rtcBacklog.count && count < maxPresses; i++) {
+    toPressEvent(rtcBacklog.presses[i], presses[count++], now);
+  }
+  return count;
+}
+
+void backlogReplace(const PressEvent* presses, int pressCount) {
+  int64_t now = rtcTimeMs();
+  int inNvs = 0;
+
+  // The oldest presses overwrite the flash copy in one write: a reset before it keeps the
+  // old backlog, after it the new one. Without a flash copy they only ever were in RTC memory
+  if (rtcBacklog.nvsCount > 0) {
+    inNvs = min(pressCount, BACKLOG_NVS_SIZE);
+    if (inNvs == 0) {
+      backlogPreferences->remove(BACKLOG_NVS_KEY);
+    } else {
+      memset(&nvsBacklog, 0, sizeof(nvsBacklog));
+      nvsBacklog.clockEpoch = clockEpoch.id;
+      for (int i = 0; i < inNvs; i++) {
+        toStoredPress(presses[i], nvsBacklog.presses[i], now);
+      }
+      nvsBacklog.count = inNvs;
+      backlogPreferences->putBytes(BACKLOG_NVS_KEY, &nvsBacklog, sizeof(nvsBacklog));
+    }
+  }
+
+  rtcBacklog.nvsCount = inNvs;
+  rtcBacklog.count = 0;
+  for (int i = inNvs; i < pressCount && rtcBacklog.count < BACKLOG_RTC_SIZE; i++) {
+    toStoredPress(presses[i], rtcBacklog.presses[rtcBacklog.count++], now);
+  }
+}
+
+void backlogClear() {
+  if (rtcBacklog.nvsCount > 0) {
+    backlogPreferences->remove(BACKLOG_NVS_KEY);
+  }
+  rtcBacklog.count = 0;
+  rtcBacklog.nvsCount = 0;
+}
@@ -0,0 +1,370 @@
+#include "ResumableTlsClient.h"
+
+#include <WiFi.h>
+#include <esp_system.h>
+#include <lwip/sockets.h>
+#include "BootTrace.h"
+#include "Log.h"
+
+#define TLS_HANDSHAKE_TIMEOUT 10000 // Used when the caller doesn't give a timeout
+#define TLS_WRITE_TIMEOUT 5000 // Max time a single write may wait for the socket
+
+// Hardware RNG, avoids seeding a CTR-DRBG on every connection
+static int tlsRandom(void* ctx, unsigned char* output, size_t length) {
+  esp_fill_random(output, length);
+  return 0;
+}
+
+static uint32_t fnv1a(const uint8_t* data, size_t length, uint32_t hash = 2166136261UL) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+ResumableTlsClient::ResumableTlsClient() {
+  mbedtls_x509_crt_init(&_pinnedCert);
+  mbedtls_net_init(&_net);
+}
+
+ResumableTlsClient::~ResumableTlsClient() {
+  stop();
+  mbedtls_x509_crt_free(&_pinnedCert);
+}
+
+bool ResumableTlsClient::setPinnedCertificate(const char* pem) {
+  mbedtls_x509_crt_free(&_pinnedCert);
+  mbedtls_x509_crt_init(&_pinnedCert);
+  _pinned = false;
+
+  if (pem == nullptr || pem[0] == '\0') {
+    return true;
+  }
+
+  // Length must include the terminating null byte for PEM input
+  int ret = mbedtls_x509_crt_parse(&_pinnedCert, (const unsigned char*)pem, strlen(pem) + 1);
+  if (ret != 0) {
+    LOG_ERRORF("Invalid pinned certificate, error: -0x%04x\n", -ret);
+    mbedtls_x509_crt_free(&_pinnedCert);
+    mbedtls_x509_crt_init(&_pinnedCert);
+    return false;
+  }
+
+  _pinned = true;
+  LOG_INFO(_pinnedCert.ca_istrue ? "Pinned CA certificate loaded" : "Pinned server certificate loaded");
+  return true;
+}
+
+int ResumableTlsClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip, port, TLS_HANDSHAKE_TIMEOUT);
+}
+
+int ResumableTlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+  stop();
+  if (!WiFiClient::connect(ip, port, timeout)) {
+    return 0;
+  }
+  return startTls(nullptr, timeout);
+}
+
+int ResumableTlsClient::connect(const char* host, uint16_t port) {
+  return connect(host, port, TLS_HANDSHAKE_TIMEOUT);
+}
+
+int ResumableTlsClient::connect(const char* host, uint16_t port, int32_t timeout) {
+  stop();
+  // Resolve here: WiFiClient::connect(host, ...) would call back into our connect(ip, ...)
+  // and we'd lose the host name needed for SNI and certificate checks
+  IPAddress ip;
+  if (!WiFi.hostByName(host, ip)) {
+    LOG_ERRORF("TLS: could not resolve %s\n", host);
+    return 0;
+  }
+  if (!WiFiClient::connect(ip, port, timeout)) {
+    return 0;
+  }
+  return startTls(host, timeout);
+}
+
+int ResumableTlsClient::startTls(const char* host, int32_t timeout) {
+  if (timeout <= 0) {
+    timeout = TLS_HANDSHAKE_TIMEOUT;
+  }
+  unsigned long start = millis();
+
+  // mbedtls drives the socket in non-blocking mode, timeouts are handled here
+  int socket = fd();
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+  _net.fd = socket;
+
+  mbedtls_ssl_init(&_ssl);
+  mbedtls_ssl_config_init(&_conf);
+  _tlsActive = true;
+  _sessionResumed = false;
+  _peek = -1;
+
+  int ret = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT,
+                                        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret != 0) {
+    LOG_ERRORF("TLS: config failed, error: -0x%04x\n", -ret);
+    stop();
+    return 0;
+  }
+  mbedtls_ssl_conf_rng(&_conf, tlsRandom, nullptr);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+  if (_pinned) {
+    mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&_conf, &_pinnedCert, nullptr);
+    if (!_pinnedCert.ca_istrue) {
+      mbedtls_ssl_conf_verify(&_conf, verifyPinnedLeaf, this);
+    }
+  } else {
+    mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+
+  ret = mbedtls_ssl_setup(&_ssl, &_conf);
+  if (ret == 0 && host != nullptr) {
+    ret = mbedtls_ssl_set_hostname(&_ssl, host);
+  }
+  if (ret != 0) {
+    LOG_ERRORF("TLS: setup failed, error: -0x%04x\n", -ret);
+    stop();
+    return 0;
+  }
+
+  uint32_t key = sessionKey(host);
+  bool offeredSession = restoreSession(key);
+
+  mbedtls_ssl_set_bio(&_ssl, &_net, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+  while ((ret = mbedtls_ssl_handshake(&_ssl)) != 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      LOG_ERRORF("TLS: handshake failed, error: -0x%04x\n", -ret);
+      if (ret == MBEDTLS_ERR_X509_CERT_VERIFY_FAILED) {
+        LOG_ERROR("TLS: server certificate doesn't match the pinned certificate");
+      }
+      // Don't offer a session the server just rejected us with
+      if (offeredSession && _sessionCache != nullptr && _updateSessionCache) {
+        _sessionCache->magic = 0;
+      }
+      stop();
+      return 0;
+    }
+    if (millis() - start >= (unsigned long)timeout) {
+      LOG_ERROR("TLS: handshake timed out");
+      stop();
+      return 0;
+    }
+    delay(1);
+  }
+  traceMark(TRACE_TLS_DONE);
+
+  if (offeredSession) {
+    // The server echoes our session ID back when it accepts the resumption
+    mbedtls_ssl_session offered;
+    mbedtls_ssl_session_init(&offered);
+    if (mbedtls_ssl_session_load(&offered, _sessionCache->data, _sessionCache->length) == 0) {
+      _sessionResumed = offered.id_len > 0 && offered.id_len == _ssl.session->id_len &&
+                        memcmp(offered.id, _ssl.session->id, offered.id_len) == 0;
+    }
+    mbedtls_ssl_session_free(&offered);
+  }
+
+  if (!_sessionResumed) {
+    saveSession(key);
+  }
+
+  LOG_INFOF("TLS: %s handshake in %lu ms\n", _sessionResumed ? "resumed" : "full", millis() - start);
+  return 1;
+}
+
+// Leaf pinning: the chain itself doesn't matter, only the server certificate must be the pinned one
+int ResumableTlsClient::verifyPinnedLeaf(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags) {
+  ResumableTlsClient* client = (ResumableTlsClient*)ctx;
+  if (depth > 0) {
+    *flags = 0;
+    return 0;
+  }
+
+  const mbedtls_x509_buf& pinned = client->_pinnedCert.raw;
+  bool matches = crt->raw.len == pinned.len && memcmp(crt->raw.p, pinned.p, pinned.len) == 0;
+  *flags = matches ? 0 : MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+  return 0;
+}
+
+uint32_t ResumableTlsClient::sessionKey(const char* host) const {
+  uint32_t key = 2166136261UL;
+  if (host != nullptr) {
+    key = fnv1a((const uint8_t*)host, strlen(host), key);
+  }
+  // A session validated against one pinned certificate is not valid for another one
+  if (_pinned) {
+    key = fnv1a(_pinnedCert.raw.p, _pinnedCert.raw.len, key);
+  }
+  return key;
+}
+
+bool ResumableTlsClient::restoreSession(uint32_t key) {
+  if (_sessionCache == nullptr || _sessionCache->magic != TLS_SESSION_CACHE_MAGIC || _sessionCache->key != key) {
+    return false;
+  }
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  bool restored = mbedtls_ssl_session_load(&session, _sessionCache->data, _sessionCache->length) == 0 &&
+                  mbedtls_ssl_set_session(&_ssl, &session) == 0;
+  mbedtls_ssl_session_free(&session);
+
+  if (!restored && _updateSessionCache) {
+    _sessionCache->magic = 0;
+  }
+  return restored;
+}
+
+void ResumableTlsClient::saveSession(uint32_t key) {
+  if (_sessionCache == nullptr || !_updateSessionCache) {
+    return;
+  }
+
+  _sessionCache->magic = 0;
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  size_t length = 0;
+  if (mbedtls_ssl_get_session(&_ssl, &session) == 0 &&
+      mbedtls_ssl_session_save(&session, _sessionCache->data, sizeof(_sessionCache->data), &length) == 0) {
+    _sessionCache->length = length;
+    _sessionCache->key = key;
+    _sessionCache->magic = TLS_SESSION_CACHE_MAGIC;
+  } else {
+    LOG_INFO("TLS: session could not be cached");
+  }
+  mbedtls_ssl_session_free(&session);
+}
+
+size_t ResumableTlsClient::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+size_t ResumableTlsClient::write(const uint8_t* buf, size_t size) {
+  if (!_tlsActive) {
+    return 0;
+  }
+
+  size_t written = 0;
+  unsigned long start = millis();
+  while (written < size) {
+    int ret = mbedtls_ssl_write(&_ssl, buf + written, size - written);
+    if (ret > 0) {
+      written += ret;
+      start = millis();
+    } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      LOG_ERRORF("TLS: write failed, error: -0x%04x\n", -ret);
+      stop();
+      break;
+    } else if (millis() - start >= TLS_WRITE_TIMEOUT) {
+      LOG_ERROR("TLS: write timed out");
+      break;
+    } else {
+      delay(1);
+    }
+  }
+  return written;
+}
+
+int ResumableTlsClient::available() {
+  if (!_tlsActive) {
+    return 0;
+  }
+
+  // Process incoming records without consuming application data
+  int ret = mbedtls_ssl_read(&_ssl, nullptr, 0);
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    int pending = _peek >= 0 ? 1 : 0;
+    // Peer closed or the connection broke, keep what is already decrypted
+    if (mbedtls_ssl_get_bytes_avail(&_ssl) == 0 && pending == 0) {
+      stop();
+    }
+    return _tlsActive ? mbedtls_ssl_get_bytes_avail(&_ssl) + pending : pending;
+  }
+  return mbedtls_ssl_get_bytes_avail(&_ssl) + (_peek >= 0 ? 1 : 0);
+}
+
+int ResumableTlsClient::read() {
+  uint8_t data;
+  return read(&data, 1) == 1 ? data : -1;
+}
+
+int ResumableTlsClient::read(uint8_t* buf, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+
+  int received = 0;
+  if (_peek >= 0) {
+    buf[0] = _peek;
+    _peek = -1;
+    received = 1;
+    if (size == 1) {
+      return 1;
+    }
+  }
+
+  if (!available()) {
+    return received > 0 ? received : -1;
+  }
+
+  int ret = mbedtls_ssl_read(&_ssl, buf + received, size - received);
+  if (ret > 0) {
+    return received + ret;
+  }
+  if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    stop();
+  }
+  return received > 0 ? received : -1;
+}
+
+int ResumableTlsClient::peek() {
+  if (_peek < 0 && available()) {
+    uint8_t data;
+    if (mbedtls_ssl_read(&_ssl, &data, 1) == 1) {
+      _peek = data;
+    }
+  }
+  return _peek;
+}
+
+uint8_t ResumableTlsClient::connected() {
+  // Process pending records first, so a close_notify from the server is noticed here
+  available();
+  if (!_tlsActive) {
+    return 0;
+  }
+  // Decrypted data can still be read after the peer closed the socket
+  if (_peek >= 0 || mbedtls_ssl_get_bytes_avail(&_ssl) > 0) {
+    return 1;
+  }
+  return WiFiClient::connected();
+}
+
+void ResumableTlsClient::stop() {
+  if (_tlsActive) {
+    if (WiFiClient::connected()) {
+      mbedtls_ssl_close_notify(&_ssl);
+    }
+    freeTls();
+  }
+  _peek = -1;
+  // The socket belongs to WiFiClient, which closes it
+  _net.fd = -1;
+  WiFiClient::stop();
+}
+
+void ResumableTlsClient::freeTls() {
+  mbedtls_ssl_free(&_ssl);
+  mbedtls_ssl_config_free(&_conf);
+  _tlsActive = false;
+}
@@ -0,0 +1,172 @@
+#include "WebhookRequest.h"
+
+#define RESPONSE_LINE_SIZE 128 // Longer status and header lines are cut, we only need their start
+
+int waitResponseData(WiFiClient& client, uint32_t timeout) {
+  unsigned long start = millis();
+  while (client.available() <= 0) {
+    if (!client.connected()) {
+      return WEBHOOK_ERROR_CONNECTION_LOST;
+    }
+    if (millis() - start >= timeout) {
+      return WEBHOOK_ERROR_READ_TIMEOUT;
+    }
+    delay(1);
+  }
+  return 0;
+}
+
+// Reads a line without its CRLF, keeping its first size - 1 characters. Returns the
+// length that was kept, or an error
+static int readLine(WiFiClient& client, char* line, size_t size, uint32_t timeout) {
+  size_t length = 0;
+  for (;;) {
+    int error = waitResponseData(client, timeout);
+    if (error < 0) {
+      return error;
+    }
+    int c = client.read();
+    if (c < 0 || c == '\n') {
+      break;
+    }
+    if (c != '\r' && length < size - 1) {
+      line[length++] = c;
+    }
+  }
+  line[length] = '\0';
+  return length;
+}
+
+// Reads length bytes of the body (until the connection closes if negative), appending them
+// to preview while it has room. Returns false if the body didn't arrive in full
+static bool readBodyBytes(WiFiClient& client, long length, uint32_t timeout, char* preview, size_t previewSize,
+                          size_t& kept) {
+  uint8_t chunk[64];
+  while (length != 0) {
+    int error = waitResponseData(client, timeout);
+    if (error < 0) {
+      return length < 0 && error == WEBHOOK_ERROR_CONNECTION_LOST;
+    }
+    size_t wanted = length < 0 || length > (long)sizeof(chunk) ? sizeof(chunk) : (size_t)length;
+    int received = client.read(chunk, wanted);
+    if (received <= 0) {
+      return false;
+    }
+    if (kept + 1 < previewSize) {
+      size_t copied = min((size_t)received, previewSize - 1 - kept);
+      memcpy(preview + kept, chunk, copied);
+      kept += copied;
+      preview[kept] = '\0';
+    }
+    if (length > 0) {
+      length -= received;
+    }
+  }
+  return true;
+}
+
+int readResponseHead(WiFiClient& client, uint32_t timeout, ResponseHead& head) {
+  // A kept-alive connection the server closed in the meantime looks like this
+  int error = waitResponseData(client, timeout);
+  if (error < 0) {
+    return error == WEBHOOK_ERROR_CONNECTION_LOST ? WEBHOOK_ERROR_NOT_CONNECTED : error;
+  }
+
+  // "HTTP/1.1 200 OK"
+  char line[RESPONSE_LINE_SIZE];
+  int length = readLine(client, line, sizeof(line), timeout);
+  if (length < 0) {
+    return length;
+  }
+  if (length < 12 || strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+    return WEBHOOK_ERROR_NO_HTTP_SERVER;
+  }
+  int status = atoi(line + 9);
+  if (status < 100) {
+    return WEBHOOK_ERROR_NO_HTTP_SERVER;
+  }
+
+  head.keepAlive = line[7] == '1'; // HTTP/1.0 closes unless it says otherwise
+  head.chunked = false;
+  head.contentLength = -1;
+  for (;;) {
+    length = readLine(client, line, sizeof(line), timeout);
+    if (length < 0) {
+      return length;
+    }
+    if (length == 0) {
+      break; // End of the headers
+    }
+    char* colon = strchr(line, ':');
+    if (colon == nullptr) {
+      continue;
+    }
+    *colon = '\0';
+    const char* value = colon + 1;
+    while (*value == ' ') {
+      value++;
+    }
+    if (strcasecmp(line, "Content-Length") == 0) {
+      head.contentLength = strtol(value, nullptr, 10);
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+      head.chunked = strcasecmp(value, "chunked") == 0;
+    } else if (strcasecmp(line, "Connection") == 0) {
+      head.keepAlive = strcasecmp(value, "close") != 0;
+    }
+  }
+  return status;
+}
+
+int readWebhookResponse(WiFiClient& client, uint32_t timeout, bool readBody, bool& reusable,
+                        char* preview, size_t previewSize) {
+  reusable = false;
+  if (previewSize > 0) {
+    preview[0] = '\0';
+  }
+
+  ResponseHead head;
+  int status = readResponseHead(client, timeout, head);
+  if (status < 0) {
+    return status;
+  }
+
+  bool hasBody = status >= 200 && status != 204 && status != 304 && (head.chunked || head.contentLength != 0);
+  if (!hasBody) {
+    reusable = head.keepAlive;
+    return status;
+  }
+  if (!readBody) {
+    return status; // What is left of it would be taken as the next response
+  }
+
+  // The status code is the result: a body that doesn't arrive in full only costs the connection
+  size_t kept = 0;
+  char line[RESPONSE_LINE_SIZE];
+  int length;
+  if (head.chunked) {
+    for (;;) {
+      if (readLine(client, line, sizeof(line), timeout) < 0) {
+        return status;
+      }
+      long chunkLength = strtol(line, nullptr, 16);
+      if (chunkLength <= 0) {
+        break;
+      }
+      if (!readBodyBytes(client, chunkLength, timeout, preview, previewSize, kept) ||
+          readLine(client, line, sizeof(line), timeout) < 0) {
+        return status;
+      }
+    }
+    // Trailers, up to the empty line
+    do {
+      length = readLine(client, line, sizeof(line), timeout);
+    } while (length > 0);
+    reusable = head.keepAlive && length == 0;
+  } else if (head.contentLength > 0) {
+    reusable = readBodyBytes(client, head.contentLength, timeout, preview, previewSize, kept) && head.keepAlive;
+  } else {
+    // No length: the body ends when the server closes the connection
+    readBodyBytes(client, -1, timeout, preview, previewSize, kept);
+  }
+  return status;
+}
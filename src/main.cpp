@@ -1,20 +1,80 @@
 #include <Arduino.h>
 #include <WiFi.h>
-#include <WebServer.h>
-#include <DNSServer.h>
+#include <ESPAsyncWebServer.h>
 #include <Preferences.h>
-#include <HTTPClient.h>
 #include <driver/rtc_io.h>
+#include <driver/gpio.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include "BootTrace.h"
+#include "ButtonGestures.h"
+#include "CaptiveDnsServer.h"
+#include "DeviceConfig.h"
+#include "DeviceMetrics.h"
+#include "FastTrigger.h"
+#include "FirmwareUpdate.h"
+#include "LatencyBench.h"
+#include "Log.h"
+#include "MqttPublisher.h"
+#include "PayloadTemplate.h"
+#include "PortalPage.h"
+#include "PressBacklog.h"
+#include "PressEventRing.h"
+#include "ResumableTlsClient.h"
+#include "RtcBudget.h"
+#include "WebhookRequest.h"
 
 // Constants
 #define AP_SSID_BASE "GrotBot-" // Base SSID name, will be appended with random number
 #define AP_PASSWORD "" // Empty for open network
 #define DNS_PORT 53 // Standard DNS port
-#define MAX_CONNECTION_ATTEMPTS 10
-#define CONNECTION_RETRY_DELAY 1000
+#define CONNECTION_ATTEMPT_TIMEOUT 10000 // Max time for one full connection cycle to get an IP
 #define MAX_FULL_CONNECTION_ATTEMPTS 3  // Number of full connection cycles to try
+#define CONNECTION_BACKOFF_BASE 500 // Wait before the second full connection cycle, doubled on each retry
+#define CONNECTION_BACKOFF_MAX 8000 // Upper bound for the wait between full connection cycles
+#define LOOP_INTERVAL 100 // Max time loop() waits for an event (WiFi, button) before running again
 #define BUTTON_PIN 2 // Button connected to PIN 2
+#define DOUBLE_PRESS_WINDOW 350 // Max time (ms) from releasing the button to pressing it again for a double press
+#define LONG_PRESS_TIME 800 // Held at least this long (ms) is a long press
+#define PORTAL_HOLD_TIME 5000 // Held this long (ms) starts the captive portal, instead of sending a press
+#define BATTERY_ADC_PIN -1 // ADC pin wired to the battery through a voltage divider for {{battery_mv}}, -1 if there is none
+#define BATTERY_DIVIDER_RATIO 2 // Battery voltage / voltage at BATTERY_ADC_PIN
 #define SLEEP_TIMEOUT 60000 // 60 seconds timeout before going to sleep
+#define SLEEP_AFTER_SUCCESS 0 // Set to 1 to go to sleep as soon as all presses were delivered (after SUCCESS_SLEEP_GRACE)
+#define SUCCESS_SLEEP_GRACE 3000 // With SLEEP_AFTER_SUCCESS, time to wait for another press before going to sleep
+#define FAST_RECONNECT_TIMEOUT 1500 // Max time to wait for association using the cached AP and lease
+#define WIFI_CACHE_MAGIC 0x47524F32 // "GRO2", marks the RTC connection cache as initialized (and its layout)
+#define WIFI_SCAN_CACHE_MAGIC 0x5343414E // "SCAN", marks the RTC scan cache as initialized
+#define WIFI_SCAN_CACHE_TTL 1800000 // With more than one network, how long (ms, deep sleep included) a scan is used to pick one
+#define WIFI_SCAN_CHANNEL_TIME 120 // Max time (ms) the scan listens on each channel
+#define WIFI_SCAN_TIMEOUT 4000 // Max time to wait for the scan, without results the networks are tried in order
+#define PRESS_RING_SIZE 32 // Max presses waiting to be sent (power of two), more are dropped
+#define OFFLINE_RETRY_BASE 60000 // Sleep before retrying to deliver undelivered presses, doubled on each failure
+#define OFFLINE_RETRY_MAX 3600000 // Upper bound for the sleep between delivery retries
+#define PORTAL_PAGE_PIECES 136 // Flash chunks and configuration values that make up the portal page
+#define WEBHOOK_TASK_STACK 8192 // Stack of each webhook task, the TLS handshake needs most of it
+#define DISPATCH_TASK_STACK 8192 // Stack of the task that hands presses to the webhook tasks, it does the TLS handshake for mqtts
+#define WEBHOOK_CONNECT_TIMEOUT 5000 // Max time (ms) to connect to a webhook server, TLS handshake included
+#define WEBHOOK_RESPONSE_TIMEOUT 5000 // Max time (ms) to wait for the webhook response
+#define PAYLOAD_RENDER_SIZE 768 // Webhook payload with its placeholders replaced
+#define BATCH_RENDER_SIZE (PAYLOAD_RENDER_SIZE + 128 + BACKLOG_MAX_PRESSES * 32) // Payload or query with the batch fields, for a full backlog
+#define READ_RESPONSE_BODY 1 // Set to 0 to stop after the status line and headers, the response body is only logged
+#define SEND_BOOT_TRACE 0 // Set to 1 to send the timings of the previous wake cycle in an X-Grotbot-Trace webhook header
+#define LATENCY_SIGNAL_PIN -1 // GPIO kept high from wake-up until the first press is delivered (to measure it externally), -1 for none
+#define BENCH_DRIVE_PIN -1 // Latency benchmark (latency_bench environment): GPIO wired to BUTTON_PIN to also press it while online, -1 for none
+#define BENCH_PRESS_TIME 50 // How long (ms) BENCH_DRIVE_PIN holds the button down
+#define METRICS_ENDPOINT 1 // Set to 0 to not serve the counters at http://<button>/metrics while awake
+#define METRICS_EVERY_PRESSES 0 // Send a summary of the counters in an X-Grotbot-Metrics webhook header every N presses, 0 for never
+#define FIRMWARE_VERSION "1.0.2" // Compared with the version in the update manifest
+#define OTA_MANIFEST_URL "" // Firmware update manifest (see README), empty to never check for updates
+#define OTA_CHECK_EVERY_WAKES 24 // Check the manifest at most once every N wake-ups
+#define OTA_ALLOW_INSECURE 0 // Set to 1 to accept updates over http, or https without the pinned certificate (testing only)
+#define OTA_TIMEOUT 5000 // Max time (ms) to connect to the update server and to wait for each of its responses
+#define OTA_DOWNLOAD_TIMEOUT 120000 // Max time (ms) for a whole download, paused time included
+#define OTA_TASK_STACK 10240 // Stack of the firmware update task, it does its own TLS handshake
 
 /**
  * About low power mode (USE_LOWER_WIFI_POWER):
@@ -48,596 +108,2306 @@
  * 
  * If you are unsure or can't tell the diffrence, keep USE_LOWER_WIFI_POWER to 1
  * but you will have lower wifi reception
+ *
+ * With ADAPTIVE_TX_POWER the button connects with the power that worked last time and
+ * adjusts it from there: one level up after a failed connection attempt, a lost connection
+ * (or an ESP-NOW message without ack) or a weak signal, one level down when the signal is
+ * strong. USE_LOWER_WIFI_POWER is then the highest level it uses. The level is kept in RTC
+ * memory, so a power cycle starts again from the highest one.
  */
 #define USE_LOWER_WIFI_POWER 1 // Set to 1 to use lower power (8.5dBm) or 0 to use maximum power (19.5dBm)
+#define ADAPTIVE_TX_POWER 1 // Set to 0 to always use the USE_LOWER_WIFI_POWER level
+#define TX_POWER_WEAK_RSSI -75 // Signal (dBm) below which the TX power is raised
+#define TX_POWER_STRONG_RSSI -55 // Signal (dBm) above which the next connections use less TX power
+
+/**
+ * About idle light sleep (USE_IDLE_LIGHT_SLEEP):
+ * 
+ * While connected and waiting for presses (up to SLEEP_TIMEOUT) the chip uses automatic
+ * light sleep: CPU frequency scaling plus light sleep whenever FreeRTOS is idle, with WiFi
+ * in modem sleep so the connection stays up and a press is still sent right away.
+ * The button wakes the chip up through a GPIO (low level) wakeup.
+ * 
+ * Automatic light sleep needs power management and tickless idle enabled in the framework
+ * build. If they are not, only frequency scaling (or nothing) is used.
+ */
+#define USE_IDLE_LIGHT_SLEEP 1
+#define IDLE_MIN_CPU_FREQ_MHZ 40 // Lowest CPU frequency while idle (XTAL frequency)
 
 // Global variables
-WebServer server(80);
-DNSServer dnsServer;
+AsyncWebServer server(80);
+CaptiveDnsServer dnsServer;
 Preferences preferences;
-String ssid = "";
-String password = "";
-String webhookUrl = "";
-String webhookMethod = "GET";
-String webhookHeaders = "";
-String webhookPayload = "";
-bool configSaved = false;
-volatile int pendingRequests = 0;
-bool requestInProgress = false;
-volatile unsigned long lastButtonPressTime = 0;
+DeviceConfig config; // Loaded once at boot, see DeviceConfig.h
+// Headers as typed in the form and the pinned certificate, only loaded for the captive portal
+String webhookHeaders[WEBHOOK_TARGETS];
+String tlsCertificate;
+volatile bool configSaved = false; // Set by the web server task
+String portalUrl; // Where captive portal probes are redirected, set when the web server starts
+
+// Presses waiting to be sent. Written only by onButtonGesture() (from the esp_timer task, or
+// from setup() before the button is sampled), drained only by loop()
+PressEventRing<PRESS_RING_SIZE> pressRing;
+uint32_t reportedDroppedPresses = 0;
+RTC_DATA_ATTR uint32_t nextPressSequence = 0; // Sequence number of the next press, survives deep sleep
+RTC_DATA_ATTR uint32_t offlineRetryDelay = 0; // Current timer wake-up delay for undelivered presses
+bool wokenForRetry = false; // Woken up by the timer to deliver the backlog, no one is pressing the button
+bool benchCycle = false; // Woken up by the timer for a cycle of the latency benchmark, see LatencyBench.h
+bool benchAwakePressed = false; // This cycle pressed the button through BENCH_DRIVE_PIN
+bool backlogFlushAttempted = false; // Only try to deliver the backlog once per wake-up
+volatile bool pressesDelivered = false; // Some presses reached all webhooks during this wake-up
+// How this wake-up got onto the network (cold, fast or radio) and when, for the latency of each press
+const char* linkMode = nullptr;
+unsigned long linkReadyTime = 0;
+unsigned long wifiConnectStart = 0; // millis() of the first attempt of the current connection
+bool webServerStarted = false; // server.begin() was called, the server then runs until the restart
+bool portalPagesAdded = false;
+RTC_DATA_ATTR uint32_t metricsReportedPresses = 0; // nextPressSequence when the last summary was sent
+// Summary for the webhooks of the current dispatch, empty if none is due
+char metricsSummary[192];
+// Webhooks (bit per target) not called for each gesture, and the configured ones
+uint8_t gestureSkippedTargets[GESTURE_COUNT] = {};
+uint8_t gestureTargets = 0;
+bool wakePressPending = false; // The first gesture is the press that woke us up
+volatile bool portalRequested = false; // The button was held for PORTAL_HOLD_TIME
+bool idleSleepEnabled = false;
+esp_pm_lock_handle_t requestPmLock = nullptr; // Keeps the CPU at full speed while sending
 unsigned long lastActivityTime = 0; // Track time of last activity
-const unsigned long DEBOUNCE_TIME = 300; // Debounce time in milliseconds
+
+/**
+ * Connection details from the last successful WiFi connection.
+ * 
+ * Kept in RTC memory so they survive deep sleep (but not a power cycle).
+ * On wake-up by button press we use them to skip the channel scan and DHCP:
+ * WiFi.begin() goes straight to the known BSSID/channel with the last lease
+ * configured as a static IP. credentialsHash ties the cache to the ssid/password
+ * of the network it was created with, so saving a new configuration invalidates it.
+ */
+struct WiFiConnectionCache {
+  uint32_t magic;
+  uint32_t credentialsHash;
+  uint8_t network; // Index in config.networks
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t localIP;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns1;
+  uint32_t dns2;
+};
+RTC_DATA_ATTR WiFiConnectionCache wifiCache = {0};
+
+/**
+ * Strongest AP of each configured network in the last scan, kept in RTC memory.
+ *
+ * With more than one network, a full connection cycle doesn't try them one after the
+ * other: it scans once (in the background, loop() keeps running) and joins the network
+ * that connected last time if it is in range with a usable signal, or else the strongest
+ * one, straight on the AP and channel the scan found. The scan is reused by the next
+ * wake-ups for WIFI_SCAN_CACHE_TTL. An AP that fails to connect is dropped from it, so
+ * the next cycle scans again once none is left. networksHash ties it to the SSIDs.
+ */
+struct WiFiScanCache {
+  uint32_t magic;
+  uint32_t networksHash;
+  int64_t scanTime; // rtcTimeMs() when the scan finished
+  struct {
+    uint8_t channel; // 0 if the network wasn't seen
+    int8_t rssi;
+    uint8_t bssid[6];
+  } networks[WIFI_NETWORKS];
+};
+RTC_DATA_ATTR WiFiScanCache wifiScanCache = {0};
+RTC_DATA_ATTR int8_t lastWiFiNetwork = -1; // Network of the last successful connection, tried first
+static_assert(sizeof(WiFiConnectionCache) + sizeof(WiFiScanCache) <= RTC_BUDGET_WIFI, "The WiFi caches are over their share of RTC memory");
+
+// TX power levels for ADAPTIVE_TX_POWER, lowest first
+const wifi_power_t txPowerLevels[] = {
+  WIFI_POWER_5dBm, WIFI_POWER_7dBm, WIFI_POWER_8_5dBm, WIFI_POWER_11dBm,
+  WIFI_POWER_13dBm, WIFI_POWER_15dBm, WIFI_POWER_17dBm, WIFI_POWER_19_5dBm
+};
+#define TX_POWER_MAX_LEVEL (USE_LOWER_WIFI_POWER ? 2 : 7) // Index of the 8.5dBm or 19.5dBm level
+RTC_DATA_ATTR int8_t txPowerLevel = -1; // Level that worked last time, -1 until the first connection
+bool txPowerRaised = false; // Some attempt of this wake-up needed more power
+
+/**
+ * WiFi station connection state machine.
+ * 
+ * Connecting never blocks: startWiFi() kicks off the first attempt and
+ * updateWiFiConnection() advances it from loop(). Progress comes from WiFi events
+ * (see onWiFiEvent) which also wake up loop() right away, so presses are sent
+ * the moment we get an IP instead of on the next polling tick.
+ * 
+ * FAST_CONNECTING -> (fail) -> [SCANNING] -> CONNECTING -> (fail) -> BACKOFF -> [SCANNING] -> CONNECTING ... -> FAILED (AP mode)
+ *        \______________________________________\________________________________________________-> CONNECTED
+ *
+ * SCANNING only happens with more than one network and no usable scan cache. A cycle
+ * tries each network the scan found (or each configured one, without a scan) before it
+ * counts as failed.
+ */
+enum WiFiConnectionState {
+  WIFI_STATE_IDLE,
+  WIFI_STATE_FAST_CONNECTING, // Connecting with the cached AP and lease
+  WIFI_STATE_SCANNING,        // Looking for the configured networks, before a full connection cycle
+  WIFI_STATE_CONNECTING,      // Full connection cycle: scan, associate and DHCP
+  WIFI_STATE_BACKOFF,         // Waiting before the next full connection cycle
+  WIFI_STATE_CONNECTED,
+  WIFI_STATE_FAILED,          // All attempts failed, running the captive portal
+  WIFI_STATE_RADIO_ONLY       // ESP-NOW: radio on the bridge channel, never connects
+};
+WiFiConnectionState wifiState = WIFI_STATE_IDLE;
+unsigned long wifiStateStartTime = 0; // millis() when wifiState last changed
+unsigned long wifiBackoffDelay = 0; // Wait time of the current backoff
+int wifiConnectionAttempt = 0; // Full connection cycles done so far
+int wifiNetwork = 0; // Network (index in config.networks) of the current attempt or connection
+uint8_t wifiNetworksTried = 0; // Bit per network tried in the current cycle
+bool wifiCycleScanned = false; // The current cycle picks from the scan cache
+// Set from the WiFi event task, consumed by updateWiFiConnection()
+volatile bool wifiGotIP = false;
+volatile bool wifiDisconnected = false;
+volatile uint8_t wifiDisconnectReason = 0;
+TaskHandle_t loopTaskHandle = nullptr; // Notified on events to wake up loop() early
+
+// TLS session of the last handshake of the first HTTPS webhook (or the mqtts broker), so
+// presses after a deep sleep can resume it. There is only room in RTC memory for one
+static_assert(sizeof(TlsSessionCache) <= RTC_BUDGET_TLS_SESSION, "TlsSessionCache is over its share of RTC memory");
+RTC_DATA_ATTR TlsSessionCache tlsSessionCache = {0};
+
+/**
+ * Firmware updates, see FirmwareUpdate.h. The manifest is checked from its own task once
+ * the presses of a wake-up are out, resuming the TLS session of the webhooks (it never
+ * replaces it). A newer image is downloaded in the background, pausing whenever there are
+ * presses to send, and installed at the next goToSleep() with a restart.
+ */
+RTC_DATA_ATTR uint16_t otaWakesSinceCheck = OTA_CHECK_EVERY_WAKES; // Full after a power cycle, so it checks right away
+RTC_DATA_ATTR char otaReadyVersion[FIRMWARE_VERSION_SIZE] = ""; // Downloaded and verified, waiting for goToSleep()
+static_assert(sizeof(nextPressSequence) + sizeof(offlineRetryDelay) + sizeof(metricsReportedPresses) + sizeof(lastWiFiNetwork) +
+                  sizeof(txPowerLevel) + sizeof(otaWakesSinceCheck) + sizeof(otaReadyVersion) <= RTC_BUDGET_MISC,
+              "The RTC variables of main.cpp are over their share of RTC memory");
+bool otaDue = false; // Check during this wake-up
+volatile bool otaRunning = false; // The update task is running, stay awake
+volatile bool otaCancel = false; // Set by goToSleep(), the download gives up
+WebhookUrl otaUrl;
+ResumableTlsClient otaSecureClient;
+WiFiClient otaPlainClient;
+
+/**
+ * Each configured webhook is sent from its own task, so a press reaches all of them at
+ * the same time and takes as long as the slowest one instead of the sum of all of them.
+ * 
+ * dispatchWebhooks() hands the presses to the tasks and waits until every one of them
+ * has set its bit in webhookDoneEvents. The clients are long-lived: each connection is
+ * kept alive between presses while awake.
+ */
+struct WebhookWorker {
+  int target;
+  TaskHandle_t task = nullptr;
+  ResumableTlsClient secureClient;
+  WiFiClient plainClient;
+  WebhookUrl url; // Parsed from the configured URL at boot
+  // Request to send, set by dispatchWebhooks() before notifying the task
+  const PressEvent* presses;
+  int pressCount;
+  bool asBatch;
+  int result; // HTTP response code, or a negative WEBHOOK_ERROR_*
+  PayloadTemplate payloadTemplate; // Compiled from the configured payload at boot
+  // Rendered payload before the batch fields are added, then the start of the response
+  char payload[PAYLOAD_RENDER_SIZE];
+  // The whole request as it is written to the socket: head, then batch query or body
+  char request[WEBHOOK_HEAD_SIZE + BATCH_RENDER_SIZE];
+  // Set by loop() when WiFi was lost, the task drops its kept-alive connections before the
+  // next request (only the task itself touches its clients)
+  volatile bool connectionLost;
+};
+WebhookWorker webhookWorkers[WEBHOOK_TARGETS];
+EventGroupHandle_t webhookDoneEvents = nullptr; // Bit per target, set when its request is done
+uint8_t activeTargets = 0; // Bit per webhook that has a URL (and a running task), or bit 0 for the gateway
+// Sends the presses to a gateway or bridge instead of the webhooks
+TriggerSender triggerSender;
+// Or publishes them to an MQTT broker, from the dispatcher task. The session (packet IDs of
+// unacknowledged publishes) survives deep sleep
+static_assert(sizeof(MqttSession) <= RTC_BUDGET_MQTT, "MqttSession is over its share of RTC memory");
+RTC_DATA_ATTR MqttSession mqttSession = {0};
+MqttPublisher mqttPublisher;
+ResumableTlsClient mqttSecureClient;
+WiFiClient mqttPlainClient;
+volatile bool mqttConnectionLost = false; // Same as WebhookWorker::connectionLost
+// Payload placeholder values shared by all webhooks, set by dispatchWebhooks()
+PayloadValues payloadValues;
+char macAddress[18];
+
+/**
+ * Sending happens in the dispatcher task, so a slow server never blocks loop(): it only
+ * moves presses from pressRing to dispatchQueue and takes care of WiFi and power.
+ * 
+ * The dispatcher takes items from the queue (batching them if configured), hands them to
+ * the webhook tasks with dispatchWebhooks() and wakes up loop() when done. pendingDispatch
+ * counts the items queued and not handled yet: when it is 0 every press was either
+ * delivered or moved to the backlog, and loop() can go to sleep right away.
+ */
+struct DispatchItem {
+  bool flushBacklog; // Deliver the presses from previous wake-ups instead of press
+  PressEvent press;
+};
+QueueHandle_t dispatchQueue = nullptr;
+uint32_t pendingDispatch = 0; // Incremented by loop() when queueing, decremented by the dispatcher
 
 // Function prototypes
-void setupWiFi();
+void startWiFi(bool fastReconnect);
+void updateWiFiConnection();
+void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info);
+void wakeLoop();
+void enableIdleSleep();
+void disableIdleSleep();
+void startButton(bool wokenByPress);
+void onButtonGesture(PressGesture gesture, uint32_t pressTime);
+void onButtonHold();
+void startPortal();
+void saveWiFiCache();
+void invalidateWiFiCache();
+void saveWiFiScan(int found);
+bool networkConfigured(int network);
+int configuredNetworkCount();
 void setupAP();
 void setupWebServer();
+void beginWebServer();
+void startMetricsServer();
+void handleMetrics(AsyncWebServerRequest* request);
+void countDroppedPresses();
 String getWiFiStatusString(wl_status_t status);
-void handleRoot();
-void handleSave();
-void sendWebhookRequest();
+void handleCaptiveProbe(AsyncWebServerRequest* request);
+void handleRoot(AsyncWebServerRequest* request);
+void handleSave(AsyncWebServerRequest* request);
+void setupDispatcher();
+void setupWebhookWorkers();
+void setupMqtt();
+void startEspNow();
+bool queueDispatch(const DispatchItem& item);
+bool dispatchIdle();
+int sendWebhookRequest(WebhookWorker& worker);
+uint8_t dispatchWebhooks(const PressEvent* presses, int pressCount, bool asBatch);
+void sendPresses(PressEvent* presses, int pressCount, bool asBatch);
+void flushBacklog();
+void deferPendingPresses();
+void setupFirmwareUpdate();
+void startFirmwareUpdate();
 void goToSleep();
 bool isButtonPressed();
-void IRAM_ATTR buttonISR();
 
 void setup() {
-  Serial.begin(115200);
-  delay(1000);
-  Serial.println("\n\nESP32 C3 Super Mini starting up...");
-  Serial.println("Firmware version: 1.0.2 - Auto Sleep");
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  LOG_BEGIN(115200);
+  LOG_DELAY(1000); // Give the serial monitor time to attach
+  LOG_INFO("\n\nESP32 C3 Super Mini starting up...");
+  LOG_INFO("Firmware version: " FIRMWARE_VERSION " - Auto Sleep");
   
   // Initialize last activity time to current time at boot
   lastActivityTime = millis();
 
   // Check wake-up reason with detailed debug info
   esp_sleep_wakeup_cause_t wakeup_reason = esp_sleep_get_wakeup_cause();
-  Serial.print("Wake up reason code: ");
-  Serial.println(wakeup_reason);
+  traceMark(TRACE_WAKEUP);
+  metricsBegin();
+  metricsCount(METRIC_WAKEUPS);
+  if (LATENCY_SIGNAL_PIN >= 0) {
+    pinMode(LATENCY_SIGNAL_PIN, OUTPUT);
+    digitalWrite(LATENCY_SIGNAL_PIN, HIGH);
+  }
+  LOG_DEBUGF("Wake up reason code: %d\n", wakeup_reason);
   
   // Print human-readable wake-up reason
   switch(wakeup_reason) {
     case ESP_SLEEP_WAKEUP_UNDEFINED:
-      Serial.println("Wake up reason: ESP_SLEEP_WAKEUP_UNDEFINED (Normal boot)");
+      LOG_DEBUG("Wake up reason: ESP_SLEEP_WAKEUP_UNDEFINED (Normal boot)");
       break;
     case ESP_SLEEP_WAKEUP_GPIO:
-      Serial.println("Wake up reason: ESP_SLEEP_WAKEUP_GPIO (Button press)");
+      LOG_DEBUG("Wake up reason: ESP_SLEEP_WAKEUP_GPIO (Button press)");
       break;
     case ESP_SLEEP_WAKEUP_TIMER:
-      Serial.println("Wake up reason: ESP_SLEEP_WAKEUP_TIMER");
+      LOG_DEBUG("Wake up reason: ESP_SLEEP_WAKEUP_TIMER");
       break;
     default:
-      Serial.println("Wake up reason: Other reason");
+      LOG_DEBUG("Wake up reason: Other reason");
       break;
   }
   
   if (wakeup_reason == ESP_SLEEP_WAKEUP_GPIO) {
-    Serial.println("Woken up by button press - will trigger webhook request");
-    // Set pending request flag since we were woken by button
-    __atomic_fetch_add(&pendingRequests, 1, __ATOMIC_SEQ_CST);
+    LOG_INFO("Woken up by button press - will trigger webhook request");
+  } else if (wakeup_reason == ESP_SLEEP_WAKEUP_TIMER) {
+    LOG_INFO("Woken up by timer - will retry delivering undelivered presses");
+    wokenForRetry = true;
   } else {
-    Serial.println("Normal boot or woken by timer");
+    LOG_INFO("Normal boot");
+  }
+  // The benchmark handles its timer wake-ups like button presses
+  if (LATENCY_BENCH_CYCLES > 0) {
+    benchCycle = benchBegin(wakeup_reason == ESP_SLEEP_WAKEUP_TIMER);
+    wokenForRetry = wokenForRetry && !benchCycle;
   }
 
-  // Initialize button pin with internal pull-up resistor
-  pinMode(BUTTON_PIN, INPUT_PULLUP);
-  Serial.println("Button initialized on PIN 2 with internal pull-up resistor");
-  
-  // Read the initial state of the button for debugging
-  int buttonState = digitalRead(BUTTON_PIN);
-  Serial.print("Initial button state: ");
-  Serial.println(buttonState == HIGH ? "HIGH (not pressed)" : "LOW (pressed)");
-  
-  // Attach interrupt to button pin
-  attachInterrupt(BUTTON_PIN, buttonISR, FALLING);
-  Serial.println("Button interrupt attached");
-  
   // Configure GPIO for wakeup - ESP32-C3 specific method
   // For ESP32-C3, only GPIO0-GPIO5 can be used for deep sleep wakeup
-  
-  // Detach interrupt before configuring deep sleep wake-up to avoid conflicts
-  if (wakeup_reason != ESP_SLEEP_WAKEUP_GPIO) {
-    // Only detach and reattach if this is not a wake-up from sleep
-    // This prevents potential issues with the interrupt handler
-    detachInterrupt(BUTTON_PIN);
-    delay(100);
-    attachInterrupt(BUTTON_PIN, buttonISR, FALLING);
-    Serial.println("Interrupt detached and reattached to ensure clean state");
-  }
-  
   // Enable GPIO wakeup from deep sleep - ESP32-C3 specific method
   // The first parameter is a bitmask of GPIOs that can trigger wakeup
   // The second parameter is the level that triggers wakeup (LOW in our case)
   esp_err_t result = esp_deep_sleep_enable_gpio_wakeup(1ULL << BUTTON_PIN, ESP_GPIO_WAKEUP_GPIO_LOW);
   if (result == ESP_OK) {
-    Serial.println("Deep sleep wake-up by button configured successfully on GPIO2");
+    LOG_DEBUG("Deep sleep wake-up by button configured successfully on GPIO2");
   } else {
-    Serial.print("Failed to configure deep sleep wake-up, error code: ");
-    Serial.println(result);
+    LOG_ERRORF("Failed to configure deep sleep wake-up, error code: %d\n", result);
   }
 
   // Initialize preferences
   preferences.begin("grotbot", false);
+  backlogBegin(&preferences);
+  firmwareUpdateBegin(&preferences, FIRMWARE_VERSION);
   
-  // Load saved configuration
-  ssid = preferences.getString("ssid", "");
-  password = preferences.getString("password", "");
-  webhookUrl = preferences.getString("webhook", "");
-  webhookMethod = preferences.getString("webhook_method", "GET");
-  webhookHeaders = preferences.getString("webhook_headers", "");
-  webhookPayload = preferences.getString("webhook_payload", "");
-  
-  // Trim whitespace from credentials to prevent connection issues
-  ssid.trim();
-  password.trim();
-  webhookUrl.trim();
+  // Load saved configuration (values were trimmed when saved)
+  loadDeviceConfig(preferences, config);
+  traceMark(TRACE_CONFIG_LOADED);
+  traceTag(TRACE_TAG_TRANSPORT, transportName(config.trigger.transport));
   
-  Serial.println("Loaded configuration (after trimming):");
-  Serial.println("SSID: " + ssid);
-  Serial.println("SSID length: " + String(ssid.length()));
-  Serial.println("Password length: " + String(password.length()));
-  Serial.println("Webhook URL: " + webhookUrl);
-
-  // Check if button is currently pressed (force AP mode)
-  if (digitalRead(BUTTON_PIN) == LOW) {
-    Serial.println("Button is pressed during startup - forcing AP mode");
-    setupAP();
-    setupWebServer();
+  LOG_INFO("Loaded configuration:");
+  for (int i = 0; i < WIFI_NETWORKS; i++) {
+    if (config.networks[i].ssid[0] != '\0') {
+      LOG_DEBUGF("SSID %d: %s\n", i + 1, config.networks[i].ssid);
+      LOG_DEBUGF("SSID length: %u\n", strlen(config.networks[i].ssid));
+      LOG_DEBUGF("Password length: %u\n", strlen(config.networks[i].password));
+    }
+  }
+  for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+    if (config.webhooks[i].url[0] != '\0') {
+      LOG_DEBUGF("Webhook %d URL: %s\n", i + 1, config.webhooks[i].url);
+    }
+  }
+
+  // The press that woke us up is queued (or still being told apart) from here on. Holding
+  // the button starts the captive portal, see loop()
+  startButton(wakeup_reason == ESP_SLEEP_WAKEUP_GPIO || benchCycle);
+
+  // ESP-NOW doesn't need to connect to the WiFi network
+  if (config.trigger.transport == TRANSPORT_ESPNOW) {
+    setupDispatcher();
+    startEspNow();
   }
-  // Otherwise, check if we have saved configuration
-  else if (ssid.length() > 0 && password.length() > 0) {
-    // Try to connect to WiFi
-    setupWiFi();
+  else if (configuredNetworkCount() > 0) {
+    setupDispatcher();
+    if (config.trigger.transport == TRANSPORT_UDP) {
+      if (triggerSender.beginUdp(config.trigger.gateway, config.trigger.key)) {
+        activeTargets = 1;
+      }
+    } else if (config.trigger.transport == TRANSPORT_MQTT) {
+      setupMqtt();
+    } else {
+      setupWebhookWorkers();
+    }
+    setupFirmwareUpdate();
+    if (benchCycle && benchColdCycle()) {
+      invalidateWiFiCache();
+    }
+    // Start connecting to WiFi, using the cached AP and lease first if we just woke up from sleep.
+    // The connection is completed from loop()
+    startWiFi(wakeup_reason == ESP_SLEEP_WAKEUP_GPIO || wakeup_reason == ESP_SLEEP_WAKEUP_TIMER);
   } else {
-    Serial.println("No saved WiFi credentials, starting AP mode");
+    LOG_INFO("No saved WiFi credentials, starting AP mode");
     setupAP();
     setupWebServer();
   }
 }
 
-void IRAM_ATTR buttonISR() {
-  // Simple debounce - ignore button presses that are too close together
-  unsigned long currentTime = millis();
-  if (currentTime - lastButtonPressTime > DEBOUNCE_TIME) {
-    // Use atomic operation to increment the counter to avoid race conditions
-    // This ensures the increment operation is not interrupted
-    __atomic_fetch_add(&pendingRequests, 1, __ATOMIC_SEQ_CST);
-    lastButtonPressTime = currentTime;
-    
-    // Update activity time in the ISR as well
-    // This is safe since we're only writing to it, not reading
-    lastActivityTime = currentTime;
-    
-    Serial.println("Button pressed - Pending requests: " + String(pendingRequests));
+// Gestures are only told apart if a webhook cares (it is only called for some of them, or
+// its payload has {{gesture}}): that waits DOUBLE_PRESS_WINDOW after each short press.
+// Otherwise, and for the gateway, bridge and broker, every press is sent right away
+void startButton(bool wokenByPress) {
+  bool classify = false;
+  if (config.trigger.transport == TRANSPORT_WEBHOOK) {
+    for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+      const WebhookTarget& webhook = config.webhooks[i];
+      if (webhook.url[0] == '\0') {
+        continue;
+      }
+      uint8_t gestures = config.webhookGestures[i];
+      gestureTargets |= 1 << i;
+      classify |= gestures != 0 || strstr(webhook.payload, "{{gesture}}") != nullptr;
+      for (int gesture = 0; gesture < GESTURE_COUNT; gesture++) {
+        if (gestures != 0 && (gestures & (1 << gesture)) == 0) {
+          gestureSkippedTargets[gesture] |= 1 << i;
+        }
+      }
+    }
+  }
+
+  wakePressPending = wokenByPress;
+  ButtonTiming timing = {DOUBLE_PRESS_WINDOW, LONG_PRESS_TIME, PORTAL_HOLD_TIME};
+  buttonBegin(BUTTON_PIN, classify, timing, onButtonGesture, onButtonHold, wokenByPress);
+  LOG_DEBUGF("Button on GPIO%d, %s\n", BUTTON_PIN, classify ? "telling gestures apart" : "every press is a single press");
+}
+
+// Called from the esp_timer task (see ButtonGestures.h). Keep this minimal: queue the press
+// and wake up loop(). Everything else (logging, activity time, sending) happens in loop()
+// when it drains pressRing
+void onButtonGesture(PressGesture gesture, uint32_t pressTime) {
+  PressType type = wakePressPending ? PRESS_WAKEUP : PRESS_SINGLE;
+  wakePressPending = false;
+  // The webhooks that don't want this gesture count as delivered
+  uint8_t skipped = gestureSkippedTargets[gesture];
+  if (gestureTargets != 0 && (gestureTargets & ~skipped) == 0) {
+    return; // None of them does
   }
+  pressRing.push({nextPressSequence++, pressTime, type, skipped, gesture, false});
+  wakeLoop();
+}
+
+void onButtonHold() {
+  portalRequested = true;
+  wakeLoop();
 }
 
 void loop() {
   wifi_mode_t currentMode = WiFi.getMode();
+  unsigned long waitTime = LOOP_INTERVAL;
   
-  if (currentMode == WIFI_MODE_AP || (currentMode == WIFI_MODE_STA && WiFi.status() != WL_CONNECTED)) {
-    dnsServer.processNextRequest(); // Process DNS requests for captive portal
-    server.handleClient();
+  if (currentMode == WIFI_MODE_STA) {
+    // Advance the connection state machine (may switch to AP mode if all attempts fail)
+    updateWiFiConnection();
+    currentMode = WiFi.getMode();
+  }
+
+  // Held for PORTAL_HOLD_TIME: once what is being sent is done, open the captive portal.
+  // Right here, a restart would clear the RTC memory
+  if (portalRequested && currentMode != WIFI_MODE_AP && dispatchIdle()) {
+    portalRequested = false;
+    LOG_INFO("Button held - starting AP mode");
+    startPortal();
+    currentMode = WiFi.getMode();
+  }
+  
+  if (currentMode == WIFI_MODE_AP) {
+    // DNS and HTTP are served from their own tasks, loop() only waits for the new configuration
     
     // If config was just saved, restart to apply new settings
     if (configSaved) {
-      Serial.println("Configuration saved, restarting...");
-      delay(1000);
+      LOG_INFO("Configuration saved, restarting...");
+      delay(1000); // Let the web server send the confirmation page
+      // The presses kept for later (those startPortal() deferred, and any since) are in RTC
+      // memory, which the restart clears
+      deferPendingPresses();
+      backlogPersist();
       ESP.restart();
     }
     
     // Never go to sleep in AP mode - we need to stay awake for configuration
     
-  } else if (currentMode == WIFI_MODE_STA && WiFi.status() == WL_CONNECTED) {
-    // Connected to WiFi in station mode
+  } else if (currentMode == WIFI_MODE_STA && (wifiState == WIFI_STATE_CONNECTED || wifiState == WIFI_STATE_RADIO_ONLY)) {
+    // Connected to WiFi in station mode (or the ESP-NOW bridge, which needs no connection)
     
-    // Check if we have pending requests and no request is currently in progress
-    if (pendingRequests > 0 && !requestInProgress) {
-      pendingRequests--;
-      Serial.println("Processing pending webhook request");
-      Serial.println("Pending requests: " + String(pendingRequests));
-      sendWebhookRequest(); // Process pending request
-      
-      // Update activity time since we just processed a request
-      lastActivityTime = millis();
+    if (pressRing.dropped() != reportedDroppedPresses) {
+      LOG_INFO("Press queue full, presses dropped so far: " + String(pressRing.dropped()));
+      countDroppedPresses();
     }
     
-    // Check if it's time to go to sleep - only in STA mode with connection
-    // Only avoid sleep if we're processing a request or have pending requests
-    if (!requestInProgress && pendingRequests == 0) {
-      if (millis() - lastActivityTime >= SLEEP_TIMEOUT) {
-        Serial.println("Sleep timeout reached, going to sleep after " + 
-                       String(millis() - lastActivityTime) + "ms of inactivity");
-        goToSleep();
-      }
+    // Presses from previous wake-ups go first, all in one request
+    if (!backlogFlushAttempted && dispatchIdle() && backlogSize() > 0) {
+      backlogFlushAttempted = true;
+      queueDispatch({true, {}});
     }
-  }
-  
-  // Small delay to avoid excessive CPU usage
-  delay(100);
-}
-
-void setupWiFi() {
-  Serial.println("Connecting to WiFi: " + ssid);
-  
-  WiFi.mode(WIFI_STA);
-  delay(100);
-  
-  // Try multiple full connection attempts
-  for (int fullAttempt = 0; fullAttempt < MAX_FULL_CONNECTION_ATTEMPTS; fullAttempt++) {
-    Serial.printf("\nConnection attempt %d of %d\n", fullAttempt + 1, MAX_FULL_CONNECTION_ATTEMPTS);
     
-    // Disconnect if we're already trying to connect
-    WiFi.disconnect();
-    delay(1000);
+    // Hand new presses to the dispatcher task, which sends them (batched if configured)
+    // without blocking loop(). They stay in pressRing while the queue is full
+    PressEvent press;
+    while (pressRing.peek(press) && queueDispatch({false, press})) {
+      pressRing.pop(press);
+    }
 
-    // print password and ssid for debug
-    Serial.println("SSID:" + ssid);
-    
-    // Begin connection attempt
-    WiFi.begin(ssid.c_str(), password.c_str());
-    
-    // Set WiFi power based on configuration
-    if (USE_LOWER_WIFI_POWER) {
-      WiFi.setTxPower(WIFI_POWER_8_5dBm);
-    } else {
-      WiFi.setTxPower(WIFI_POWER_19_5dBm);
+    // A new firmware that delivered a press works
+    if (pressesDelivered) {
+      firmwareMarkValid();
     }
-    
-    // Try multiple times with reasonable delays
-    int attempts = 0;
-    
-    while (WiFi.status() != WL_CONNECTED && attempts < MAX_CONNECTION_ATTEMPTS) {
-      delay(CONNECTION_RETRY_DELAY);
-      Serial.print(".");
-      
-      // Print diagnostic info every few attempts
-      if (attempts % 3 == 0) {
-        wl_status_t status = WiFi.status();
-        Serial.printf("\nAttempt %d/%d - Status: %s\n", 
-                     attempts + 1, MAX_CONNECTION_ATTEMPTS, 
-                     getWiFiStatusString(status).c_str());
-      }
-      
-      attempts++;
+    // Latency benchmark: once the wake press is out, press again over the kept-alive connection
+    if (BENCH_DRIVE_PIN >= 0 && benchCycle && !benchAwakePressed && pressesDelivered && dispatchIdle() && !buttonBusy()) {
+      benchAwakePressed = true;
+      pinMode(BENCH_DRIVE_PIN, OUTPUT);
+      digitalWrite(BENCH_DRIVE_PIN, LOW);
+      delay(BENCH_PRESS_TIME);
+      pinMode(BENCH_DRIVE_PIN, INPUT); // Released, the real button works again
+    }
+    // Updates wait until the presses are out, the button stays awake for them anyway
+    if (otaDue && dispatchIdle() && pressRing.size() == 0) {
+      startFirmwareUpdate();
     }
     
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("\nConnected to WiFi");
-      Serial.println("IP address: " + WiFi.localIP().toString());
-      Serial.printf("Signal strength (RSSI): %d dBm\n", WiFi.RSSI());
-      return; // Successfully connected, exit function
-    } else {
-      wl_status_t status = WiFi.status();
-      Serial.printf("\nConnection attempt %d failed. Status: %s\n", 
-                   fullAttempt + 1, getWiFiStatusString(status).c_str());
-      
-      // If this isn't the last attempt, wait before trying again
-      if (fullAttempt < MAX_FULL_CONNECTION_ATTEMPTS - 1) {
-        Serial.println("Waiting before next connection attempt...");
-        delay(3000);
+    // Check if it's time to go to sleep - only in STA mode with connection
+    // Only avoid sleep if presses are still being sent or waiting to be. The dispatcher
+    // wakes up loop() as soon as it is done, so this runs right after the last request
+    if (dispatchIdle() && pressRing.size() == 0 && !buttonBusy() && !otaRunning) {
+      // Latency benchmark: on to the next cycle as soon as this one has its presses
+      if (LATENCY_BENCH_CYCLES > 0 && benchRunning() && (!benchCycle || benchCycleDone(BENCH_DRIVE_PIN >= 0))) {
+        goToSleep();
+      }
+      // Nobody is around on a timer wake-up, go back to sleep once the backlog was handled
+      if (wokenForRetry && backlogFlushAttempted) {
+        LOG_INFO("Backlog delivery done, going back to sleep");
+        goToSleep();
+      }
+      unsigned long idleTime = millis() - lastActivityTime;
+      // Once everything got through, only wait a moment in case the button is pressed again.
+      // Without a connection to keep (ESP-NOW) there is no point in staying awake longer
+      unsigned long sleepTimeout = SLEEP_TIMEOUT;
+      if ((SLEEP_AFTER_SUCCESS && pressesDelivered && backlogSize() == 0) || wifiState == WIFI_STATE_RADIO_ONLY) {
+        sleepTimeout = SUCCESS_SLEEP_GRACE;
       }
+      if (idleTime >= sleepTimeout) {
+        LOG_INFO("Sleep timeout reached, going to sleep after " + 
+                       String(idleTime) + "ms of inactivity");
+        goToSleep();
+      }
+      // Nothing to poll: block until a press, a WiFi event or the sleep timeout,
+      // so the chip can stay in light sleep the whole time
+      waitTime = sleepTimeout - idleTime;
     }
   }
   
-  // If we get here, all connection attempts failed
-  Serial.println("\nAll connection attempts failed, starting AP mode");
+  // Wait for the next event (WiFi, button press) or waitTime to avoid excessive CPU usage
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitTime));
+}
+
+// Presses that didn't go out yet are kept for a later wake-up
+void startPortal() {
+  deferPendingPresses();
+  setWiFiState(WIFI_STATE_FAILED);
   setupAP();
   setupWebServer();
 }
 
+void enableIdleSleep() {
+#if USE_IDLE_LIGHT_SLEEP
+  if (idleSleepEnabled) {
+    return;
+  }
 
+  // Modem sleep keeps the association while the radio is off between beacons
+  WiFi.setSleep(WIFI_PS_MIN_MODEM);
 
-void setupAP() {
-  Serial.println("Setting up Access Point with Captive Portal");
-  
-  // Ensure WiFi is disconnected before switching to AP mode
-  WiFi.disconnect(true);
-  delay(500);
-  
-  // Set mode to AP only
-  WiFi.mode(WIFI_OFF);
-  delay(100);
-  WiFi.mode(WIFI_AP);
-  delay(500);
-  
-  // Generate a random number to append to the SSID
-  // This helps avoid conflicts with other networks
-  String randomizedSSID = AP_SSID_BASE + String(random(1000, 9999));
-  
-  // Start the AP with the randomized SSID and parameters
-  bool apStarted = WiFi.softAP(randomizedSSID.c_str(), AP_PASSWORD, 1, false, 4);
-  
-  // Set WiFi power based on configuration
-  if (USE_LOWER_WIFI_POWER) {
-    WiFi.setTxPower(WIFI_POWER_8_5dBm);
-  } else {
-    WiFi.setTxPower(WIFI_POWER_19_5dBm);
+  // Only level wakeups are supported in light sleep. This also switches the pin
+  // interrupt to low level, which the button ISR handles by disabling itself
+  gpio_wakeup_enable((gpio_num_t)BUTTON_PIN, GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+
+  if (requestPmLock == nullptr) {
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "webhook", &requestPmLock);
   }
-  
-  // Debug information
-  if (apStarted) {
-    Serial.println("AP successfully started!");
+
+  esp_pm_config_esp32c3_t pmConfig = {};
+  pmConfig.max_freq_mhz = F_CPU / 1000000;
+  pmConfig.min_freq_mhz = IDLE_MIN_CPU_FREQ_MHZ;
+  pmConfig.light_sleep_enable = true;
+  esp_err_t result = esp_pm_configure(&pmConfig);
+  if (result == ESP_ERR_NOT_SUPPORTED) {
+    LOG_INFO("Automatic light sleep not supported by this build, using frequency scaling only");
+    pmConfig.light_sleep_enable = false;
+    result = esp_pm_configure(&pmConfig);
+  }
+
+  if (result == ESP_OK) {
+    idleSleepEnabled = true;
+    LOG_INFO("Idle light sleep enabled");
   } else {
-    Serial.println("Failed to start AP! Check your ESP32 hardware.");
-    // Try one more time with default parameters
-    delay(1000);
-    apStarted = WiFi.softAP(randomizedSSID.c_str(), AP_PASSWORD);
-    Serial.println(apStarted ? "Second attempt succeeded!" : "Second attempt also failed!");
+    LOG_ERRORF("Failed to configure power management, error code: %d\n", result);
   }
-  
-  // Configure DNS server to redirect all domains to the ESP's IP
-  IPAddress apIP = WiFi.softAPIP();
-  dnsServer.start(DNS_PORT, "*", apIP);
-  
-  Serial.println("AP Started with Captive Portal");
-  Serial.println("SSID: " + randomizedSSID);
-  Serial.println("IP address: " + apIP.toString());
-  Serial.println("WiFi mode: " + String(WiFi.getMode()));
-  Serial.println("MAC address: " + WiFi.softAPmacAddress());
-  Serial.println("Channel: 1 (fixed for better compatibility)");
+#endif
 }
 
-void setupWebServer() {
-  // Serve the configuration page for all URLs to create a captive portal effect
-  server.on("/", HTTP_GET, handleRoot);
-  server.on("/save", HTTP_POST, handleSave);
-  
-  // Handle captive portal detection
-  server.on("/generate_204", HTTP_GET, handleRoot);  // Android captive portal detection
-  server.on("/connecttest.txt", HTTP_GET, handleRoot); // Microsoft captive portal detection
-  server.on("/redirect", HTTP_GET, handleRoot); // Microsoft redirect
-  server.on("/hotspot-detect.html", HTTP_GET, handleRoot); // Apple captive portal detection
-  server.on("/canonical.html", HTTP_GET, handleRoot); // Apple captive portal detection
-  server.on("/success.txt", HTTP_GET, handleRoot); // Apple captive portal detection
-  
-  // Catch-all handler for any request that doesn't match the ones above
-  server.onNotFound([]() {
-    server.sendHeader("Location", String("http://") + WiFi.softAPIP().toString(), true);
-    server.send(302, "text/plain", ""); // Empty content for redirect
-  });
-  
-  server.begin();
-  Serial.println("Web server started with captive portal");
+// Back to full speed without light sleep (needed for AP mode)
+void disableIdleSleep() {
+  if (!idleSleepEnabled) {
+    return;
+  }
+
+  esp_pm_config_esp32c3_t pmConfig = {};
+  pmConfig.max_freq_mhz = F_CPU / 1000000;
+  pmConfig.min_freq_mhz = pmConfig.max_freq_mhz;
+  pmConfig.light_sleep_enable = false;
+  esp_pm_configure(&pmConfig);
+
+  gpio_wakeup_disable((gpio_num_t)BUTTON_PIN);
+  gpio_set_intr_type((gpio_num_t)BUTTON_PIN, GPIO_INTR_NEGEDGE);
+  idleSleepEnabled = false;
+  LOG_INFO("Idle light sleep disabled");
 }
 
-void handleRoot() {
-  // Update activity time when user accesses the configuration page
-  lastActivityTime = millis();
-  String html = "<html><head><title>GrotBot Configuration</title>"
-                "<meta name='viewport' content='width=device-width, initial-scale=1'>"
-                "<style>"
-                "body { font-family: Arial, sans-serif; max-width: 800px; margin: 0 auto; padding: 20px; }"
-                "h1 { color: #333; text-align: center; }"
-                "h2 { color: #444; border-bottom: 1px solid #eee; padding-bottom: 10px; }"
-                ".form-group { margin-bottom: 15px; }"
-                "label { display: block; margin-bottom: 5px; font-weight: bold; }"
-                "input[type='text'], input[type='password'], select, textarea { width: 100%; padding: 8px; box-sizing: border-box; margin-bottom: 10px; }"
-                "button { background-color: #4CAF50; color: white; padding: 10px 15px; border: none; cursor: pointer; width: 100%; font-size: 16px; }"
-                ".form-section { background: #f9f9f9; padding: 15px; border-radius: 5px; margin-bottom: 20px; }"
-                "small { display: block; margin-top: 5px; color: #666; font-size: 0.9em; }"
-                "</style></head>"
-                "<body><h1>GrotBot Configuration</h1>"
-                "<form action='/save' method='post'>"
-                
-                "<div class='form-section'><h2>WiFi Settings</h2>"
-                "<div class='form-group'>"
-                "<label for='ssid'>WiFi SSID:</label>"
-                "<input type='text' id='ssid' name='ssid' value='" + ssid + "' required>"
-                "</div>"
-                "<div class='form-group'>"
-                "<label for='password'>WiFi Password:</label>"
-                "<input type='text' id='password' name='password' value='" + password + "' required>"
-                "<small>Make sure there are no extra spaces in your password</small>"
-                "</div></div>"
-                
-                "<div class='form-section'><h2>Webhook Settings</h2>"
-                "<div class='form-group'>"
-                "<label for='webhook'>Webhook URL:</label>"
-                "<input type='text' id='webhook' name='webhook' value='" + webhookUrl + "' required>"
-                "</div>"
-                
-                "<div class='form-group'>"
-                "<label for='webhook_method'>HTTP Method:</label>"
-                "<select id='webhook_method' name='webhook_method'>"
-                "<option value='GET'" + (webhookMethod == "GET" ? " selected" : "") + ">GET</option>"
-                "<option value='POST'" + (webhookMethod == "POST" ? " selected" : "") + ">POST</option>"
-                "</select>"
-                "</div>"
-                
-                "<div class='form-group'>"
-                "<label for='webhook_headers'>Headers (one per line):</label>"
-                "<textarea id='webhook_headers' name='webhook_headers' rows='4'>" + webhookHeaders + "</textarea>"
-                "<small>Example: Content-Type: application/json</small>"
-                "</div>"
-                
-                "<div class='form-group'>"
-                "<label for='webhook_payload'>Request Payload (for POST requests):</label>"
-                "<textarea id='webhook_payload' name='webhook_payload' rows='4'>" + webhookPayload + "</textarea>"
-                "<small>For JSON, use regular quotes (no escape characters)</small>"
-                "</div></div>"
-                
-                "<button type='submit'>Save and Connect</button>"
-                "</form></body></html>";
-  
-  server.send(200, "text/html", html);
+// Simple FNV-1a hash, used to tie cached data to the configuration it was created with
+uint32_t fnv1aHash(const char* input, uint32_t hash = 2166136261UL) {
+  for (; *input != '\0'; input++) {
+    hash ^= (uint8_t)*input;
+    hash *= 16777619UL;
+  }
+  return hash;
 }
 
-void handleSave() {
-  // Update activity time when user submits form
-  lastActivityTime = millis();
-  
-  if (server.hasArg("ssid") && server.hasArg("password") && server.hasArg("webhook")) {
-    // Get form values and trim whitespace to prevent connection issues
-    ssid = server.arg("ssid");
-    password = server.arg("password");
-    webhookUrl = server.arg("webhook");
-    webhookMethod = server.arg("webhook_method");
-    webhookHeaders = server.arg("webhook_headers");
-    webhookPayload = server.arg("webhook_payload");
-    
-    // Trim whitespace from beginning and end of credentials
-    ssid.trim();
-    password.trim();
-    webhookUrl.trim();
-    webhookMethod.trim();
-    webhookHeaders.trim();
-    webhookPayload.trim();
-    
-    Serial.println("Trimmed credentials to remove any extra spaces:");
-    Serial.println("SSID length: " + String(ssid.length()));
-    Serial.println("Password length: " + String(password.length()));
-    
-    // Save to preferences
-    preferences.putString("ssid", ssid);
-    preferences.putString("password", password);
-    preferences.putString("webhook", webhookUrl);
-    preferences.putString("webhook_method", webhookMethod);
-    preferences.putString("webhook_headers", webhookHeaders);
-    preferences.putString("webhook_payload", webhookPayload);
-    
-    Serial.println("New configuration saved:");
-    Serial.println("SSID: " + ssid);
-    Serial.println("Password: '" + password + "'"); // Print actual password with quotes to see any spaces
-    Serial.println("Webhook URL: " + webhookUrl);
-    
-    String html = "<!DOCTYPE html>"
-                  "<html>"
-                  "<head>"
-                  "<title>Configuration Saved</title>"
-                  "<meta name='viewport' content='width=device-width, initial-scale=1'>"
-                  "<style>"
-                  "body { font-family: Arial, sans-serif; margin: 20px; text-align: center; }"
-                  "h1 { color: #4CAF50; }"
-                  "</style>"
-                  "</head>"
-                  "<body>"
-                  "<h1>Configuration Saved!</h1>"
-                  "<p>The device will now restart and attempt to connect to the WiFi network.</p>"
-                  "</body>"
-                  "</html>";
-    
-    server.send(200, "text/html", html);
-    configSaved = true;
-  } else {
-    server.send(400, "text/plain", "Missing required fields");
+uint32_t wifiCredentialsHash(int network) {
+  return fnv1aHash(config.networks[network].password, fnv1aHash(config.networks[network].ssid));
+}
+
+uint32_t wifiNetworksHash() {
+  uint32_t hash = 2166136261UL;
+  for (const WifiNetwork& network : config.networks) {
+    hash = fnv1aHash("\n", fnv1aHash(network.ssid, hash));
   }
+  return hash;
 }
 
-// Helper function to escape JSON strings
-String escapeJsonString(const String& input) {
-    String output;
-    output.reserve(input.length() * 1.1); // Reserve some extra space for escape characters
-    
-    for (size_t i = 0; i < input.length(); i++) {
-        char c = input.charAt(i);
-        switch (c) {
-            case '\\': output += "\\\\"; break;
-            case '\"': output += "\\\""; break;
-            case '\b': output += "\\b"; break;
-            case '\f': output += "\\f"; break;
-            case '\n': output += "\\n"; break;
-            case '\r': output += "\\r"; break;
-            case '\t': output += "\\t"; break;
-            default:
-                if (c >= ' ' && c <= '~') {
-                    output += c;
-                } else {
-                    // Convert to \uXXXX for non-printable characters
-                    char buf[7];
-                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
-                    output += buf;
-                }
-        }
-    }
-    
-    return output;
+bool networkConfigured(int network) {
+  return config.networks[network].ssid[0] != '\0' && config.networks[network].password[0] != '\0';
 }
 
-void sendWebhookRequest() {
-    requestInProgress = true;
-    lastActivityTime = millis();
+int configuredNetworkCount() {
+  int count = 0;
+  for (int i = 0; i < WIFI_NETWORKS; i++) {
+    count += networkConfigured(i);
+  }
+  return count;
+}
 
-    if (webhookUrl.length() == 0) {
-        Serial.println("Webhook URL not set, skipping request");
-        requestInProgress = false;
-        return;
-    }
+const char* transportName(uint8_t transport) {
+  switch (transport) {
+    case TRANSPORT_UDP: return "udp";
+    case TRANSPORT_ESPNOW: return "espnow";
+    case TRANSPORT_MQTT: return "mqtt";
+    default: return "webhook";
+  }
+}
 
-    HTTPClient http;
-    Serial.println("Preparing to send request to: " + webhookUrl);
-    // Use WiFiClientSecure for HTTPS and set insecure mode for testing
-    WiFiClientSecure client;
-    client.setInsecure(); // disables certificate validation (for testing)
-    http.begin(client, webhookUrl);
-
-    // Parse headers from free text (one per line, Header: Value)
-    int lineStart = 0;
-    while (lineStart < webhookHeaders.length()) {
-        int lineEnd = webhookHeaders.indexOf('\n', lineStart);
-        if (lineEnd == -1) lineEnd = webhookHeaders.length();
-        String line = webhookHeaders.substring(lineStart, lineEnd);
-        line.trim();
-        if (line.length() > 0) {
-            int colon = line.indexOf(':');
-            if (colon > 0) {
-                String key = line.substring(0, colon);
-                String value = line.substring(colon + 1);
-                key.trim();
-                value.trim();
-                http.addHeader(key, value);
-                Serial.println("Added header: " + key);
-            }
-        }
-        lineStart = lineEnd + 1;
+// Only the first connection of the wake-up counts, a reconnect after losing it is not how
+// the wake-up started
+void setLinkReady(const char* mode) {
+  if (linkMode == nullptr) {
+    linkMode = mode;
+    linkReadyTime = millis();
+    traceTag(TRACE_TAG_CONNECTION, mode);
+  }
+}
+
+void countDroppedPresses() {
+  uint32_t dropped = pressRing.dropped();
+  metricsCount(METRIC_PRESSES_DROPPED, dropped - reportedDroppedPresses);
+  reportedDroppedPresses = dropped;
+}
+
+void setWiFiState(WiFiConnectionState state) {
+  wifiState = state;
+  wifiStateStartTime = millis();
+}
+
+int currentTxPowerLevel() {
+  if (!ADAPTIVE_TX_POWER || txPowerLevel < 0 || txPowerLevel > TX_POWER_MAX_LEVEL) {
+    return TX_POWER_MAX_LEVEL;
+  }
+  return txPowerLevel;
+}
+
+void applyWiFiTxPower() {
+  WiFi.setTxPower(txPowerLevels[currentTxPowerLevel()]);
+}
+
+// More power right away, and for the next wake-ups
+void raiseTxPower(const char* reason) {
+  int level = currentTxPowerLevel();
+  txPowerRaised = true;
+  if (!ADAPTIVE_TX_POWER || level == TX_POWER_MAX_LEVEL) {
+    txPowerLevel = level;
+    return;
+  }
+  txPowerLevel = level + 1;
+  LOG_INFOF("Raising WiFi TX power to level %d (%s)\n", txPowerLevel, reason);
+  applyWiFiTxPower();
+}
+
+// Once connected, adjust the power to the signal of the AP
+void adaptTxPower(int rssi) {
+  if (rssi < TX_POWER_WEAK_RSSI) {
+    raiseTxPower("weak signal");
+    return;
+  }
+  int level = currentTxPowerLevel();
+  // Only if the connection worked at this level right away, otherwise the level would
+  // go down and up again on every wake-up. Applied from the next connection on
+  if (ADAPTIVE_TX_POWER && rssi > TX_POWER_STRONG_RSSI && !txPowerRaised && level > 0) {
+    level--;
+    LOG_DEBUGF("Strong signal, next connections use TX power level %d\n", level);
+  }
+  txPowerLevel = level;
+}
+
+// Clear events left over from a previous attempt right before starting a new one
+void clearWiFiEvents() {
+  wifiGotIP = false;
+  wifiDisconnected = false;
+}
+
+// Valid for the current networks, not too old, and it found at least one of them
+bool wifiScanUsable() {
+  if (wifiScanCache.magic != WIFI_SCAN_CACHE_MAGIC || wifiScanCache.networksHash != wifiNetworksHash() ||
+      rtcTimeMs() - wifiScanCache.scanTime >= WIFI_SCAN_CACHE_TTL) {
+    return false;
+  }
+  for (int i = 0; i < WIFI_NETWORKS; i++) {
+    if (networkConfigured(i) && wifiScanCache.networks[i].channel != 0) {
+      return true;
     }
+  }
+  return false;
+}
 
-    int httpResponseCode = -1;
-    String response;
-    if (webhookMethod.equalsIgnoreCase("POST")) {
-        // Only send payload for POST
-        String payload = webhookPayload;
-        Serial.println("Sending POST request with payload: " + payload);
-        httpResponseCode = http.POST(payload);
-    } else {
-        Serial.println("Sending GET request");
-        httpResponseCode = http.GET();
+// Next network to try in this cycle, -1 once all of them were. With a scan, only the
+// networks it found: the last one that worked unless its signal is weak, else the strongest
+int pickWiFiNetwork() {
+  int best = -1;
+  for (int i = 0; i < WIFI_NETWORKS; i++) {
+    if (!networkConfigured(i) || (wifiNetworksTried & (1 << i))) {
+      continue;
+    }
+    if (!wifiCycleScanned) {
+      if (i == lastWiFiNetwork) {
+        return i;
+      }
+      if (best < 0) best = i;
+      continue;
+    }
+    if (wifiScanCache.networks[i].channel == 0) {
+      continue;
     }
+    int8_t rssi = wifiScanCache.networks[i].rssi;
+    if (i == lastWiFiNetwork && rssi >= TX_POWER_WEAK_RSSI) {
+      return i;
+    }
+    if (best < 0 || rssi > wifiScanCache.networks[best].rssi) {
+      best = i;
+    }
+  }
+  return best;
+}
 
-    if (httpResponseCode > 0) {
-        response = http.getString();
-        Serial.println("HTTP Response code: " + String(httpResponseCode));
-        Serial.println("Response: " + response);
-    } else {
-        Serial.println("Error on HTTP request. Error code: " + String(httpResponseCode));
+// Joins the next network of the cycle, on the AP the scan found for it if there was a scan
+void beginNetworkConnection() {
+  if (wifiNetworksTried == 0) {
+    wifiCycleScanned = wifiScanUsable();
+  }
+  int network = pickWiFiNetwork();
+  if (network < 0) {
+    network = 0; // Only if nothing is configured, setup() doesn't get here then
+  }
+  wifiNetwork = network;
+  wifiNetworksTried |= 1 << network;
+  const WifiNetwork& credentials = config.networks[network];
+  LOG_DEBUGF("SSID: %s\n", credentials.ssid);
+
+  clearWiFiEvents();
+  traceMark(TRACE_WIFI_BEGIN);
+  if (wifiCycleScanned) {
+    const auto& seen = wifiScanCache.networks[network];
+    LOG_INFOF("Joining %s on channel %d (%d dBm when scanned)\n", credentials.ssid, seen.channel, seen.rssi);
+    WiFi.begin(credentials.ssid, credentials.password, seen.channel, seen.bssid);
+  } else {
+    WiFi.begin(credentials.ssid, credentials.password);
+  }
+  applyWiFiTxPower();
+  setWiFiState(WIFI_STATE_CONNECTING);
+}
+
+// A full connection cycle. With several networks and no usable scan, scans first
+void beginFullConnection() {
+  wifiConnectionAttempt++;
+  wifiNetworksTried = 0;
+  LOG_INFOF("\nConnection attempt %d of %d\n", wifiConnectionAttempt, MAX_FULL_CONNECTION_ATTEMPTS);
+
+  if (configuredNetworkCount() > 1 && !wifiScanUsable()) {
+    LOG_INFO("Scanning for the configured WiFi networks");
+    clearWiFiEvents();
+    traceMark(TRACE_WIFI_BEGIN);
+    if (WiFi.scanNetworks(true, false, false, WIFI_SCAN_CHANNEL_TIME) == WIFI_SCAN_RUNNING) {
+      setWiFiState(WIFI_STATE_SCANNING);
+      return;
     }
+    LOG_ERROR("Could not start the WiFi scan, trying the networks in order");
+  }
+  beginNetworkConnection();
+}
 
-    http.end();
-    lastActivityTime = millis();
-    requestInProgress = false;
+// Try to reconnect to the last known AP with the last known lease as a static IP
+bool beginFastConnection() {
+  if (wifiCache.magic != WIFI_CACHE_MAGIC || wifiCache.network >= WIFI_NETWORKS ||
+      wifiCache.credentialsHash != wifiCredentialsHash(wifiCache.network)) {
+    LOG_INFO("No valid fast reconnect cache, using full connection cycle");
+    return false;
+  }
+
+  LOG_INFOF("Fast reconnect to %02X:%02X:%02X:%02X:%02X:%02X on channel %d with IP %s\n",
+                wifiCache.bssid[0], wifiCache.bssid[1], wifiCache.bssid[2],
+                wifiCache.bssid[3], wifiCache.bssid[4], wifiCache.bssid[5],
+                wifiCache.channel, IPAddress(wifiCache.localIP).toString().c_str());
+
+  clearWiFiEvents();
+  WiFi.config(IPAddress(wifiCache.localIP), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet),
+              IPAddress(wifiCache.dns1), IPAddress(wifiCache.dns2));
+  traceMark(TRACE_WIFI_BEGIN);
+  wifiNetwork = wifiCache.network;
+  WiFi.begin(config.networks[wifiNetwork].ssid, config.networks[wifiNetwork].password, wifiCache.channel, wifiCache.bssid);
+  applyWiFiTxPower();
+  setWiFiState(WIFI_STATE_FAST_CONNECTING);
+  return true;
 }
 
+// ESP-NOW only needs the radio on, there is no connection to wait for
+void startEspNow() {
+  LOG_INFOF("Sending presses to the ESP-NOW bridge %s\n", config.trigger.gateway);
+  WiFi.mode(WIFI_STA);
+  applyWiFiTxPower();
+  if (triggerSender.beginEspNow(config.trigger.gateway, config.trigger.channel, config.trigger.key)) {
+    activeTargets = 1;
+  }
+  setWiFiState(WIFI_STATE_RADIO_ONLY);
+  setLinkReady("radio");
+}
 
-void goToSleep() {
-  Serial.println("Going to deep sleep. Can be woken by button press only");
-  Serial.println("Current button state before sleep: " + String(digitalRead(BUTTON_PIN) == HIGH ? "HIGH (not pressed)" : "LOW (pressed)"));
-  
-  // Detach interrupt before going to sleep to avoid any potential conflicts
-  detachInterrupt(BUTTON_PIN);
-  Serial.println("Interrupt detached before sleep");
-  
-  // Configure GPIO for wake-up again right before sleep
-  esp_err_t result = esp_deep_sleep_enable_gpio_wakeup(1ULL << BUTTON_PIN, ESP_GPIO_WAKEUP_GPIO_LOW);
-  if (result == ESP_OK) {
-    Serial.println("Deep sleep wake-up reconfigured before sleep");
-  } else {
-    Serial.print("Failed to reconfigure wake-up, error: ");
-    Serial.println(result);
+void startWiFi(bool fastReconnect) {
+  LOG_INFOF("Connecting to WiFi (%d networks configured)\n", configuredNetworkCount());
+
+  WiFi.onEvent(onWiFiEvent);
+  WiFi.mode(WIFI_STA);
+  // Retries are driven by updateWiFiConnection(), not by the WiFi library
+  WiFi.setAutoReconnect(false);
+  // Full connections scan every channel and pick the strongest AP with our SSID, instead of
+  // the first one found. Its BSSID is then cached for the fast reconnects
+  WiFi.setScanMethod(WIFI_ALL_CHANNEL_SCAN);
+  WiFi.setSortMethod(WIFI_CONNECT_AP_BY_SIGNAL);
+  wifiConnectionAttempt = 0;
+  wifiConnectStart = millis();
+
+  if (!fastReconnect || !beginFastConnection()) {
+    beginFullConnection();
+  }
+}
+
+// Stop the current attempt and schedule the next full connection cycle (or give up)
+void retryWiFi(unsigned long backoffDelay) {
+  // If the attempt timed out, stop whatever the driver is still trying. Its disconnect
+  // event arrives during the backoff and is cleared before the next attempt starts
+  if (!wifiDisconnected) {
+    WiFi.disconnect();
+  }
+
+  if (wifiConnectionAttempt >= MAX_FULL_CONNECTION_ATTEMPTS) {
+    // Don't lose presses: keep them for later and retry from deep sleep with a timer.
+    // Hold the button for PORTAL_HOLD_TIME to get to the captive portal
+    if (pressRing.size() > 0 || backlogSize() > 0) {
+      LOG_INFO("\nAll connection attempts failed, keeping presses for later delivery");
+      setWiFiState(WIFI_STATE_FAILED);
+      goToSleep();
+      return;
+    }
+    LOG_INFO("\nAll connection attempts failed, starting AP mode");
+    metricsCount(METRIC_AP_FALLBACKS);
+    setWiFiState(WIFI_STATE_FAILED);
+    setupAP();
+    setupWebServer();
+    return;
+  }
+
+  if (backoffDelay == 0) {
+    beginFullConnection();
+    return;
+  }
+
+  wifiBackoffDelay = backoffDelay;
+  LOG_INFOF("Waiting %lu ms before next connection attempt...\n", wifiBackoffDelay);
+  setWiFiState(WIFI_STATE_BACKOFF);
+}
+
+// Exponential backoff: CONNECTION_BACKOFF_BASE after the first failed cycle, doubled after each one
+unsigned long nextBackoffDelay() {
+  unsigned long backoff = CONNECTION_BACKOFF_BASE << min(wifiConnectionAttempt - 1, 8);
+  return min(backoff, (unsigned long)CONNECTION_BACKOFF_MAX);
+}
+
+void updateWiFiConnection() {
+  unsigned long elapsed = millis() - wifiStateStartTime;
+
+  switch (wifiState) {
+    case WIFI_STATE_FAST_CONNECTING:
+    case WIFI_STATE_CONNECTING:
+      if (wifiGotIP) {
+        bool fast = wifiState == WIFI_STATE_FAST_CONNECTING;
+        setWiFiState(WIFI_STATE_CONNECTED);
+        enableIdleSleep();
+        lastWiFiNetwork = wifiNetwork;
+        LOG_INFOF("\nConnected to WiFi %s in %lu ms%s\n", config.networks[wifiNetwork].ssid, elapsed,
+                  fast ? " (fast reconnect)" : "");
+        setLinkReady(fast ? "fast" : "cold");
+        metricsObserve(METRIC_WIFI_CONNECT_MS, millis() - wifiConnectStart);
+        startMetricsServer();
+        LOG_DEBUG("IP address: " + WiFi.localIP().toString());
+        int rssi = WiFi.RSSI();
+        LOG_DEBUGF("Signal strength (RSSI): %d dBm\n", rssi);
+        adaptTxPower(rssi);
+        // Only a DHCP lease is worth caching, a fast reconnect reuses the cached one. If the
+        // cached AP got weak, the next wake-up scans again for the strongest one
+        if (!fast) {
+          saveWiFiCache();
+        } else if (rssi < TX_POWER_WEAK_RSSI) {
+          invalidateWiFiCache();
+        }
+        break;
+      }
+
+      if (wifiState == WIFI_STATE_FAST_CONNECTING) {
+        if (wifiDisconnected || elapsed >= FAST_RECONNECT_TIMEOUT) {
+          LOG_INFOF("Fast reconnect failed after %lu ms (disconnect reason: %d)\n",
+                        elapsed, wifiDisconnected ? wifiDisconnectReason : 0);
+          metricsCount(METRIC_WIFI_FAILURES);
+          // The AP or the lease might have changed, don't try again until the next full connection
+          invalidateWiFiCache();
+          // Go back to DHCP for the full connection cycle
+          WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+          // Start the full cycle right away, unless the driver was still trying and needs a moment to settle.
+          // A failed fast attempt doesn't count as a full connection cycle
+          retryWiFi(wifiDisconnected ? 0 : CONNECTION_BACKOFF_BASE);
+        }
+        break;
+      }
+
+      if (wifiDisconnected || elapsed >= CONNECTION_ATTEMPT_TIMEOUT) {
+        LOG_INFOF("\nConnection attempt %d failed on %s. Status: %s (disconnect reason: %d)\n",
+                      wifiConnectionAttempt, config.networks[wifiNetwork].ssid,
+                      getWiFiStatusString(WiFi.status()).c_str(), wifiDisconnected ? wifiDisconnectReason : 0);
+        metricsCount(METRIC_WIFI_FAILURES);
+        // Don't join that AP again before the next scan
+        wifiScanCache.networks[wifiNetwork].channel = 0;
+        if (pickWiFiNetwork() >= 0) {
+          // Next network of the cycle, after letting the driver settle if it was still trying
+          if (wifiDisconnected) {
+            beginNetworkConnection();
+          } else {
+            WiFi.disconnect();
+            wifiBackoffDelay = CONNECTION_BACKOFF_BASE;
+            setWiFiState(WIFI_STATE_BACKOFF);
+          }
+          break;
+        }
+        raiseTxPower("connection attempt failed");
+        retryWiFi(nextBackoffDelay());
+      }
+      break;
+
+    case WIFI_STATE_SCANNING: {
+      int16_t found = WiFi.scanComplete();
+      if (found == WIFI_SCAN_RUNNING && elapsed < WIFI_SCAN_TIMEOUT) {
+        break;
+      }
+      if (found >= 0) {
+        LOG_INFOF("WiFi scan found %d APs in %lu ms\n", found, elapsed);
+        saveWiFiScan(found);
+      } else {
+        LOG_INFO("WiFi scan failed, trying the networks in order");
+        esp_wifi_scan_stop();
+      }
+      WiFi.scanDelete();
+      beginNetworkConnection();
+      break;
+    }
+
+    case WIFI_STATE_BACKOFF:
+      if (elapsed >= wifiBackoffDelay) {
+        // Either the rest of this cycle or the next one
+        if (wifiNetworksTried != 0 && pickWiFiNetwork() >= 0) {
+          beginNetworkConnection();
+        } else {
+          beginFullConnection();
+        }
+      }
+      break;
+
+    case WIFI_STATE_CONNECTED:
+      if (wifiDisconnected) {
+        LOG_INFOF("WiFi connection lost (reason: %d), reconnecting\n", wifiDisconnectReason);
+        // Kept-alive webhook connections didn't survive this
+        for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+          webhookWorkers[i].connectionLost = true;
+        }
+        mqttConnectionLost = true;
+        raiseTxPower("connection lost");
+        metricsCount(METRIC_WIFI_LOST);
+        // A fast reconnect left the cached lease as a static IP: go back to DHCP, and
+        // don't reuse that lease at the next wake-up either
+        invalidateWiFiCache();
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+        wifiConnectionAttempt = 0;
+        wifiConnectStart = millis();
+        beginFullConnection();
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Runs in the WiFi event task: only record what happened and wake up loop()
+void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+      // Associated, still waiting for an IP
+      traceMark(TRACE_WIFI_ASSOCIATED);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      traceMark(TRACE_WIFI_GOT_IP);
+      wifiGotIP = true;
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      wifiDisconnectReason = info.wifi_sta_disconnected.reason;
+      wifiDisconnected = true;
+      wifiGotIP = false;
+      break;
+    case ARDUINO_EVENT_WIFI_SCAN_DONE:
+      break; // Results are read by updateWiFiConnection()
+    default:
+      return;
+  }
+  wakeLoop();
+}
+
+void wakeLoop() {
+  if (loopTaskHandle != nullptr) {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+}
+
+// Store the current AP and DHCP lease so the next wake-up can skip scan and DHCP
+void saveWiFiCache() {
+  uint8_t* bssid = WiFi.BSSID();
+  if (bssid == nullptr) {
+    return;
+  }
+
+  memcpy(wifiCache.bssid, bssid, sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.localIP = (uint32_t)WiFi.localIP();
+  wifiCache.gateway = (uint32_t)WiFi.gatewayIP();
+  wifiCache.subnet = (uint32_t)WiFi.subnetMask();
+  wifiCache.dns1 = (uint32_t)WiFi.dnsIP(0);
+  wifiCache.dns2 = (uint32_t)WiFi.dnsIP(1);
+  wifiCache.network = wifiNetwork;
+  wifiCache.credentialsHash = wifiCredentialsHash(wifiNetwork);
+  wifiCache.magic = WIFI_CACHE_MAGIC;
+  LOG_DEBUG("Saved connection details for fast reconnect");
+}
+
+void invalidateWiFiCache() {
+  wifiCache.magic = 0;
+}
+
+// Keeps the strongest AP of each configured network from the scan results
+void saveWiFiScan(int found) {
+  memset(&wifiScanCache, 0, sizeof(wifiScanCache));
+  for (int i = 0; i < found; i++) {
+    const wifi_ap_record_t* ap = (const wifi_ap_record_t*)WiFi.getScanInfoByIndex(i);
+    if (ap == nullptr) {
+      continue;
+    }
+    for (int network = 0; network < WIFI_NETWORKS; network++) {
+      auto& seen = wifiScanCache.networks[network];
+      if (networkConfigured(network) && strcmp((const char*)ap->ssid, config.networks[network].ssid) == 0 &&
+          (seen.channel == 0 || ap->rssi > seen.rssi)) {
+        seen.channel = ap->primary;
+        seen.rssi = ap->rssi;
+        memcpy(seen.bssid, ap->bssid, sizeof(seen.bssid));
+      }
+    }
+  }
+  for (int network = 0; network < WIFI_NETWORKS; network++) {
+    if (wifiScanCache.networks[network].channel != 0) {
+      LOG_DEBUGF("Network %s: channel %d, %d dBm\n", config.networks[network].ssid,
+                 wifiScanCache.networks[network].channel, wifiScanCache.networks[network].rssi);
+    }
+  }
+  wifiScanCache.networksHash = wifiNetworksHash();
+  wifiScanCache.scanTime = rtcTimeMs();
+  wifiScanCache.magic = WIFI_SCAN_CACHE_MAGIC;
+}
+
+void setupAP() {
+  LOG_INFO("Setting up Access Point with Captive Portal");
+  disableIdleSleep();
+  
+  // Ensure WiFi is disconnected before switching to AP mode
+  WiFi.disconnect(true);
+  delay(500);
+  
+  // Set mode to AP only
+  WiFi.mode(WIFI_OFF);
+  delay(100);
+  WiFi.mode(WIFI_AP);
+  delay(500);
+  
+  // Generate a random number to append to the SSID
+  // This helps avoid conflicts with other networks
+  String randomizedSSID = AP_SSID_BASE + String(random(1000, 9999));
+  
+  // Start the AP with the randomized SSID and parameters
+  bool apStarted = WiFi.softAP(randomizedSSID.c_str(), AP_PASSWORD, 1, false, 4);
+  
+  // Always the highest level, the portal is used from wherever the phone is
+  WiFi.setTxPower(txPowerLevels[TX_POWER_MAX_LEVEL]);
+  
+  // Debug information
+  if (apStarted) {
+    LOG_INFO("AP successfully started!");
+  } else {
+    LOG_ERROR("Failed to start AP! Check your ESP32 hardware.");
+    // Try one more time with default parameters
+    delay(1000);
+    apStarted = WiFi.softAP(randomizedSSID.c_str(), AP_PASSWORD);
+    LOG_INFO(apStarted ? "Second attempt succeeded!" : "Second attempt also failed!");
+  }
+  
+  // Configure DNS server to redirect all domains to the ESP's IP
+  IPAddress apIP = WiFi.softAPIP();
+  dnsServer.begin(apIP, DNS_PORT);
+  
+  LOG_INFO("AP Started with Captive Portal");
+  LOG_INFO("SSID: " + randomizedSSID);
+  LOG_INFO("IP address: " + apIP.toString());
+  LOG_DEBUG("WiFi mode: " + String(WiFi.getMode()));
+  LOG_DEBUG("MAC address: " + WiFi.softAPmacAddress());
+  LOG_DEBUG("Channel: 1 (fixed for better compatibility)");
+}
+
+void setupWebServer() {
+  // Only the form needs the headers as text, the certificate and the settings of the
+  // transports that are not used
+  loadDeviceConfig(preferences, config, true);
+  for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+    webhookHeaders[i] = preferences.getString(webhookHeadersKey(i), "");
+  }
+  tlsCertificate = preferences.getString(CONFIG_CERTIFICATE_KEY, "");
+
+  portalUrl = "http://" + WiFi.softAPIP().toString() + "/";
+  // Configuration page and form submission. The pages stay registered if the portal is
+  // opened again, and the metrics server may already be running
+  if (!portalPagesAdded) {
+    portalPagesAdded = true;
+    server.on("/", HTTP_GET, handleRoot);
+    server.on("/save", HTTP_POST, handleSave);
+
+    // Operating systems probe these URLs to detect captive portals: anything other than
+    // their expected answer makes them show the portal, so a bare redirect is enough and
+    // the form is only rendered once the user opens it
+    server.on("/generate_204", HTTP_GET, handleCaptiveProbe);  // Android captive portal detection
+    server.on("/gen_204", HTTP_GET, handleCaptiveProbe);  // Android captive portal detection
+    server.on("/connecttest.txt", HTTP_GET, handleCaptiveProbe); // Microsoft captive portal detection
+    server.on("/ncsi.txt", HTTP_GET, handleCaptiveProbe); // Microsoft captive portal detection (older versions)
+    server.on("/redirect", HTTP_GET, handleCaptiveProbe); // Microsoft redirect
+    server.on("/hotspot-detect.html", HTTP_GET, handleCaptiveProbe); // Apple captive portal detection
+    server.on("/canonical.html", HTTP_GET, handleCaptiveProbe); // Firefox captive portal detection
+    server.on("/success.txt", HTTP_GET, handleCaptiveProbe); // Firefox captive portal detection
+
+    // Catch-all handler for any request that doesn't match the ones above
+    server.onNotFound(handleCaptiveProbe);
+  }
+
+  beginWebServer();
+  LOG_INFO("Web server started with captive portal");
+}
+
+// Starts the server once, with /metrics, whichever of the portal and the metrics server
+// needs it first
+void beginWebServer() {
+  if (webServerStarted) {
+    return;
+  }
+  webServerStarted = true;
+  if (METRICS_ENDPOINT) {
+    server.on("/metrics", HTTP_GET, handleMetrics);
+  }
+  server.begin();
+}
+
+// While connected the web server only serves the counters
+void startMetricsServer() {
+  if (!METRICS_ENDPOINT || webServerStarted) {
+    return;
+  }
+  beginWebServer();
+  LOG_INFOF("Metrics at http://%s/metrics\n", WiFi.localIP().toString().c_str());
+}
+
+void handleMetrics(AsyncWebServerRequest* request) {
+  AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+  metricsWrite(*response);
+  response->printf("# HELP grotbot_presses_total Presses since the last power cycle\n"
+                   "# TYPE grotbot_presses_total counter\ngrotbot_presses_total %lu\n",
+                   (unsigned long)nextPressSequence);
+  response->printf("# HELP grotbot_backlog_presses Presses waiting for a later delivery\n"
+                   "# TYPE grotbot_backlog_presses gauge\ngrotbot_backlog_presses %lu\n",
+                   (unsigned long)backlogSize());
+  if (WiFi.status() == WL_CONNECTED) {
+    response->printf("# HELP grotbot_wifi_rssi_dbm Signal of the AP\n"
+                     "# TYPE grotbot_wifi_rssi_dbm gauge\ngrotbot_wifi_rssi_dbm %d\n", WiFi.RSSI());
+  }
+  request->send(response);
+}
+
+// Redirect to the configuration page, without a body
+void handleCaptiveProbe(AsyncWebServerRequest* request) {
+  AsyncWebServerResponse* response = request->beginResponse(302);
+  response->addHeader("Location", portalUrl);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+// One chunked response of the portal page: goes through the flash chunks and the
+// configuration values (HTML escaped on the fly) filling each buffer the web server
+// asks for, so neither the page nor its values are ever copied to the heap
+struct PortalPageStream {
+  struct Piece {
+    const char* data;
+    size_t length;
+    bool escape;
+  };
+
+  Piece pieces[PORTAL_PAGE_PIECES];
+  int count = 0;
+  int current = 0; // Piece being sent
+  size_t offset = 0; // Bytes of the current piece already sent
+  char number[12]; // Batch window as text
+  char targetNumbers[WEBHOOK_TARGETS][4]; // Webhook section titles
+  char channel[4]; // ESP-NOW channel as text
+
+  void add(const char* data, bool escape = false) {
+    if (count < PORTAL_PAGE_PIECES) {
+      pieces[count++] = {data, strlen(data), escape};
+    }
+  }
+
+  // Values go in attributes and textareas, escape anything that could end them
+  static const char* htmlEntity(char c) {
+    switch (c) {
+      case '&': return "&amp;";
+      case '<': return "&lt;";
+      case '>': return "&gt;";
+      case '\'': return "&#39;";
+      case '"': return "&quot;";
+      default: return nullptr;
+    }
+  }
+
+  size_t fill(uint8_t* buffer, size_t maxLength) {
+    size_t length = 0;
+    while (current < count && length < maxLength) {
+      const Piece& piece = pieces[current];
+      if (!piece.escape) {
+        size_t size = min(piece.length - offset, maxLength - length);
+        memcpy(buffer + length, piece.data + offset, size);
+        length += size;
+        offset += size;
+      } else {
+        while (offset < piece.length) {
+          const char* entity = htmlEntity(piece.data[offset]);
+          size_t size = entity != nullptr ? strlen(entity) : 1;
+          if (length + size > maxLength) {
+            return length; // Continues in the next buffer
+          }
+          memcpy(buffer + length, entity != nullptr ? entity : piece.data + offset, size);
+          length += size;
+          offset++;
+        }
+      }
+      if (offset == piece.length) {
+        current++;
+        offset = 0;
+      }
+    }
+    return length;
+  }
+};
+
+void handleRoot(AsyncWebServerRequest* request) {
+  // Update activity time when user accesses the configuration page
+  lastActivityTime = millis();
+
+  // The values stay valid while the page is sent: they only change when the configuration
+  // is saved, and then the device restarts
+  auto page = std::make_shared<PortalPageStream>();
+  page->add(PORTAL_PAGE_HEAD);
+  page->add(config.networks[0].ssid, true);
+  page->add(PORTAL_PAGE_AFTER_SSID);
+  page->add(config.networks[0].password, true);
+  page->add(PORTAL_PAGE_AFTER_PASSWORD);
+  for (int i = 1; i < WIFI_NETWORKS; i++) {
+    page->add(PORTAL_PAGE_NETWORK_START);
+    page->add(config.networks[i].ssid, true);
+    page->add(PORTAL_PAGE_NETWORK_AFTER_SSID);
+    page->add(config.networks[i].password, true);
+    page->add(PORTAL_PAGE_NETWORK_END);
+  }
+  page->add(PORTAL_PAGE_AFTER_NETWORKS);
+  page->add(config.trigger.transport == TRANSPORT_WEBHOOK ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_TRANSPORT_WEBHOOK);
+  page->add(config.trigger.transport == TRANSPORT_UDP ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_TRANSPORT_UDP);
+  page->add(config.trigger.transport == TRANSPORT_ESPNOW ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_TRANSPORT_ESPNOW);
+  page->add(config.trigger.transport == TRANSPORT_MQTT ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_TRANSPORT_MQTT);
+  page->add(config.trigger.gateway, true);
+  page->add(PORTAL_PAGE_AFTER_GATEWAY);
+  snprintf(page->channel, sizeof(page->channel), "%u", config.trigger.channel);
+  page->add(page->channel);
+  page->add(PORTAL_PAGE_AFTER_CHANNEL);
+  page->add(config.trigger.key, true);
+  page->add(PORTAL_PAGE_AFTER_KEY);
+  page->add(config.mqtt.broker, true);
+  page->add(PORTAL_PAGE_AFTER_MQTT_BROKER);
+  page->add(config.mqtt.topic, true);
+  page->add(PORTAL_PAGE_AFTER_MQTT_TOPIC);
+  page->add(config.mqtt.username, true);
+  page->add(PORTAL_PAGE_AFTER_MQTT_USERNAME);
+  page->add(config.mqtt.password, true);
+  page->add(PORTAL_PAGE_AFTER_MQTT_PASSWORD);
+  page->add(!config.mqtt.validateCertificate ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_MQTT_VALIDATE_OFF);
+  page->add(config.mqtt.validateCertificate ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_MQTT_VALIDATE_ON);
+  page->add(!config.webhookBatching ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_BATCH_OFF);
+  page->add(config.webhookBatching ? " selected" : "");
+  page->add(PORTAL_PAGE_AFTER_BATCH_ON);
+  snprintf(page->number, sizeof(page->number), "%lu", (unsigned long)config.batchWindow);
+  page->add(page->number);
+  page->add(PORTAL_PAGE_AFTER_BATCH_WINDOW);
+  page->add(tlsCertificate.c_str(), true);
+  page->add(PORTAL_PAGE_AFTER_CERTIFICATE);
+  for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+    const WebhookTarget& webhook = config.webhooks[i];
+    page->add(PORTAL_PAGE_WEBHOOK_START);
+    snprintf(page->targetNumbers[i], sizeof(page->targetNumbers[i]), "%d", i + 1);
+    page->add(page->targetNumbers[i]);
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_NUMBER);
+    page->add(webhook.url, true);
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_URL);
+    page->add(strcmp(webhook.method, "GET") == 0 ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_GET);
+    page->add(strcmp(webhook.method, "POST") == 0 ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_POST);
+    uint8_t gestures = config.webhookGestures[i];
+    page->add(gestures == 0 ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_ANY);
+    page->add(gestures == 1 << GESTURE_SINGLE ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_SINGLE);
+    page->add(gestures == 1 << GESTURE_DOUBLE ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_DOUBLE);
+    page->add(gestures == 1 << GESTURE_LONG ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_GESTURE_LONG);
+    page->add(webhookHeaders[i].c_str(), true);
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_HEADERS);
+    page->add(webhook.payload, true);
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_PAYLOAD);
+    page->add(!webhook.validateCertificate ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_AFTER_VALIDATE_OFF);
+    page->add(webhook.validateCertificate ? " selected" : "");
+    page->add(PORTAL_PAGE_WEBHOOK_END);
+  }
+  page->add(PORTAL_PAGE_TAIL);
+
+  request->send(request->beginChunkedResponse("text/html", [page](uint8_t* buffer, size_t maxLength, size_t index) {
+    return page->fill(buffer, maxLength);
+  }));
+}
+
+// Form fields that were left out read as empty. The webhook sections repeat their field
+// names, occurrence picks the section (the form sends them in order)
+String formValue(AsyncWebServerRequest* request, const char* name, int occurrence = 0) {
+  for (size_t i = 0; i < request->params(); i++) {
+    const AsyncWebParameter* parameter = request->getParam(i);
+    if (parameter->isPost() && parameter->name() == name && occurrence-- == 0) {
+      return parameter->value();
+    }
+  }
+  return String();
+}
+
+void handleSave(AsyncWebServerRequest* request) {
+  // Update activity time when user submits form
+  lastActivityTime = millis();
+  
+  if (request->hasParam("ssid", true) && request->hasParam("password", true) && request->hasParam("webhook", true)) {
+    // Get form values, trimmed to prevent connection issues. They go into a copy, so a
+    // rejected form leaves the running (and saved) configuration as it was. Static, the
+    // configuration is too big for the stack of the web server task
+    static DeviceConfig edited;
+    edited = config;
+    String headers[WEBHOOK_TARGETS];
+    for (int i = 0; i < WIFI_NETWORKS; i++) {
+      WifiNetwork& network = edited.networks[i];
+      String ssid = i == 0 ? formValue(request, "ssid") : formValue(request, "network_ssid", i - 1);
+      String password = i == 0 ? formValue(request, "password") : formValue(request, "network_password", i - 1);
+      if (!setConfigString(network.ssid, sizeof(network.ssid), ssid) ||
+          !setConfigString(network.password, sizeof(network.password), password)) {
+        request->send(400, "text/plain", "A field is too long");
+        return;
+      }
+    }
+    for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+      WebhookTarget& webhook = edited.webhooks[i];
+      if (!setConfigString(webhook.url, sizeof(webhook.url), formValue(request, "webhook", i)) ||
+          !setConfigString(webhook.method, sizeof(webhook.method), formValue(request, "webhook_method", i)) ||
+          !setConfigString(webhook.payload, sizeof(webhook.payload), formValue(request, "webhook_payload", i))) {
+        request->send(400, "text/plain", "A field is too long");
+        return;
+      }
+      if (webhook.method[0] == '\0') {
+        strcpy(webhook.method, "GET");
+      }
+      webhook.validateCertificate = formValue(request, "webhook_validate", i) == "1";
+      edited.webhookGestures[i] = formValue(request, "webhook_gesture", i).toInt() & ((1 << GESTURE_COUNT) - 1);
+      headers[i] = formValue(request, "webhook_headers", i);
+      headers[i].trim();
+      
+      if (!parseWebhookHeaders(headers[i].c_str(), webhook.headers)) {
+        LOG_INFOF("Webhook %d: too many or too long headers, only the first %d were kept\n", i + 1, webhook.headers.count);
+      }
+    }
+    edited.webhookBatching = formValue(request, "webhook_batch") == "1";
+    edited.batchWindow = max(0L, formValue(request, "batch_window").toInt());
+
+    TriggerConfig& trigger = edited.trigger;
+    long transport = formValue(request, "trigger_transport").toInt();
+    trigger.transport = transport == TRANSPORT_UDP || transport == TRANSPORT_ESPNOW || transport == TRANSPORT_MQTT
+                            ? transport : TRANSPORT_WEBHOOK;
+    trigger.channel = constrain(formValue(request, "trigger_channel").toInt(), 0L, 14L);
+    if (!setConfigString(trigger.gateway, sizeof(trigger.gateway), formValue(request, "trigger_gateway")) ||
+        !setConfigString(trigger.key, sizeof(trigger.key), formValue(request, "trigger_key"))) {
+      request->send(400, "text/plain", "A field is too long");
+      return;
+    }
+    if (trigger.transport == TRANSPORT_UDP || trigger.transport == TRANSPORT_ESPNOW) {
+      char host[CONFIG_GATEWAY_SIZE];
+      uint16_t port;
+      uint8_t mac[6];
+      bool validGateway = trigger.transport == TRANSPORT_UDP ? parseUdpGateway(trigger.gateway, host, sizeof(host), port)
+                                                             : parseMacAddress(trigger.gateway, mac);
+      if (!validGateway) {
+        request->send(400, "text/plain", "Invalid gateway address");
+        return;
+      }
+      if (trigger.key[0] == '\0') {
+        request->send(400, "text/plain", "The gateway needs a shared key");
+        return;
+      }
+    }
+
+    MqttConfig& mqtt = edited.mqtt;
+    if (!setConfigString(mqtt.broker, sizeof(mqtt.broker), formValue(request, "mqtt_broker")) ||
+        !setConfigString(mqtt.topic, sizeof(mqtt.topic), formValue(request, "mqtt_topic")) ||
+        !setConfigString(mqtt.username, sizeof(mqtt.username), formValue(request, "mqtt_username")) ||
+        !setConfigString(mqtt.password, sizeof(mqtt.password), formValue(request, "mqtt_password"))) {
+      request->send(400, "text/plain", "A field is too long");
+      return;
+    }
+    mqtt.validateCertificate = formValue(request, "mqtt_validate") == "1";
+    if (trigger.transport == TRANSPORT_MQTT) {
+      char host[CONFIG_URL_SIZE];
+      uint16_t port;
+      bool secure;
+      if (!parseMqttBroker(mqtt.broker, host, sizeof(host), port, secure)) {
+        request->send(400, "text/plain", "Invalid MQTT broker");
+        return;
+      }
+      if (mqtt.topic[0] == '\0') {
+        request->send(400, "text/plain", "The MQTT topic is missing");
+        return;
+      }
+    }
+    String certificate = formValue(request, "tls_cert");
+    certificate.trim();
+    if (certificate.length() >= CONFIG_CERTIFICATE_SIZE) {
+      request->send(400, "text/plain", "A field is too long");
+      return;
+    }
+    
+    // Save to preferences, all at once
+    if (!saveDeviceConfig(preferences, edited)) {
+      request->send(500, "text/plain", "Could not save the configuration");
+      return;
+    }
+    config = edited;
+    for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+      webhookHeaders[i] = headers[i];
+      preferences.putString(webhookHeadersKey(i), webhookHeaders[i]);
+    }
+    tlsCertificate = certificate;
+    preferences.putString(CONFIG_CERTIFICATE_KEY, tlsCertificate);
+    
+    LOG_INFO("New configuration saved:");
+    for (int i = 0; i < WIFI_NETWORKS; i++) {
+      if (config.networks[i].ssid[0] != '\0') {
+        LOG_INFOF("SSID %d: %s\n", i + 1, config.networks[i].ssid);
+        LOG_DEBUGF("Password: '%s'\n", config.networks[i].password); // Print actual password with quotes to see any spaces
+      }
+    }
+    for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+      LOG_INFOF("Webhook %d URL: %s\n", i + 1, config.webhooks[i].url);
+    }
+    
+    request->send(200, "text/html", PORTAL_SAVED_PAGE);
+    configSaved = true;
+    wakeLoop();
+  } else {
+    request->send(400, "text/plain", "Missing required fields");
+  }
+}
+
+// Battery voltage in mV, or -1 without BATTERY_ADC_PIN
+int32_t readBatteryMillivolts() {
+#if BATTERY_ADC_PIN >= 0
+    return analogReadMilliVolts(BATTERY_ADC_PIN) * BATTERY_DIVIDER_RATIO;
+#else
+    return -1;
+#endif
+}
+
+// Waits for presses from dispatchWebhooks() and sends them to the webhook of this worker
+void webhookTask(void* parameter) {
+    WebhookWorker& worker = *(WebhookWorker*)parameter;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        worker.result = sendWebhookRequest(worker);
+        xEventGroupSetBits(webhookDoneEvents, 1 << worker.target);
+    }
+}
+
+// Takes presses from dispatchQueue and sends them, one after the other (all webhooks
+// at once for each of them, see dispatchWebhooks())
+void dispatchTask(void* parameter) {
+    static PressEvent batch[PRESS_RING_SIZE];
+    DispatchItem item;
+    for (;;) {
+        xQueueReceive(dispatchQueue, &item, portMAX_DELAY);
+        int handled = 1;
+
+        if (item.flushBacklog) {
+            flushBacklog();
+        } else if (!config.webhookBatching) {
+            LOG_INFO("Processing pending webhook request");
+            sendPresses(&item.press, 1, false);
+        } else {
+            // Everything that queued up (while the last request was in flight or during
+            // the batch window, counted from the oldest pending press) goes in one request
+            int presses = 0;
+            batch[presses++] = item.press;
+            while (presses < PRESS_RING_SIZE) {
+                unsigned long waited = millis() - batch[0].timestamp;
+                TickType_t wait = waited >= config.batchWindow ? 0 : pdMS_TO_TICKS(config.batchWindow - waited);
+                if (xQueueReceive(dispatchQueue, &item, wait) != pdTRUE) {
+                    break;
+                }
+                handled++;
+                if (item.flushBacklog) {
+                    flushBacklog(); // Older presses, fine to send them first
+                } else {
+                    batch[presses++] = item.press;
+                }
+            }
+            LOG_INFO("Processing batch of " + String(presses) + " presses");
+            sendPresses(batch, presses, true);
+        }
+
+        __atomic_sub_fetch(&pendingDispatch, handled, __ATOMIC_RELEASE);
+        wakeLoop();
+    }
+}
+
+// Called from loop() only. Returns false if the queue is full
+bool queueDispatch(const DispatchItem& item) {
+    if (dispatchQueue == nullptr) {
+        return false;
+    }
+    // Counted before queueing, so the dispatcher never sees an item that isn't
+    __atomic_add_fetch(&pendingDispatch, 1, __ATOMIC_RELAXED);
+    if (xQueueSend(dispatchQueue, &item, 0) != pdTRUE) {
+        __atomic_sub_fetch(&pendingDispatch, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+// True when every queued press was delivered or moved to the backlog
+bool dispatchIdle() {
+    return __atomic_load_n(&pendingDispatch, __ATOMIC_ACQUIRE) == 0;
+}
+
+void setupDispatcher() {
+    dispatchQueue = xQueueCreate(PRESS_RING_SIZE, sizeof(DispatchItem));
+    if (dispatchQueue == nullptr ||
+        xTaskCreate(dispatchTask, "dispatch", DISPATCH_TASK_STACK, nullptr, 1, nullptr) != pdPASS) {
+        LOG_ERROR("Could not start the dispatcher task, presses won't be sent");
+        if (dispatchQueue != nullptr) {
+            vQueueDelete(dispatchQueue);
+            dispatchQueue = nullptr;
+        }
+    }
+}
+
+// Publishes go out from the dispatcher task itself, there is only one broker
+void setupMqtt() {
+    char host[CONFIG_URL_SIZE];
+    uint16_t port;
+    bool secure;
+    if (!parseMqttBroker(config.mqtt.broker, host, sizeof(host), port, secure)) {
+        LOG_ERRORF("Invalid MQTT broker: %s, presses won't be sent\n", config.mqtt.broker);
+        return;
+    }
+
+    WiFiClient* client = &mqttPlainClient;
+    if (secure) {
+        mqttSecureClient.setSessionCache(&tlsSessionCache);
+        if (config.mqtt.validateCertificate) {
+            String certificate = preferences.getString(CONFIG_CERTIFICATE_KEY, "");
+            if (certificate.length() == 0 || !mqttSecureClient.setPinnedCertificate(certificate.c_str())) {
+                LOG_ERROR("MQTT: no valid certificate to pin, broker certificate will not be validated");
+            }
+        }
+        client = &mqttSecureClient;
+    }
+    mqttPublisher.begin(&config.mqtt, &mqttSession, client);
+    activeTargets = 1;
+}
+
+// Starts a task for each webhook that has a URL
+void setupWebhookWorkers() {
+    webhookDoneEvents = xEventGroupCreate();
+    bool sessionCacheUsed = false;
+    String certificate; // Only read if some webhook validates it
+
+    for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+        const WebhookTarget& webhook = config.webhooks[i];
+        if (webhook.url[0] == '\0') {
+            continue;
+        }
+
+        WebhookWorker& worker = webhookWorkers[i];
+        worker.target = i;
+        if (!parseWebhookUrl(webhook.url, worker.url)) {
+            LOG_ERRORF("Webhook %d: invalid URL %s, it won't be called\n", i + 1, webhook.url);
+            continue;
+        }
+        if (!compilePayloadTemplate(webhook.payload, worker.payloadTemplate)) {
+            LOG_ERRORF("Webhook %d: too many placeholders in the payload, the last ones are sent as they are\n", i + 1);
+        }
+        if (worker.url.secure && !sessionCacheUsed) {
+            worker.secureClient.setSessionCache(&tlsSessionCache);
+            sessionCacheUsed = true;
+        }
+        if (webhook.validateCertificate) {
+            if (certificate.length() == 0) {
+                certificate = preferences.getString(CONFIG_CERTIFICATE_KEY, "");
+            }
+            if (certificate.length() == 0 || !worker.secureClient.setPinnedCertificate(certificate.c_str())) {
+                LOG_ERRORF("Webhook %d: no valid certificate to pin, server certificate will not be validated\n", i + 1);
+            }
+        }
+
+        if (xTaskCreate(webhookTask, "webhook", WEBHOOK_TASK_STACK, &worker, 1, &worker.task) != pdPASS) {
+            LOG_ERRORF("Webhook %d: could not start its task, it won't be called\n", i + 1);
+            continue;
+        }
+        activeTargets |= 1 << i;
+    }
+
+    if (activeTargets == 0) {
+        LOG_INFO("No webhook URL set, presses won't be sent anywhere");
+    }
+    strlcpy(macAddress, WiFi.macAddress().c_str(), sizeof(macAddress));
+}
+
+// Sends the presses of the worker that its webhook didn't get yet, as a batch (with press
+// count, ages and sequence numbers) if asked to. Runs in the worker task.
+// The request is built in worker.request and written in one go, nothing is allocated.
+// Returns the HTTP response code, or a negative WEBHOOK_ERROR_*
+int sendWebhookRequest(WebhookWorker& worker) {
+    const WebhookTarget& webhook = config.webhooks[worker.target];
+    const PressEvent* presses = worker.presses;
+    int pressCount = worker.pressCount;
+    int target = worker.target;
+
+    if (worker.connectionLost) {
+        worker.connectionLost = false;
+        worker.secureClient.stop();
+        worker.plainClient.stop();
+    }
+    unsigned long requestStart = millis();
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+    uint32_t freeHeap = ESP.getFreeHeap(); // Only logged
+#endif
+
+    LOG_DEBUGF("Webhook %d: preparing to send request to: %s\n", target + 1, webhook.url);
+    // HTTPS goes through secureClient so its TLS session can be resumed on the next press.
+    // It only validates the server if a certificate is pinned
+    WiFiClient& client = worker.url.secure ? (WiFiClient&)worker.secureClient : worker.plainClient;
+
+    bool post = strcasecmp(webhook.method, "POST") == 0;
+    HttpHeader extraHeaders[2];
+    int extraCount = 0;
+#if SEND_BOOT_TRACE
+    if (lastCycleTrace()[0] != '\0') {
+        extraHeaders[extraCount++] = {"X-Grotbot-Trace", lastCycleTrace()};
+    }
+#endif
+    if (metricsSummary[0] != '\0') {
+        extraHeaders[extraCount++] = {"X-Grotbot-Metrics", metricsSummary};
+    }
+    // Headers were parsed when the configuration was saved
+    WebhookRequestParts parts = {post, &worker.url, &webhook.headers, &worker.payloadTemplate, payloadValues,
+                                 presses, pressCount, target, worker.asBatch, millis(), extraHeaders, extraCount};
+    WebhookRequestBuild built;
+    bool tooLong = !buildWebhookRequest(parts, worker.request, sizeof(worker.request), WEBHOOK_HEAD_SIZE,
+                                        worker.payload, sizeof(worker.payload), built);
+    size_t requestLength = built.length;
+    if (built.payloadCut) {
+        LOG_ERRORF("Webhook %d: payload too long, it was cut\n", target + 1);
+    }
+    if (built.batchWithoutPayload) {
+        LOG_ERRORF("Webhook %d: batch too long, sent without the payload\n", target + 1);
+    }
+    if (built.queryCut) {
+        LOG_ERRORF("Webhook %d: batch too long, it was cut\n", target + 1);
+    }
+    if (post) {
+        LOG_DEBUGF("Sending POST request with payload: %.*s\n", (int)built.bodyLength,
+                   worker.request + requestLength - built.bodyLength);
+    } else {
+        LOG_DEBUG("Sending GET request");
+    }
+
+    // Both clients stay connected after a request (HTTP keep-alive) so presses while awake
+    // skip the TCP and TLS setup. If the server closed the kept-alive connection in the
+    // meantime, the first attempt fails and we retry once with a new connection. Only if
+    // the server can't have seen the request: writing it failed, or the connection closed
+    // without a byte of response. A timeout or a cut response isn't retried, the server
+    // may already have the press
+    bool reusingConnection = client.connected();
+    bool reusable = false;
+    int httpResponseCode = WEBHOOK_ERROR_TOO_LONG;
+    for (int attempt = 0; attempt < 2 && !tooLong; attempt++) {
+        if (reusingConnection) {
+            LOG_DEBUGF("Webhook %d: reusing kept-alive connection\n", target + 1);
+        } else if (!client.connect(worker.url.host, worker.url.port, WEBHOOK_CONNECT_TIMEOUT)) {
+            httpResponseCode = WEBHOOK_ERROR_CONNECTION_REFUSED;
+            break;
+        }
+
+        // One write, so a small request goes out in a single segment (and TLS record)
+        if (client.write((const uint8_t*)worker.request, requestLength) != requestLength) {
+            httpResponseCode = WEBHOOK_ERROR_SEND_FAILED;
+        } else {
+            httpResponseCode = readWebhookResponse(client, WEBHOOK_RESPONSE_TIMEOUT, READ_RESPONSE_BODY, reusable,
+                                                   worker.payload, sizeof(worker.payload));
+        }
+
+        if (!reusingConnection ||
+            (httpResponseCode != WEBHOOK_ERROR_SEND_FAILED && httpResponseCode != WEBHOOK_ERROR_NOT_CONNECTED)) {
+            break;
+        }
+        LOG_INFOF("Webhook %d: kept-alive connection was closed, reconnecting\n", target + 1);
+        client.stop();
+        reusingConnection = false;
+    }
+
+    if (httpResponseCode > 0) {
+        traceMark(TRACE_HTTP_RESPONSE);
+        LOG_INFOF("Webhook %d: HTTP response code: %d\n", target + 1, httpResponseCode);
+#if READ_RESPONSE_BODY
+        LOG_DEBUGF("Response: %s\n", worker.payload);
+#endif
+    } else if (tooLong) {
+        LOG_ERRORF("Webhook %d: request headers don't fit in %d bytes, not sent\n", target + 1, WEBHOOK_HEAD_SIZE);
+    } else {
+        LOG_ERRORF("Webhook %d: error on HTTP request. Error code: %d\n", target + 1, httpResponseCode);
+    }
+
+    // Keeps the connection open unless the server asked to close it, or some of the
+    // response is still unread
+    if (!reusable) {
+        client.stop();
+    }
+    LOG_DEBUGF("Webhook %d: %u bytes sent, free heap %lu (%ld since the request started)\n", target + 1,
+               (unsigned)requestLength, (unsigned long)ESP.getFreeHeap(), (long)ESP.getFreeHeap() - (long)freeHeap);
+    metricsCount(METRIC_REQUESTS);
+    metricsObserve(METRIC_REQUEST_MS, millis() - requestStart);
+    if (httpResponseCode <= 0 || httpResponseCode >= 400) {
+        metricsCount(METRIC_REQUEST_ERRORS);
+    }
+    return httpResponseCode;
+}
+
+// Sends the presses to every webhook still missing some of them, all at the same time,
+// and waits for all of them. Runs in the dispatcher task.
+// Returns the webhooks (bit per target) that were reached
+uint8_t dispatchWebhooks(const PressEvent* presses, int pressCount, bool asBatch) {
+    lastActivityTime = millis();
+    if (requestPmLock != nullptr) esp_pm_lock_acquire(requestPmLock);
+
+    payloadValues.rssi = WiFi.RSSI();
+    payloadValues.uptimeMs = millis();
+    payloadValues.mac = macAddress;
+    payloadValues.batteryMv = readBatteryMillivolts();
+    payloadValues.ssid = config.networks[wifiNetwork].ssid;
+    bool reportMetrics = METRICS_EVERY_PRESSES > 0 && nextPressSequence - metricsReportedPresses >= METRICS_EVERY_PRESSES;
+    if (reportMetrics) {
+        snprintf(metricsSummary, sizeof(metricsSummary),
+                 "wakeups=%lu presses=%lu delivered=%lu deferred=%lu dropped=%lu ap_fallbacks=%lu wifi_failures=%lu "
+                 "request_errors=%lu connect_avg_ms=%lu",
+                 (unsigned long)metricsValue(METRIC_WAKEUPS), (unsigned long)nextPressSequence,
+                 (unsigned long)metricsValue(METRIC_PRESSES_DELIVERED), (unsigned long)metricsValue(METRIC_PRESSES_DEFERRED),
+                 (unsigned long)metricsValue(METRIC_PRESSES_DROPPED), (unsigned long)metricsValue(METRIC_AP_FALLBACKS),
+                 (unsigned long)metricsValue(METRIC_WIFI_FAILURES), (unsigned long)metricsValue(METRIC_REQUEST_ERRORS),
+                 (unsigned long)metricsAverage(METRIC_WIFI_CONNECT_MS));
+    }
+
+    EventBits_t dispatched = 0;
+    for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+        if ((activeTargets & (1 << i)) == 0 || countPendingPresses(presses, pressCount, i) == 0) {
+            continue;
+        }
+        WebhookWorker& worker = webhookWorkers[i];
+        worker.presses = presses;
+        worker.pressCount = pressCount;
+        worker.asBatch = asBatch;
+        dispatched |= 1 << i;
+    }
+
+    uint8_t reached = 0;
+    if (dispatched != 0) {
+        xEventGroupClearBits(webhookDoneEvents, dispatched);
+        for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+            if (dispatched & (1 << i)) {
+                xTaskNotifyGive(webhookWorkers[i].task);
+            }
+        }
+        // Each worker has its own timeouts, so this always ends
+        xEventGroupWaitBits(webhookDoneEvents, dispatched, pdTRUE, pdTRUE, portMAX_DELAY);
+        for (int i = 0; i < WEBHOOK_TARGETS; i++) {
+            if ((dispatched & (1 << i)) == 0) {
+                continue;
+            }
+            // 2xx and 3xx (not followed) mean the server took them. 5xx and 429 might work
+            // later, so those presses stay in the backlog. Any other 4xx would be refused
+            // again: they are dropped instead of retried forever
+            int result = webhookWorkers[i].result;
+            if (result >= 400 && result < 500 && result != 429) {
+                LOG_ERRORF("Webhook %d: presses refused with %d, dropping them\n", i + 1, result);
+                reached |= 1 << i;
+            } else if (result >= 200 && result < 400) {
+                reached |= 1 << i;
+            }
+        }
+    }
+    if (reportMetrics) {
+        metricsSummary[0] = '\0';
+        if (reached != 0) {
+            metricsReportedPresses = nextPressSequence;
+        }
+    }
+
+    if (requestPmLock != nullptr) esp_pm_lock_release(requestPmLock);
+    lastActivityTime = millis();
+    return reached;
+}
+
+// Sends the presses that the gateway (target 0) didn't get yet, in messages of up to
+// TRIGGER_MAX_PRESSES. Stops at the first one that isn't acknowledged
+bool sendTrigger(PressEvent* presses, int pressCount) {
+    if (activeTargets == 0) {
+        return false;
+    }
+    lastActivityTime = millis();
+    if (requestPmLock != nullptr) esp_pm_lock_acquire(requestPmLock);
+
+    bool reached = false;
+    bool acknowledged = true;
+    int next = 0;
+    while (acknowledged && next < pressCount) {
+        PressEvent message[TRIGGER_MAX_PRESSES];
+        int indexes[TRIGGER_MAX_PRESSES];
+        int count = 0;
+        for (; next < pressCount && count < TRIGGER_MAX_PRESSES; next++) {
+            if (pressPending(presses[next], 0)) {
+                indexes[count] = next;
+                message[count++] = presses[next];
+            }
+        }
+        if (count == 0) {
+            break;
+        }
+
+        unsigned long requestStart = millis();
+        acknowledged = triggerSender.send(message, count, millis());
+        metricsCount(METRIC_REQUESTS);
+        metricsObserve(METRIC_REQUEST_MS, millis() - requestStart);
+        if (!acknowledged) {
+            metricsCount(METRIC_REQUEST_ERRORS);
+        }
+        if (acknowledged) {
+            traceMark(TRACE_HTTP_RESPONSE);
+            for (int i = 0; i < count; i++) {
+                presses[indexes[i]].delivered |= 1;
+            }
+            reached = true;
+        }
+    }
+    if (acknowledged) {
+        LOG_INFO("Presses acknowledged by the gateway");
+    } else {
+        LOG_ERROR("No ack from the gateway");
+        if (config.trigger.transport == TRANSPORT_ESPNOW) {
+            raiseTxPower("no ack from the bridge");
+        }
+    }
+
+    if (requestPmLock != nullptr) esp_pm_lock_release(requestPmLock);
+    lastActivityTime = millis();
+    return reached;
+}
+
+// Publishes the presses that the broker (target 0) didn't acknowledge yet, up to
+// MQTT_MAX_INFLIGHT at a time. Stops if the broker can't be reached
+bool sendMqtt(PressEvent* presses, int pressCount) {
+    if (activeTargets == 0) {
+        return false;
+    }
+    lastActivityTime = millis();
+    if (requestPmLock != nullptr) esp_pm_lock_acquire(requestPmLock);
+    if (mqttConnectionLost) {
+        mqttConnectionLost = false;
+        mqttPublisher.stop();
+    }
+
+    bool reached = false;
+    bool allAcked = true;
+    int next = 0;
+    while (allAcked && next < pressCount) {
+        PressEvent publish[MQTT_MAX_INFLIGHT];
+        int indexes[MQTT_MAX_INFLIGHT];
+        int count = 0;
+        for (; next < pressCount && count < MQTT_MAX_INFLIGHT; next++) {
+            if (pressPending(presses[next], 0)) {
+                indexes[count] = next;
+                publish[count++] = presses[next];
+            }
+        }
+        if (count == 0) {
+            break;
+        }
+
+        bool acked[MQTT_MAX_INFLIGHT];
+        unsigned long requestStart = millis();
+        allAcked = mqttPublisher.publish(publish, count, millis(), acked);
+        metricsCount(METRIC_REQUESTS);
+        metricsObserve(METRIC_REQUEST_MS, millis() - requestStart);
+        if (!allAcked) {
+            metricsCount(METRIC_REQUEST_ERRORS);
+        }
+        for (int i = 0; i < count; i++) {
+            if (acked[i]) {
+                traceMark(TRACE_HTTP_RESPONSE);
+                presses[indexes[i]].delivered |= 1;
+                reached = true;
+            }
+        }
+    }
+    if (allAcked) {
+        LOG_INFO("Presses acknowledged by the MQTT broker");
+    } else {
+        LOG_ERROR("Not every press was acknowledged by the MQTT broker");
+    }
+
+    if (requestPmLock != nullptr) esp_pm_lock_release(requestPmLock);
+    lastActivityTime = millis();
+    return reached;
+}
+
+// Sends the presses to every target still missing them, and marks them as delivered to the
+// ones that were reached. Returns false if no new target got them
+bool deliverPresses(PressEvent* presses, int pressCount, bool asBatch) {
+    if (config.trigger.transport == TRANSPORT_MQTT) {
+        return sendMqtt(presses, pressCount);
+    }
+    if (config.trigger.transport != TRANSPORT_WEBHOOK) {
+        return sendTrigger(presses, pressCount);
+    }
+
+    uint8_t reached = dispatchWebhooks(presses, pressCount, asBatch);
+    for (int i = 0; i < pressCount; i++) {
+        presses[i].delivered |= reached;
+    }
+    return reached != 0;
+}
+
+// True if some target is still missing some of the presses
+bool hasUndelivered(const PressEvent* presses, int pressCount) {
+    for (int i = 0; i < pressCount; i++) {
+        if (activeTargets & ~presses[i].delivered) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// One line per press that reached every target, for measuring latency from the serial log.
+// A press made while already connected is an "awake" one, the others waited for the link
+void logPressLatency(const PressEvent* presses, int pressCount) {
+    unsigned long now = millis();
+    bool delivered = false;
+    for (int i = 0; i < pressCount; i++) {
+        if (activeTargets & ~presses[i].delivered) {
+            continue;
+        }
+        delivered = true;
+        bool awake = linkMode != nullptr && (long)(presses[i].timestamp - linkReadyTime) >= 0;
+        LOG_INFOF("Latency: seq=%lu ms=%lu conn=%s\n", (unsigned long)presses[i].sequence,
+                  now - presses[i].timestamp, awake ? "awake" : linkMode);
+        metricsCount(METRIC_PRESSES_DELIVERED);
+        metricsObserve(METRIC_PRESS_LATENCY_MS, now - presses[i].timestamp);
+        if (benchCycle) {
+            benchRecordPress(awake ? "awake" : linkMode, now - presses[i].timestamp);
+        }
+    }
+    if (LATENCY_SIGNAL_PIN >= 0 && delivered) {
+        digitalWrite(LATENCY_SIGNAL_PIN, LOW);
+    }
+}
+
+// Sends presses taken from pressRing. Presses that some target couldn't get go to the
+// backlog, to be delivered (only to the targets missing them) after the next wake-up
+void sendPresses(PressEvent* presses, int pressCount, bool asBatch) {
+    deliverPresses(presses, pressCount, asBatch);
+    logPressLatency(presses, pressCount);
+    if (!hasUndelivered(presses, pressCount)) {
+        pressesDelivered = true;
+        return;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < pressCount; i++) {
+        if (activeTargets & ~presses[i].delivered) {
+            backlogAdd(presses[i]);
+            kept++;
+        }
+    }
+    metricsCount(METRIC_PRESSES_DEFERRED, kept);
+    // Already failed once, leave the rest for the next wake-up
+    backlogFlushAttempted = true;
+    LOG_INFOF("Webhook unreachable, %d presses kept for later delivery\n", kept);
+}
+
+// Deliver all presses from previous wake-ups in a single batch request per webhook
+void flushBacklog() {
+    static PressEvent backlog[BACKLOG_MAX_PRESSES];
+    int pressCount = backlogLoad(backlog, BACKLOG_MAX_PRESSES);
+    backlogFlushAttempted = true;
+    LOG_INFOF("Delivering %d presses from previous wake-ups\n", pressCount);
+
+    if (!deliverPresses(backlog, pressCount, true)) {
+        // Nothing changed, keep the backlog as it is
+        return;
+    }
+
+    // Only keep the presses that some target still misses
+    int kept = 0;
+    for (int i = 0; i < pressCount; i++) {
+        if (activeTargets & ~backlog[i].delivered) {
+            backlog[kept++] = backlog[i];
+        } else {
+            metricsCount(METRIC_PRESSES_DELIVERED);
+        }
+    }
+    backlogReplace(backlog, kept);
+    if (kept == 0) {
+        offlineRetryDelay = 0;
+        pressesDelivered = true;
+        return;
+    }
+    LOG_INFOF("%d presses still missing some webhook, kept for later delivery\n", kept);
+}
+
+// Move presses that were not sent yet to the backlog, before their RAM is lost in deep sleep
+void deferPendingPresses() {
+    PressEvent press;
+    int deferred = 0;
+    while (pressRing.pop(press)) {
+        backlogAdd(press);
+        deferred++;
+    }
+    if (deferred > 0) {
+        LOG_INFOF("%d presses kept for later delivery\n", deferred);
+        metricsCount(METRIC_PRESSES_DEFERRED, deferred);
+    }
+}
+
+
+void goToSleep() {
+  // Let the dispatcher finish what it was given: its presses are either delivered or
+  // moved to the backlog. Requests time out on their own
+  while (!dispatchIdle()) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOOP_INTERVAL));
+  }
+  // A download is dropped, it starts over on a later wake-up. The manifest request times out on its own
+  otaCancel = true;
+  while (otaRunning) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOOP_INTERVAL));
+  }
+  deferPendingPresses();
+  countDroppedPresses();
+  traceEnd();
+
+  // A new firmware that could neither deliver a press nor reach the update server goes back
+  // to the previous one. Its boot after deep sleep would do that anyway, with the RTC memory
+  // of this firmware. Both firmwares are started with a restart, which clears RTC memory
+  if (firmwarePendingVerify()) {
+    backlogPersist();
+    firmwareRollBack();
+  }
+  if (otaReadyVersion[0] != '\0' && installFirmware(otaReadyVersion)) {
+    backlogPersist();
+    LOG_INFOF("Restarting into firmware %s\n", otaReadyVersion);
+    LOG_FLUSH();
+    esp_restart();
+  }
+
+  // Undelivered presses: wake up with a timer to retry, backing off while it keeps failing
+  if (backlogSize() > 0) {
+    offlineRetryDelay = offlineRetryDelay == 0 ? OFFLINE_RETRY_BASE : min(offlineRetryDelay * 2, (uint32_t)OFFLINE_RETRY_MAX);
+    esp_sleep_enable_timer_wakeup((uint64_t)offlineRetryDelay * 1000);
+    LOG_INFOF("Going to deep sleep with %u undelivered presses, retrying in %u s\n",
+                  backlogSize(), offlineRetryDelay / 1000);
+  } else {
+    offlineRetryDelay = 0;
+    LOG_INFO("Going to deep sleep. Can be woken by button press only");
+  }
+  // Latency benchmark: the next cycle starts with a timer wake-up. After the last one this
+  // prints the summary instead, and doesn't return
+  if (LATENCY_BENCH_CYCLES > 0 && benchRunning()) {
+    uint32_t sleepTime = benchEndCycle(benchCycle, esp_timer_get_time() / 1000, transportName(config.trigger.transport));
+    esp_sleep_enable_timer_wakeup((uint64_t)sleepTime * 1000);
+  }
+
+  LOG_DEBUG("Current button state before sleep: " + String(digitalRead(BUTTON_PIN) == HIGH ? "HIGH (not pressed)" : "LOW (pressed)"));
+  
+  // Detach interrupt before going to sleep to avoid any potential conflicts
+  buttonEnd();
+  LOG_DEBUG("Interrupt detached before sleep");
+  
+  // Configure GPIO for wake-up again right before sleep
+  esp_err_t result = esp_deep_sleep_enable_gpio_wakeup(1ULL << BUTTON_PIN, ESP_GPIO_WAKEUP_GPIO_LOW);
+  if (result == ESP_OK) {
+    LOG_DEBUG("Deep sleep wake-up reconfigured before sleep");
+  } else {
+    LOG_ERRORF("Failed to reconfigure wake-up, error: %d\n", result);
+  }
+  
+  LOG_DEBUG("Entering deep sleep...");
+  LOG_FLUSH(); // Make sure all serial data is sent before sleep
+  LOG_DELAY(1000);
+  esp_deep_sleep_start();
+}
+
+// Not with ESP-NOW (no network), on timer wake-ups (need to sleep again soon) or when an
+// update is already waiting. A new firmware checks on its first boot, which confirms it
+void setupFirmwareUpdate() {
+  if (otaWakesSinceCheck < OTA_CHECK_EVERY_WAKES) {
+    otaWakesSinceCheck++;
+  }
+  if (OTA_MANIFEST_URL[0] == '\0') {
+    firmwareMarkValid(); // Updates were turned off, nothing to prove
+    return;
+  }
+  if (wokenForRetry || benchCycle || otaReadyVersion[0] != '\0') {
+    return;
+  }
+  if (otaWakesSinceCheck < OTA_CHECK_EVERY_WAKES && !firmwarePendingVerify()) {
+    return;
+  }
+  if (!parseWebhookUrl(OTA_MANIFEST_URL, otaUrl) || (!otaUrl.secure && !OTA_ALLOW_INSECURE)) {
+    LOG_ERROR("Firmware update: OTA_MANIFEST_URL must be a valid https URL, not checking for updates");
+    return;
+  }
+  otaDue = true;
+}
+
+// Only one of them can run at a time, so presses get the connection to themselves
+bool firmwareDownloadPaused() {
+  return !dispatchIdle() || pressRing.size() > 0;
+}
+
+void firmwareUpdateTask(void*) {
+  WiFiClient& client = otaUrl.secure ? otaSecureClient : otaPlainClient;
+  FirmwareManifest manifest;
+  bool valid = false;
+  WebhookUrl imageUrl;
+
+  int result = fetchFirmwareManifest(client, otaUrl, OTA_TIMEOUT, manifest, valid);
+  if (result != 200 || !valid) {
+    LOG_ERRORF("Firmware update: manifest request failed (%d%s)\n", result, result == 200 ? ", invalid manifest" : "");
+  } else {
+    // Reaching the update server is also what a new firmware has to prove
+    firmwareMarkValid();
+    if (strcmp(manifest.version, FIRMWARE_VERSION) == 0) {
+      LOG_INFO("Firmware update: up to date");
+    } else if (firmwareRejected(manifest.version)) {
+      LOG_INFOF("Firmware update: %s was rolled back before, not installing it again\n", manifest.version);
+    } else if (!parseWebhookUrl(manifest.url, imageUrl) || (!imageUrl.secure && !OTA_ALLOW_INSECURE)) {
+      LOG_ERRORF("Firmware update: invalid image URL %s\n", manifest.url);
+    } else {
+      WiFiClient& imageClient = imageUrl.secure ? otaSecureClient : otaPlainClient;
+      if (&imageClient != &client || imageUrl.port != otaUrl.port || strcmp(imageUrl.host, otaUrl.host) != 0) {
+        client.stop();
+      }
+      LOG_INFOF("Firmware update: downloading %s (%u bytes)\n", manifest.version, manifest.size);
+      unsigned long start = millis();
+      result = downloadFirmware(imageClient, imageUrl, manifest, OTA_TIMEOUT, start + OTA_DOWNLOAD_TIMEOUT,
+                                firmwareDownloadPaused, &otaCancel);
+      if (result == 0) {
+        strlcpy(otaReadyVersion, manifest.version, sizeof(otaReadyVersion));
+        LOG_INFOF("Firmware update: %s ready after %lu ms, installed before the next sleep\n", manifest.version, millis() - start);
+      } else {
+        LOG_ERRORF("Firmware update: download of %s failed (%d)\n", manifest.version, result);
+      }
+    }
+  }
+
+  client.stop();
+  otaRunning = false;
+  wakeLoop();
+  vTaskDelete(nullptr);
+}
+
+void startFirmwareUpdate() {
+  otaDue = false;
+  otaWakesSinceCheck = 0;
+  if (otaUrl.secure) {
+    // Pinned like the webhooks, with the Server Certificate of the portal
+    String certificate = preferences.getString(CONFIG_CERTIFICATE_KEY, "");
+    if ((certificate.length() == 0 || !otaSecureClient.setPinnedCertificate(certificate.c_str())) && !OTA_ALLOW_INSECURE) {
+      LOG_ERROR("Firmware update: no valid certificate to pin, not checking for updates");
+      return;
+    }
+    otaSecureClient.setSessionCache(&tlsSessionCache, false);
+  }
+
+  otaRunning = true;
+  if (xTaskCreate(firmwareUpdateTask, "ota", OTA_TASK_STACK, nullptr, 1, nullptr) != pdPASS) {
+    LOG_ERROR("Firmware update: could not start its task");
+    otaRunning = false;
   }
-  
-  Serial.println("Entering deep sleep in 1 second...");
-  Serial.flush(); // Make sure all serial data is sent before sleep
-  delay(1000);
-  esp_deep_sleep_start();
 }
 
 bool isButtonPressed() {
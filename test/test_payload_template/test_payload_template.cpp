@@ -0,0 +1,195 @@
+#include <unity.h>
+
+#include "PayloadTemplate.h"
+
+static PayloadValues values() {
+  PayloadValues values = {};
+  values.pressCount = 2;
+  values.sequence = 41;
+  values.gesture = "double";
+  values.rssi = -67;
+  values.uptimeMs = 1234;
+  values.mac = "AA:BB:CC:DD:EE:FF";
+  values.batteryMv = 3012;
+  values.ssid = "home";
+  return values;
+}
+
+static PressEvent press(uint32_t sequence, uint32_t timestamp, PressGesture gesture, uint8_t delivered = 0) {
+  return {sequence, timestamp, PRESS_SINGLE, delivered, gesture, false};
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_literal_payload_has_no_fields() {
+  PayloadTemplate payload;
+  TEST_ASSERT_TRUE(compilePayloadTemplate("pressed", payload));
+  TEST_ASSERT_FALSE(payload.hasFields);
+  TEST_ASSERT_FALSE(payload.json);
+
+  char buffer[32];
+  TEST_ASSERT_EQUAL(7, renderPayload(payload, values(), buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL_STRING("pressed", buffer);
+}
+
+static void test_json_detected_after_whitespace() {
+  PayloadTemplate payload;
+  compilePayloadTemplate(" \n [1]", payload);
+  TEST_ASSERT_TRUE(payload.json);
+  compilePayloadTemplate("x{}", payload);
+  TEST_ASSERT_FALSE(payload.json);
+}
+
+static void test_placeholders_are_replaced() {
+  PayloadTemplate payload;
+  TEST_ASSERT_TRUE(compilePayloadTemplate("n={{press_count}}&s={{sequence}}&g={{gesture}}&r={{rssi}}&u={{uptime_ms}}"
+                                          "&m={{mac}}&b={{battery_mv}}&w={{ssid}}",
+                                          payload));
+  TEST_ASSERT_TRUE(payload.hasFields);
+
+  char buffer[128];
+  renderPayload(payload, values(), buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("n=2&s=41&g=double&r=-67&u=1234&m=AA:BB:CC:DD:EE:FF&b=3012&w=home", buffer);
+}
+
+static void test_unknown_placeholders_are_sent_as_they_are() {
+  PayloadTemplate payload;
+  compilePayloadTemplate("{{nope}} {{sequence}} {{ssid", payload);
+  char buffer[64];
+  renderPayload(payload, values(), buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("{{nope}} 41 {{ssid", buffer);
+}
+
+static void test_json_values_are_escaped() {
+  PayloadValues escaped = values();
+  escaped.ssid = "a\"b\\c\n\x01";
+  PayloadTemplate payload;
+  compilePayloadTemplate("{\"ssid\":\"{{ssid}}\"}", payload);
+  char buffer[64];
+  renderPayload(payload, escaped, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("{\"ssid\":\"a\\\"b\\\\c\\n\\u0001\"}", buffer);
+
+  compilePayloadTemplate("ssid={{ssid}}", payload);
+  renderPayload(payload, escaped, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("ssid=a\"b\\c\n\x01", buffer);
+}
+
+static void test_missing_battery() {
+  PayloadValues noBattery = values();
+  noBattery.batteryMv = -1;
+  PayloadTemplate payload;
+  char buffer[32];
+  compilePayloadTemplate("{\"mv\":{{battery_mv}}}", payload);
+  renderPayload(payload, noBattery, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("{\"mv\":null}", buffer);
+  compilePayloadTemplate("mv={{battery_mv}}", payload);
+  renderPayload(payload, noBattery, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("mv=", buffer);
+}
+
+static void test_too_many_placeholders() {
+  char text[PAYLOAD_MAX_SEGMENTS * 16] = "";
+  for (int i = 0; i < PAYLOAD_MAX_SEGMENTS; i++) {
+    strcat(text, "-{{sequence}}");
+  }
+  PayloadTemplate payload;
+  TEST_ASSERT_FALSE(compilePayloadTemplate(text, payload));
+  TEST_ASSERT_TRUE(payload.count <= PAYLOAD_MAX_SEGMENTS);
+
+  // The placeholders that didn't fit are sent as text
+  char buffer[sizeof(text) + 64];
+  renderPayload(payload, values(), buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING_LEN("-41-41", buffer, 6);
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "{{sequence}}"));
+}
+
+static void test_render_overflow_is_cut_and_terminated() {
+  PayloadTemplate payload;
+  compilePayloadTemplate("uptime {{uptime_ms}}", payload);
+  char buffer[10];
+  TEST_ASSERT_EQUAL(-1, renderPayload(payload, values(), buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL_STRING("uptime 12", buffer);
+}
+
+static void test_pending_presses() {
+  PressEvent presses[] = {press(1, 100, GESTURE_SINGLE, 0x02), press(2, 200, GESTURE_LONG),
+                          press(3, 300, GESTURE_DOUBLE, 0x02)};
+  TEST_ASSERT_EQUAL(1, countPendingPresses(presses, 3, 1));
+  TEST_ASSERT_EQUAL(3, countPendingPresses(presses, 3, 0));
+  TEST_ASSERT_EQUAL_PTR(&presses[1], newestPendingPress(presses, 3, 1));
+  TEST_ASSERT_EQUAL_PTR(&presses[2], newestPendingPress(presses, 3, 0));
+  TEST_ASSERT_NULL(newestPendingPress(presses, 1, 1));
+}
+
+static void test_batch_query() {
+  PressEvent presses[] = {press(7, 650, GESTURE_SINGLE), press(8, 900, GESTURE_LONG, 0x01), press(9, 980, GESTURE_LONG)};
+  char buffer[128];
+  TEST_ASSERT_TRUE(renderBatchQuery(presses, 3, 1000, 0, buffer, sizeof(buffer)) > 0);
+  TEST_ASSERT_EQUAL_STRING("press_count=2&press_ages_ms=350,20&press_sequences=7,9&press_gestures=single,long", buffer);
+}
+
+static void test_batch_merged_into_json_object() {
+  PressEvent presses[] = {press(7, 650, GESTURE_SINGLE), press(8, 980, GESTURE_DOUBLE)};
+  char buffer[192];
+  renderBatchPayload(" \n{ \"a\": 1 }\n", presses, 2, 1000, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("{\"press_count\":2,\"press_ages_ms\":[350,20],\"press_sequences\":[7,8],"
+                           "\"press_gestures\":[\"single\",\"double\"],\"a\": 1 }",
+                           buffer);
+
+  renderBatchPayload("{ }", presses, 1, 1000, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING(
+      "{\"press_count\":1,\"press_ages_ms\":[350],\"press_sequences\":[7],\"press_gestures\":[\"single\"]}", buffer);
+}
+
+static void test_batch_wraps_other_payloads() {
+  PressEvent presses[] = {press(7, 650, GESTURE_SINGLE)};
+  char buffer[192];
+  renderBatchPayload("say \"hi\"", presses, 1, 1000, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("{\"press_count\":1,\"press_ages_ms\":[350],\"press_sequences\":[7],"
+                           "\"press_gestures\":[\"single\"],\"payload\":\"say \\\"hi\\\"\"}",
+                           buffer);
+
+  renderBatchPayload("", presses, 1, 1000, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING(
+      "{\"press_count\":1,\"press_ages_ms\":[350],\"press_sequences\":[7],\"press_gestures\":[\"single\"]}", buffer);
+}
+
+// Presses kept across a power cycle have no age to report
+static void test_batch_unknown_ages() {
+  PressEvent presses[] = {press(7, 650, GESTURE_SINGLE), press(8, 980, GESTURE_SINGLE)};
+  presses[0].ageUnknown = true;
+  char buffer[160];
+  renderBatchQuery(presses, 2, 1000, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("press_count=2&press_ages_ms=,20&press_sequences=7,8&press_gestures=single,single", buffer);
+  renderBatchPayload("", presses, 2, 1000, 0, buffer, sizeof(buffer));
+  TEST_ASSERT_EQUAL_STRING("{\"press_count\":2,\"press_ages_ms\":[null,20],\"press_sequences\":[7,8],"
+                           "\"press_gestures\":[\"single\",\"single\"]}",
+                           buffer);
+}
+
+static void test_batch_overflow_sends_nothing() {
+  PressEvent presses[] = {press(7, 650, GESTURE_SINGLE)};
+  char buffer[40];
+  TEST_ASSERT_EQUAL(-1, renderBatchPayload("{\"a\":1}", presses, 1, 1000, 0, buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL_STRING("", buffer);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_literal_payload_has_no_fields);
+  RUN_TEST(test_json_detected_after_whitespace);
+  RUN_TEST(test_placeholders_are_replaced);
+  RUN_TEST(test_unknown_placeholders_are_sent_as_they_are);
+  RUN_TEST(test_json_values_are_escaped);
+  RUN_TEST(test_missing_battery);
+  RUN_TEST(test_too_many_placeholders);
+  RUN_TEST(test_render_overflow_is_cut_and_terminated);
+  RUN_TEST(test_pending_presses);
+  RUN_TEST(test_batch_query);
+  RUN_TEST(test_batch_merged_into_json_object);
+  RUN_TEST(test_batch_wraps_other_payloads);
+  RUN_TEST(test_batch_unknown_ages);
+  RUN_TEST(test_batch_overflow_sends_nothing);
+  return UNITY_END();
+}
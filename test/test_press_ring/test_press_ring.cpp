@@ -0,0 +1,104 @@
+#include <unity.h>
+
+#include <initializer_list>
+#include <thread>
+#include "PressEventRing.h"
+
+static PressEvent press(uint32_t sequence) {
+  return {sequence, sequence * 10, PRESS_SINGLE, 0, GESTURE_SINGLE, false};
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_presses_come_out_in_order() {
+  PressEventRing<4> ring;
+  PressEvent event;
+  TEST_ASSERT_FALSE(ring.peek(event));
+  TEST_ASSERT_FALSE(ring.pop(event));
+
+  TEST_ASSERT_TRUE(ring.push(press(1)));
+  TEST_ASSERT_TRUE(ring.push(press(2)));
+  TEST_ASSERT_EQUAL_UINT32(2, ring.size());
+
+  TEST_ASSERT_TRUE(ring.peek(event));
+  TEST_ASSERT_EQUAL_UINT32(1, event.sequence);
+  TEST_ASSERT_EQUAL_UINT32(2, ring.size()); // peek doesn't take it
+  TEST_ASSERT_TRUE(ring.pop(event));
+  TEST_ASSERT_EQUAL_UINT32(1, event.sequence);
+  TEST_ASSERT_TRUE(ring.pop(event));
+  TEST_ASSERT_EQUAL_UINT32(2, event.sequence);
+  TEST_ASSERT_EQUAL_UINT32(10 * 2, event.timestamp);
+  TEST_ASSERT_EQUAL_UINT32(0, ring.size());
+}
+
+static void test_full_ring_drops_new_presses() {
+  PressEventRing<4> ring;
+  for (uint32_t i = 1; i <= 4; i++) {
+    TEST_ASSERT_TRUE(ring.push(press(i)));
+  }
+  TEST_ASSERT_FALSE(ring.push(press(5)));
+  TEST_ASSERT_FALSE(ring.push(press(6)));
+  TEST_ASSERT_EQUAL_UINT32(2, ring.dropped());
+  TEST_ASSERT_EQUAL_UINT32(4, ring.size());
+
+  // The oldest ones are kept, and there is room again once one is taken
+  PressEvent event;
+  ring.pop(event);
+  TEST_ASSERT_EQUAL_UINT32(1, event.sequence);
+  TEST_ASSERT_TRUE(ring.push(press(7)));
+  for (uint32_t expected : {2u, 3u, 4u, 7u}) {
+    TEST_ASSERT_TRUE(ring.pop(event));
+    TEST_ASSERT_EQUAL_UINT32(expected, event.sequence);
+  }
+}
+
+static void test_indexes_wrap_around() {
+  PressEventRing<2> ring;
+  PressEvent event;
+  for (uint32_t i = 0; i < 1000; i++) {
+    TEST_ASSERT_TRUE(ring.push(press(i)));
+    TEST_ASSERT_TRUE(ring.pop(event));
+    TEST_ASSERT_EQUAL_UINT32(i, event.sequence);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, ring.size());
+  TEST_ASSERT_EQUAL_UINT32(0, ring.dropped());
+}
+
+// One thread pushes (again while the ring is full), one pops, as the button and loop()
+// do: every press comes out once, in order
+static void test_producer_and_consumer_threads() {
+  static PressEventRing<8> ring;
+  const uint32_t presses = 200000;
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < presses; i++) {
+      while (!ring.push(press(i))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  // Keeps taking them after a wrong one, so the producer never waits forever
+  bool inOrder = true;
+  PressEvent event;
+  for (uint32_t received = 0; received < presses;) {
+    if (!ring.pop(event)) {
+      std::this_thread::yield();
+      continue;
+    }
+    inOrder &= event.sequence == received && event.timestamp == received * 10;
+    received++;
+  }
+  producer.join();
+  TEST_ASSERT_TRUE(inOrder);
+  TEST_ASSERT_EQUAL_UINT32(0, ring.size());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_presses_come_out_in_order);
+  RUN_TEST(test_full_ring_drops_new_presses);
+  RUN_TEST(test_indexes_wrap_around);
+  RUN_TEST(test_producer_and_consumer_threads);
+  return UNITY_END();
+}